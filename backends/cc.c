@@ -33,6 +33,36 @@
 
 static filter_code_t **filter_codes;
 
+/* whether the code being generated is for the fast precision mode */
+static gboolean fast_math = FALSE;
+
+/* The library functions ops are implemented with, and their
+   replacements from fastmath.h in the fast precision mode. */
+static struct { const char *name; const char *fast_name; } fast_math_functions[] =
+{
+    { "sin", "fast_sinf" }, { "sinf", "fast_sinf" },
+    { "cos", "fast_cosf" }, { "cosf", "fast_cosf" },
+    { "tan", "fast_tanf" }, { "tanf", "fast_tanf" },
+    { "asin", "fast_asinf" }, { "asinf", "fast_asinf" },
+    { "acos", "fast_acosf" }, { "acosf", "fast_acosf" },
+    { "atan", "fast_atanf" }, { "atanf", "fast_atanf" },
+    { "atan2", "fast_atan2f" }, { "atan2f", "fast_atan2f" },
+    { "exp", "fast_expf" }, { "expf", "fast_expf" },
+    { "log", "fast_logf" }, { "logf", "fast_logf" },
+    { "pow", "fast_powf" }, { "powf", "fast_powf" },
+    { "sqrt", "sqrtf" },
+    { "cexp", "fast_cexpf" }, { "cexpf", "fast_cexpf" },
+    { "clog", "fast_clogf" }, { "clogf", "fast_clogf" },
+    { "cpow", "fast_cpowf" }, { "cpowf", "fast_cpowf" },
+    { "csin", "fast_csinf" }, { "csinf", "fast_csinf" },
+    { "ccos", "fast_ccosf" }, { "ccosf", "fast_ccosf" },
+    { NULL, NULL }
+};
+
+/* the source regions of the profiling counters of the code being
+   generated, or NULL if not profiling */
+static GArray *profile_regions = NULL;
+
 // defined in compiler-types.h
 MAKE_TYPE_C_TYPE_NAME
 
@@ -208,9 +238,18 @@ output_rhs (FILE *out, rhs_t *rhs)
 
 	case RHS_OP :
 	    {
+		const char *name = rhs->v.op.op->name;
 		int i;
 
-		fprintf(out, "%s(", rhs->v.op.op->name);
+		if (fast_math)
+		    for (i = 0; fast_math_functions[i].name != NULL; ++i)
+			if (strcmp(name, fast_math_functions[i].name) == 0)
+			{
+			    name = fast_math_functions[i].fast_name;
+			    break;
+			}
+
+		fprintf(out, "%s(", name);
 		for (i = 0; i < rhs->v.op.op->num_args; ++i)
 		{
 		    if (i > 0)
@@ -263,7 +302,8 @@ output_rhs (FILE *out, rhs_t *rhs)
 		    }
 		    g_assert(i == num_args);
 
-		    fprintf(out, "%s(invocation, args, pools); })", rhs->v.closure.filter->v.native.func_name);
+		    fprintf(out, "CALL_NATIVE_FILTER(\"%s\", %s(invocation, args, pools)); })",
+			    rhs->v.closure.filter->name, rhs->v.closure.filter->v.native.func_name);
 		}
 		else
 		    g_assert_not_reached();
@@ -342,6 +382,30 @@ output_phis (FILE *out, statement_t *phis, int branch, unsigned int slice_flag)
     }
 }
 
+/* Returns the index of the profiling counter for STMT's source
+   region, or -1 if it has none. */
+static int
+profile_region_index (statement_t *stmt)
+{
+    scanner_region_t region;
+    int i;
+
+    if (!compiler_stmt_region(stmt, &region))
+	return -1;
+
+    for (i = 0; i < profile_regions->len; ++i)
+    {
+	scanner_region_t *other = &g_array_index(profile_regions, scanner_region_t, i);
+
+	if (other->start.pos == region.start.pos && other->end.pos == region.end.pos)
+	    return i;
+    }
+
+    g_array_append_val(profile_regions, region);
+
+    return profile_regions->len - 1;
+}
+
 static void
 output_stmts (FILE *out, statement_t *stmt, unsigned int slice_flag)
 {
@@ -359,11 +423,19 @@ output_stmts (FILE *out, statement_t *stmt, unsigned int slice_flag)
 		    break;
 
 		case STMT_ASSIGN :
+		{
+		    int region_index = profile_regions != NULL ? profile_region_index(stmt) : -1;
+
+		    if (region_index >= 0)
+			fputs("{ PROFILE_BEGIN();\n", out);
 		    output_value_name(out, stmt->v.assign.lhs, 0);
 		    fputs(" = ", out);
 		    output_rhs(out, stmt->v.assign.rhs);
 		    fputs(";\n", out);
+		    if (region_index >= 0)
+			fprintf(out, "PROFILE_END(%d); }\n", region_index);
 		    break;
+		}
 
 		case STMT_PHI_ASSIGN :
 		    g_assert_not_reached();
@@ -429,6 +501,16 @@ _output_value_if_needed_code (value_t *value, statement_t *stmt, void *info)
 	output_value_decl(out, value);
 }
 
+/* Only filters that draw random numbers need the draw counter reset
+   for every pixel. */
+static void
+output_pixel_prologue (filter_code_t *code, FILE *out)
+{
+    if (compiler_stmts_use_rand(code->first_stmt))
+	fputs("RAND_BEGIN_PIXEL();\n", out);
+    fputs("POOLS_STATS_BEGIN_PIXEL();\n", out);
+}
+
 static void
 output_permanent_const_code (filter_code_t *code, FILE *out, int const_type)
 {
@@ -439,6 +521,8 @@ output_permanent_const_code (filter_code_t *code, FILE *out, int const_type)
     COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(code->first_stmt, &_output_value_if_needed_code, out, (void*)const_type);
 
     /* code */
+    if (const_type == 0)
+	output_pixel_prologue(code, out);
     compiler_slice_code_for_const(code->first_stmt, const_type);
     output_stmts(out, code->first_stmt, slice_flag);
 }
@@ -447,6 +531,7 @@ static void
 output_all_code (filter_code_t *code, FILE *out)
 {
     COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(code->first_stmt, &_output_value_if_needed_code, out, (void*)CONST_IGNORE);
+    output_pixel_prologue(code, out);
     output_stmts(out, code->first_stmt, SLICE_IGNORE);
 }
 
@@ -588,7 +673,9 @@ compiler_template_processor (mathmap_t *mathmap, const char *directive, const ch
 
 	    g_assert(code->filter == filter);
 
+	    fast_math = mathmap->precision == MATHMAP_PRECISION_FAST;
 	    process_template(mathmap, arg, out, filter_template_processor, code);
+	    fast_math = FALSE;
 	}
     }
     else
@@ -644,6 +731,7 @@ gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_file
     char *c_filename, *o_filename, *so_filename, *log_filename;
     int pid = getpid();
     initfunc_t initfunc;
+    double start_time;
 #ifndef OPENSTEP
     void *initfunc_ptr;
     GModule *module = 0;
@@ -659,33 +747,65 @@ gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_file
 	return 0;
     }
 
+    start_time = mathmap_wall_time();
+
+    if (get_compile_profiling())
+	profile_regions = g_array_new(FALSE, FALSE, sizeof(scanner_region_t));
+
     set_include_path(include_path);
     if (!process_template_file(mathmap, template_filename, out, &compiler_template_processor, 0))
     {
 	sprintf(error_string, _("Could not process template file `%s'"), template_filename);
+	if (profile_regions != NULL)
+	{
+	    g_array_free(profile_regions, TRUE);
+	    profile_regions = NULL;
+	}
 	return 0;
     }
 
     filter_codes = 0;
 
+    if (profile_regions != NULL)
+    {
+	mathmap->profile_regions = g_new(profile_regions_t, 1);
+	mathmap->profile_regions->num_regions = profile_regions->len;
+	mathmap->profile_regions->regions = (scanner_region_t*)g_array_free(profile_regions, FALSE);
+	profile_regions = NULL;
+    }
+
     fclose(out);
 
+    last_compile_timings.codegen = mathmap_wall_time() - start_time;
+    mathmap_trace_end("emit C", "compile", start_time);
+
     o_filename = g_strdup_printf("%s%d_%d.o", TMP_PREFIX, pid, last_mathfunc);
     log_filename = g_strdup_printf("%s%d_%d.log", TMP_PREFIX, pid, last_mathfunc);
 
-    if (exec_cmd(log_filename, "%s %s %s", CGEN_CC, o_filename, c_filename) != 0)
+    start_time = mathmap_wall_time();
+    if (exec_cmd(log_filename, "%s %s %s%s%s%s", CGEN_CC, o_filename, c_filename,
+		 mathmap->precision == MATHMAP_PRECISION_FAST ? " -DMATHMAP_FAST_MATH" : "",
+		 mathmap->profile_regions != NULL ? " -DMATHMAP_PROFILING" : "",
+		 get_pools_statistics() ? " -DMATHMAP_POOLS_STATISTICS" : "") != 0)
     {
 	sprintf(error_string, _("C compiler failed.  See logfile `%s'."), log_filename);
 	return 0;
     }
+    last_compile_timings.cc = mathmap_wall_time() - start_time;
+    mathmap_trace_end("cc", "compile", start_time);
 
     so_filename = g_strdup_printf("%s%d_%d.so", TMP_PREFIX, pid, last_mathfunc);
 
+    start_time = mathmap_wall_time();
     if (exec_cmd(log_filename, "%s %s %s", CGEN_LD, so_filename, o_filename) != 0)
     {
 	sprintf(error_string, _("Linker failed.  See logfile `%s'."), log_filename);
 	return 0;
     }
+    last_compile_timings.link = mathmap_wall_time() - start_time;
+    mathmap_trace_end("ld", "compile", start_time);
+
+    start_time = mathmap_wall_time();
 
 #ifndef OPENSTEP
     module = g_module_open(so_filename, 0);
@@ -741,6 +861,9 @@ gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_file
     }
 #endif
 
+    last_compile_timings.load = mathmap_wall_time() - start_time;
+    mathmap_trace_end("g_module_open", "compile", start_time);
+
 #ifndef DONT_UNLINK_SO
     unlink(so_filename);
 #endif
@@ -0,0 +1,136 @@
+<?php
+
+$mathmap = 'mathmap';
+$size = '512x512';
+$renders = 3;
+$frames = 4;
+$output = null;
+$threshold = 10;
+$compare = false;
+$files = array();
+
+for ($i = 1; $i < count($argv); $i++) {
+	$arg = $argv[$i];
+	if (preg_match('!^--(mathmap|size|renders|frames|output|threshold)=(.*)$!', $arg, $m)) {
+		$opt = $m[1];
+		$$opt = $m[2];
+	} else if ($arg == '--compare') {
+		$compare = true;
+	} else {
+		$files[] = $arg;
+	}
+}
+
+$examples_dir = dirname(__FILE__).'/../examples';
+$input_image = dirname(__FILE__).'/../redgreengradient.png';
+
+function compile_time($result) {
+	return $result['parse'] + $result['optimize'] + $result['codegen']
+		+ $result['cc'] + $result['link'] + $result['load']
+		+ (isset($result['specialize']) ? $result['specialize'] : 0);
+}
+
+function load_results($filename) {
+	$results = json_decode(file_get_contents($filename), true);
+	if (! is_array($results))
+		die("Cannot read results from $filename\n");
+	$by_filter = array();
+	foreach ($results as $result)
+		$by_filter[$result['filter']] = $result;
+	return $by_filter;
+}
+
+function regressed($name, $baseline, $current, $higher_is_better, $threshold) {
+	if ($baseline <= 0)
+		return false;
+	$change = ($current - $baseline) / $baseline * 100;
+	if ($higher_is_better)
+		$change = -$change;
+	if ($change <= $threshold)
+		return false;
+	printf("  %s: %.3f -> %.3f (%+.1f%%)\n", $name, $baseline, $current,
+	       $higher_is_better ? -$change : $change);
+	return true;
+}
+
+if ($compare) {
+	if (count($files) != 2)
+		die("Usage: bench-corpus.php --compare <baseline> <results>\n");
+
+	$baseline = load_results($files[0]);
+	$current = load_results($files[1]);
+	$num_regressions = 0;
+
+	foreach ($current as $filter => $result) {
+		if (! isset($baseline[$filter]))
+			continue;
+		$base = $baseline[$filter];
+		if (isset($result['error'])) {
+			if (! isset($base['error'])) {
+				echo "$filter\n  now fails: ".$result['error']."\n";
+				$num_regressions++;
+			}
+			continue;
+		}
+		if (isset($base['error']))
+			continue;
+
+		ob_start();
+		$bad = regressed('compile seconds', compile_time($base), compile_time($result), false, $threshold);
+		$bad = regressed('render Mpix/s', $base['mpix_per_sec'], $result['mpix_per_sec'], true, $threshold) || $bad;
+		$bad = regressed('peak RSS KB', $base['peak_rss_kb'], $result['peak_rss_kb'], false, $threshold) || $bad;
+		$report = ob_get_clean();
+
+		if ($bad) {
+			echo "$filter\n$report";
+			$num_regressions++;
+		}
+	}
+
+	echo "$num_regressions regressions\n";
+	exit($num_regressions > 0 ? 1 : 0);
+}
+
+$list = shell_exec('find '.escapeshellarg($examples_dir)." -type f -name '*.mm' | sort");
+$scripts = explode("\n", $list);
+$results = array();
+$json_file = tempnam(sys_get_temp_dir(), 'mmbench');
+
+foreach ($scripts as $script) {
+	if (! $script)
+		continue;
+
+	$filter = substr($script, strlen($examples_dir) + 1);
+	fwrite(STDERR, "$filter\n");
+
+	$animated = preg_match('!^(Animation|Time)/!', $filter);
+	$com = escapeshellarg($mathmap)
+		.' -f '.escapeshellarg($script)
+		." --size=$size --seed=0 --bench-no-output --bench-render-count=$renders"
+		.' --bench-default-image='.escapeshellarg($input_image)
+		.' --bench-json='.escapeshellarg($json_file)
+		.($animated ? " --frames=$frames bench%d.png" : ' bench.png')
+		.' 2>&1';
+
+	@unlink($json_file);
+	exec($com, $lines, $status);
+
+	$result = null;
+	if ($status == 0)
+		$result = json_decode(file_get_contents($json_file), true);
+	if (! is_array($result))
+		$result = array('error' => trim(implode("\n", $lines)));
+	$result = array_merge(array('filter' => $filter), $result);
+	$results[] = $result;
+	unset($lines);
+}
+
+@unlink($json_file);
+
+$json = json_encode($results);
+if ($output)
+	file_put_contents($output, $json."\n");
+else
+	echo $json."\n";
+
+?>
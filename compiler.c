@@ -45,6 +45,7 @@
 #include "jump.h"
 #include "scanner.h"
 #include "lispreader/pools.h"
+#include "lispreader/lispreader.h"
 #include "opmacros.h"
 
 #include "compiler-internals.h"
@@ -60,6 +61,7 @@ static void init_op (int index, char *name, int num_args, type_prop_t type_prop,
 static int rhs_is_foldable (rhs_t *rhs);
 
 static type_t primary_type (primary_t *primary);
+static int primaries_equal (primary_t *prim1, primary_t *prim2);
 
 #include <complex.h>
 #include <gsl/gsl_vector.h>
@@ -125,6 +127,12 @@ static binding_values_t *binding_values = NULL;
 
 static GHashTable *vector_variables = NULL;
 
+/* The source region of the expression code is currently generated
+   for, and the regions of the statements generated so far, for
+   profiling. */
+static scanner_region_t current_stmt_region;
+static GHashTable *stmt_regions = NULL;
+
 #define STMT_STACK_SIZE            64
 
 static statement_t *stmt_stack[STMT_STACK_SIZE];
@@ -764,6 +772,27 @@ for_each_assign_statement (statement_t *stmts, void (*func) (statement_t *stmt,
 
 #define FOR_EACH_ASSIGN_STATEMENT(stmts,func,...) do { long __clos[] = { __VA_ARGS__ }; for_each_assign_statement((stmts),(func),__clos); } while (0)
 
+static void
+_check_rand_op (statement_t *stmt, void *info)
+{
+    CLOSURE_VAR(gboolean*, uses_rand, 0);
+
+    if (compiler_stmt_is_assign_with_op(stmt, OP_RAND))
+	*uses_rand = TRUE;
+}
+
+/* Whether STMTS draw random numbers, in which case the code of every
+   pixel must start with RAND_BEGIN_PIXEL(). */
+gboolean
+compiler_stmts_use_rand (statement_t *stmts)
+{
+    gboolean uses_rand = FALSE;
+
+    FOR_EACH_ASSIGN_STATEMENT(stmts, &_check_rand_op, &uses_rand);
+
+    return uses_rand;
+}
+
 static void
 _call_func (value_t *value, void *info)
 {
@@ -1172,6 +1201,34 @@ emit_stmt (statement_t *stmt)
     emit_loc = &stmt->next;
 
     record_stmt_def_uses(stmt);
+
+    if (scanner_region_is_valid(current_stmt_region))
+    {
+	scanner_region_t *region = (scanner_region_t*)pools_alloc(&compiler_pools, sizeof(scanner_region_t));
+
+	*region = current_stmt_region;
+	g_hash_table_insert(stmt_regions, stmt, region);
+    }
+}
+
+/* Finds the source region STMT was generated for.  Statements the
+   optimizer creates have no region of their own and take that of the
+   nearest enclosing statement. */
+gboolean
+compiler_stmt_region (statement_t *stmt, scanner_region_t *region)
+{
+    for (; stmt != NULL; stmt = stmt->parent)
+    {
+	scanner_region_t *stmt_region = g_hash_table_lookup(stmt_regions, stmt);
+
+	if (stmt_region != NULL)
+	{
+	    *region = *stmt_region;
+	    return TRUE;
+	}
+    }
+
+    return FALSE;
 }
 
 statement_t**
@@ -1876,8 +1933,12 @@ gen_tree_vector (filter_t *filter, exprtree *tree, compvar_t **dest, gboolean is
 static void
 gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 {
+    scanner_region_t outer_region = current_stmt_region;
     int i;
 
+    if (scanner_region_is_valid(tree->region))
+	current_stmt_region = tree->region;
+
     switch (tree->type)
     {
 	case EXPR_INT_CONST :
@@ -2225,6 +2286,8 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 	default :
 	    g_assert_not_reached();
     }
+
+    current_stmt_region = outer_region;
 }
 
 static binding_values_t*
@@ -2245,6 +2308,10 @@ new_binding_values (int kind, gpointer key, binding_values_t *next, int num_valu
     return bv;
 }
 
+/* Only set while generating code for the main filter of a
+   specialized mathmap. */
+static userval_t *constant_uservals = NULL;
+
 static binding_values_t*
 gen_binding_values_from_userval_infos (userval_info_t *info, binding_values_t *bvs)
 {
@@ -2254,7 +2321,37 @@ gen_binding_values_from_userval_infos (userval_info_t *info, binding_values_t *b
 
 	if (rep != NULL)
 	{
-	    if (info->type == USERVAL_IMAGE)
+	    rhs_t *const_rhs = NULL;
+
+	    if (constant_uservals != NULL)
+	    {
+		userval_t *userval = &constant_uservals[info->index];
+
+		switch (info->type)
+		{
+		    case USERVAL_INT_CONST :
+			const_rhs = make_int_const_rhs(userval->v.int_const);
+			break;
+
+		    case USERVAL_FLOAT_CONST :
+			const_rhs = make_float_const_rhs(userval->v.float_const);
+			break;
+
+		    case USERVAL_BOOL_CONST :
+			const_rhs = make_int_const_rhs(userval->v.bool_const);
+			break;
+
+		    default :
+			break;
+		}
+	    }
+
+	    if (const_rhs != NULL)
+	    {
+		bvs = new_binding_values(BINDING_USERVAL, info, bvs, rep->num_vars, rep->var_type);
+		emit_assign(bvs->values[0], const_rhs);
+	    }
+	    else if (info->type == USERVAL_IMAGE)
 	    {
 		compvar_t *image = make_temporary(TYPE_IMAGE);
 		value_t *resized_image;
@@ -3234,6 +3331,283 @@ analyze_constants (void)
     analyze_least_const_type_directly_used_in(first_stmt);
 }
 
+/*** closure materialization ***/
+
+/* If a closure is sampled several times per pixel, for example by a
+   blur kernel, evaluating it at every sample can be much more
+   expensive than rendering it once per frame and sampling the
+   result.  The cost model below is deliberately crude: the cost of a
+   filter is the number of nodes in its body, with loop bodies
+   weighted by MATERIALIZE_LOOP_ITERATIONS, and a sample from a
+   rendered image costs MATERIALIZE_SAMPLE_COST. */
+
+#define MATERIALIZE_LOOP_ITERATIONS	8
+#define MATERIALIZE_SAMPLE_COST		4
+#define MATERIALIZE_MAX_DEPTH		32
+
+static long
+estimate_exprtree_cost (exprtree *tree)
+{
+    exprtree *sub;
+    long cost = 1;
+
+    switch (tree->type)
+    {
+	case EXPR_INT_CONST :
+	case EXPR_FLOAT_CONST :
+	case EXPR_TUPLE_CONST :
+	case EXPR_VARIABLE :
+	case EXPR_INTERNAL :
+	case EXPR_USERVAL :
+	    return 0;
+
+	case EXPR_TUPLE :
+	    for (sub = tree->val.tuple.elems; sub != 0; sub = sub->next)
+		cost += estimate_exprtree_cost(sub);
+	    return cost;
+
+	case EXPR_SELECT :
+	    cost += estimate_exprtree_cost(tree->val.select.tuple);
+	    for (sub = tree->val.select.subscripts->val.tuple.elems; sub != 0; sub = sub->next)
+		cost += estimate_exprtree_cost(sub);
+	    return cost;
+
+	case EXPR_ASSIGNMENT :
+	    return estimate_exprtree_cost(tree->val.assignment.value);
+
+	case EXPR_SUB_ASSIGNMENT :
+	    cost += estimate_exprtree_cost(tree->val.sub_assignment.value);
+	    for (sub = tree->val.sub_assignment.subscripts->val.tuple.elems; sub != 0; sub = sub->next)
+		cost += estimate_exprtree_cost(sub);
+	    return cost;
+
+	case EXPR_CAST :
+	    return estimate_exprtree_cost(tree->val.cast.tuple);
+
+	case EXPR_FUNC :
+	    for (sub = tree->val.func.args; sub != 0; sub = sub->next)
+		cost += estimate_exprtree_cost(sub);
+	    return cost;
+
+	case EXPR_SEQUENCE :
+	    return estimate_exprtree_cost(tree->val.op.left) + estimate_exprtree_cost(tree->val.op.right);
+
+	case EXPR_IF_THEN :
+	    return cost + estimate_exprtree_cost(tree->val.ifExpr.condition)
+		+ estimate_exprtree_cost(tree->val.ifExpr.consequent);
+
+	case EXPR_IF_THEN_ELSE :
+	    return cost + estimate_exprtree_cost(tree->val.ifExpr.condition)
+		+ MAX(estimate_exprtree_cost(tree->val.ifExpr.consequent),
+		      estimate_exprtree_cost(tree->val.ifExpr.alternative));
+
+	case EXPR_DO_WHILE :
+	case EXPR_WHILE :
+	    return MATERIALIZE_LOOP_ITERATIONS * (cost + estimate_exprtree_cost(tree->val.whileExpr.invariant)
+						  + estimate_exprtree_cost(tree->val.whileExpr.body));
+
+	case EXPR_FILTER_CLOSURE :
+	    for (sub = tree->val.filter_closure.args; sub != 0; sub = sub->next)
+		cost += estimate_exprtree_cost(sub);
+	    return cost;
+
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+static long
+estimate_stmt_executions (statement_t *stmt)
+{
+    long executions = 1;
+
+    for (stmt = stmt->parent; stmt != NULL; stmt = stmt->parent)
+	if (stmt->kind == STMT_WHILE_LOOP)
+	    executions *= MATERIALIZE_LOOP_ITERATIONS;
+
+    return executions;
+}
+
+/* Conservatively checks that value does not depend on x or y, so that
+   a render of it is done once per frame instead of once per pixel. */
+static gboolean
+is_value_xy_invariant (value_t *value, int depth)
+{
+    statement_t *def = value->def;
+    rhs_t *rhs;
+    primary_t *primaries;
+    int num_primaries, i;
+
+    if (depth <= 0 || def == NULL || def->kind != STMT_ASSIGN || def->parent != NULL)
+	return FALSE;
+
+    rhs = def->v.assign.rhs;
+    switch (rhs->kind)
+    {
+	case RHS_INTERNAL :
+	    return (rhs->v.internal->const_type & (CONST_X | CONST_Y)) == (CONST_X | CONST_Y);
+
+	case RHS_FILTER :
+	    return FALSE;
+
+	case RHS_OP :
+	    if (!rhs->v.op.op->is_pure)
+		return FALSE;
+	    break;
+
+	case RHS_CLOSURE :
+	    if (rhs->v.closure.filter->kind == FILTER_NATIVE
+		&& !rhs->v.closure.filter->v.native.is_pure)
+		return FALSE;
+	    break;
+
+	default :
+	    break;
+    }
+
+    primaries = get_rhs_primaries(rhs, &num_primaries);
+    for (i = 0; i < num_primaries; ++i)
+	if (primaries[i].kind == PRIMARY_VALUE
+	    && !is_value_xy_invariant(primaries[i].v.value, depth - 1))
+	    return FALSE;
+
+    return TRUE;
+}
+
+/* Checks that primary is the t of the frame, possibly through
+   copies.  The t of an inlined filter is bound to its t argument,
+   which can be anything. */
+static gboolean
+is_primary_frame_t (filter_t *filter, primary_t *primary, int depth)
+{
+    statement_t *def;
+    rhs_t *rhs;
+
+    if (depth <= 0 || primary->kind != PRIMARY_VALUE)
+	return FALSE;
+
+    def = primary->v.value->def;
+    if (def == NULL || def->kind != STMT_ASSIGN)
+	return FALSE;
+
+    rhs = def->v.assign.rhs;
+    if (rhs->kind == RHS_INTERNAL)
+	return rhs->v.internal == lookup_internal(filter->v.mathmap.internals, "t", TRUE);
+    if (rhs->kind == RHS_PRIMARY)
+	return is_primary_frame_t(filter, &rhs->v.primary, depth - 1);
+    return FALSE;
+}
+
+/* Only samples at the t of the frame can read a render of the
+   closure, because the render is done at that t.  Samples at other
+   times keep evaluating the closure. */
+static gboolean
+is_closure_sample (filter_t *filter, statement_t *stmt, value_t *closure)
+{
+    rhs_t *rhs;
+
+    if (stmt->kind != STMT_ASSIGN)
+	return FALSE;
+
+    rhs = stmt->v.assign.rhs;
+    return rhs->kind == RHS_OP
+	&& compiler_op_index(rhs->v.op.op) == OP_ORIG_VAL
+	&& rhs->v.op.args[2].kind == PRIMARY_VALUE
+	&& rhs->v.op.args[2].v.value == closure
+	&& is_primary_frame_t(filter, &rhs->v.op.args[3], MATERIALIZE_MAX_DEPTH);
+}
+
+static value_t*
+emit_internal_before (filter_t *filter, const char *name, statement_t ***loc, statement_t *parent)
+{
+    internal_t *internal = lookup_internal(filter->v.mathmap.internals, name, TRUE);
+    value_t *lhs = make_lhs(make_temporary(TYPE_INT));
+
+    g_assert(internal != NULL);
+
+    *loc = compiler_emit_stmt_before(make_assign(lhs, compiler_make_internal_rhs(internal)), *loc, parent);
+
+    return lhs;
+}
+
+static gboolean
+materialize_closure_if_profitable (filter_t *filter, statement_t *def)
+{
+    value_t *closure = def->v.assign.lhs;
+    filter_t *closure_filter = def->v.assign.rhs->v.closure.filter;
+    statement_list_t *lst;
+    long samples = 0, cost;
+    statement_t **loc;
+    value_t *width, *height, *rendered;
+
+    for (lst = closure->uses; lst != NULL; lst = lst->next)
+	if (is_closure_sample(filter, lst->stmt, closure))
+	    samples += estimate_stmt_executions(lst->stmt);
+
+    if (samples <= 1)
+	return FALSE;
+
+    cost = estimate_exprtree_cost(closure_filter->v.mathmap.decl->v.filter.body);
+    if ((samples - 1) * cost <= samples * MATERIALIZE_SAMPLE_COST)
+	return FALSE;
+
+    if (!is_value_xy_invariant(closure, MATERIALIZE_MAX_DEPTH))
+	return FALSE;
+
+#ifdef DEBUG_OUTPUT
+    g_print("materializing closure of filter %s (%ld samples, cost %ld)\n", closure_filter->name, samples, cost);
+#endif
+
+    loc = &def->next;
+    width = emit_internal_before(filter, "__renderPixelW", &loc, def->parent);
+    height = emit_internal_before(filter, "__renderPixelH", &loc, def->parent);
+    rendered = make_lhs(make_temporary(TYPE_IMAGE));
+    compiler_emit_stmt_before(make_assign(rendered,
+					  make_op_rhs(OP_RENDER,
+						      make_value_primary(closure),
+						      make_value_primary(width),
+						      make_value_primary(height))),
+			      loc, def->parent);
+
+    lst = closure->uses;
+    while (lst != NULL)
+    {
+	statement_t *stmt = lst->stmt;
+
+	lst = lst->next;
+
+	if (!is_closure_sample(filter, stmt, closure))
+	    continue;
+
+	remove_use(closure, stmt);
+	stmt->v.assign.rhs->v.op.args[2] = make_value_primary(rendered);
+	add_use(rendered, stmt);
+    }
+
+    return TRUE;
+}
+
+static gboolean
+materialize_sampled_closures (filter_t *filter)
+{
+    statement_t *stmt;
+    gboolean changed = FALSE;
+
+    /* Rendering is only hoisted out of the pixel loop if it's
+       pure. */
+    if (!ops[OP_RENDER].is_pure)
+	return FALSE;
+
+    /* Only top-level closures can be rendered once per frame. */
+    for (stmt = first_stmt; stmt != NULL; stmt = stmt->next)
+	if (stmt->kind == STMT_ASSIGN
+	    && stmt->v.assign.rhs->kind == RHS_CLOSURE
+	    && stmt->v.assign.rhs->v.closure.filter->kind == FILTER_MATHMAP)
+	    changed = materialize_closure_if_profitable(filter, stmt) || changed;
+
+    return changed;
+}
+
 /*** closure application ***/
 
 static void
@@ -3460,115 +3834,660 @@ constant_folding (void)
 
 /*** simplification ***/
 
-static void
-simplify_unit (rhs_t **rhsp, float unit, gboolean left, gboolean right, int *changed)
+/* The simplifier is driven by rewrite rules which are written as
+ * lispreader patterns.  A rule has the form
+ *
+ *   (NAME PATTERN REPLACEMENT GUARD ...)
+ *
+ * PATTERN is an operation application.  Its arguments can be numbers,
+ * sub-patterns like #?(any) or #?(number), or again operation
+ * applications or tuples, written as (tuple ...).  Operation names are
+ * looked up case-insensitively.  When matching, values are looked
+ * through to their definitions if those are pure operations or tuples,
+ * so a pattern can span several statements.  Values which are not
+ * looked through only match #?(any).
+ *
+ * The sub-patterns are numbered from left to right and are referred to
+ * as $0, $1, ... in the replacement and the guards.  The REPLACEMENT is
+ * a number, a sub-pattern reference or an operation application or
+ * tuple built from those.  Nested applications are emitted as new
+ * statements before the rewritten one.  A replacement which is a
+ * number or a sub-pattern reference must have the type of the
+ * operation it replaces, so constants are converted to that type and
+ * values of another type keep the rule from applying.
+ *
+ * All the guards must hold for a rule to apply:
+ *
+ *   (= $i N)       $i is a number equal to N
+ *   (!= $i N)      $i is a number not equal to N
+ *   (const $i)     $i is a constant
+ *   (nonconst $i)  $i is not a constant
+ *   (same $i $j)   $i and $j are the same value or equal constants
+ *   (nonneg $i)    $i is known to be neither negative nor -0.0
+ *
+ * Rules for the same operation are tried in the order they are given
+ * here.  A rule must make the code cheaper, otherwise the optimizer
+ * will keep applying it until it times out.  Constant operands created
+ * by a replacement are taken care of by constant folding.
+ */
+static const char *rewrite_rules_source =
+    /* units and zeros */
+    "(add-zero-left (add #?(number) #?(any)) $1 (= $0 0))"
+    "(add-zero-right (add #?(any) #?(number)) $0 (= $1 0))"
+    "(sub-zero (sub #?(any) #?(number)) $0 (= $1 0))"
+    "(sub-self (sub #?(any) #?(any)) 0 (same $0 $1))"
+    "(mul-one-left (mul #?(number) #?(any)) $1 (= $0 1))"
+    "(mul-one-right (mul #?(any) #?(number)) $0 (= $1 1))"
+    "(mul-zero-left (mul #?(number) #?(any)) $0 (= $0 0))"
+    "(mul-zero-right (mul #?(any) #?(number)) $1 (= $1 0))"
+    "(div-one (div #?(any) #?(number)) $0 (= $1 1))"
+    "(pow-one (pow #?(any) #?(number)) $0 (= $1 1))"
+    "(pow-zero (pow #?(any) #?(number)) 1.0 (= $1 0))"
+    "(neg-neg (neg (neg #?(any))) $0)"
+    /* strength reduction */
+    "(mul-minus-one (mul #?(any) #?(number)) (neg $0) (= $1 -1))"
+    "(add-neg (add #?(any) (neg #?(any))) (sub $0 $1))"
+    "(div-const (div #?(any) #?(number)) (mul $0 (div 1.0 $1)) (nonconst $0) (!= $1 0))"
+    "(pow-two (pow #?(any) #?(number)) (mul $0 $0) (= $1 2))"
+    "(pow-three (pow #?(any) #?(number)) (mul (mul $0 $0) $0) (= $1 3))"
+    "(pow-half (pow #?(any) #?(number)) (sqrt $0) (= $1 0.5) (nonneg $0))"
+    "(pow-minus-one (pow #?(any) #?(number)) (div 1.0 $0) (= $1 -1))"
+    "(sqrt-square (mul (sqrt #?(any)) (sqrt #?(any))) $0 (same $0 $1) (nonneg $0))"
+    /* special functions */
+    "(ell-int-f-circular (ell_int_f #?(any) #?(number)) $0 (= $1 0))"
+    "(ell-int-e-circular (ell_int_e #?(any) #?(number)) $0 (= $1 0))"
+    "(ell-int-p-no-characteristic (ell_int_p #?(any) #?(any) #?(number)) (ell_int_f $0 $1) (= $2 0))"
+    /* tuples */
+    "(ell-jac-circular (ell_jac #?(any) #?(number)) (tuple (sin $0) (cos $0) 1.0) (= $1 0))"
+    "(ell-jac-hyperbolic (ell_jac #?(any) #?(number)) (tuple (tanh $0) (div 1.0 (cosh $0)) (div 1.0 (cosh $0))) (= $1 1))";
+
+#define MAX_REWRITE_SUBS	16
+
+typedef struct _rewrite_rule_t
+{
+    char *name;
+    lisp_object_t *pattern;
+    int num_subs;
+    lisp_object_t *replacement;
+    lisp_object_t *guards;
+
+    struct _rewrite_rule_t *next;
+} rewrite_rule_t;
+
+/* indexed by the operation the pattern is an application of */
+static rewrite_rule_t *rewrite_rules[NUM_OPS];
+/* how many levels of definitions we have to look through to match
+   the deepest pattern */
+static int rewrite_look_through_depth = 0;
+
+static pools_t rewrite_pools;
+static allocator_t rewrite_allocator;
+/* maps the lisp objects of the rhs being matched to the primaries
+   they were made from */
+static GHashTable *rewrite_primaries = NULL;
+
+static operation_t*
+lookup_op_by_name (const char *name)
 {
-    rhs_t *rhs = *rhsp;
+    int i;
 
-    if (left && RHS_ARG(0).kind == PRIMARY_CONST && OP_CONST_FLOAT_VAL(0) == unit)
-    {
-	*rhsp = make_primary_rhs(RHS_ARG(1));
-	*changed = 1;
-	return;
-    }
+    for (i = 0; i < NUM_OPS; ++i)
+	if (ops[i].name != NULL && g_ascii_strcasecmp(ops[i].name, name) == 0)
+	    return &ops[i];
 
-    if (right && RHS_ARG(1).kind == PRIMARY_CONST && OP_CONST_FLOAT_VAL(1) == unit)
-    {
-	*rhsp = make_primary_rhs(RHS_ARG(0));
-	*changed = 1;
-	return;
-    }
+    return NULL;
 }
 
-static void
-simplify_zero (rhs_t **rhsp, float zero, int result, gboolean left, gboolean right, int *changed)
+static int
+rewrite_sub_index (lisp_object_t *obj)
 {
-    rhs_t *rhs = *rhsp;
+    char *name;
 
-    if ((left && RHS_ARG(0).kind == PRIMARY_CONST && OP_CONST_FLOAT_VAL(0) == zero)
-	|| (right && RHS_ARG(1).kind == PRIMARY_CONST && OP_CONST_FLOAT_VAL(1) == zero))
-    {
-	if (RHS_ARG(0).const_type == TYPE_INT)
-	    *rhsp = make_int_const_rhs(result);
-	else
-	    *rhsp = make_float_const_rhs(result);
-	*changed = 1;
-    }
+    if (!lisp_symbol_p(obj))
+	return -1;
+
+    name = lisp_symbol(obj);
+    if (name[0] != '$' || !isdigit(name[1]))
+	return -1;
+
+    return atoi(name + 1);
 }
 
-static void
-simplify_rhs (rhs_t **rhsp, int *changed)
+/* replaces the operation names in applications by the real names of
+   the ops, so that we can match with strcmp() */
+static gboolean
+canonicalize_op_names (lisp_object_t *obj)
 {
-    rhs_t *rhs = *rhsp;
+    lisp_object_t *lst;
 
-    if (rhs->kind != RHS_OP)
-	return;
+    if (!lisp_cons_p(obj))
+	return TRUE;
 
-    switch (compiler_op_index(rhs->v.op.op))
-    {
-	case OP_ADD :
-	    simplify_unit(rhsp, 0.0, TRUE, TRUE, changed);
-	    break;
+    if (!lisp_symbol_p(lisp_car(obj)))
+	return FALSE;
 
-	case OP_SUB :
-	    simplify_unit(rhsp, 0.0, FALSE, TRUE, changed);
-	    break;
+    if (strcmp(lisp_symbol(lisp_car(obj)), "tuple") != 0)
+    {
+	operation_t *op = lookup_op_by_name(lisp_symbol(lisp_car(obj)));
 
-	case OP_MUL :
-	    simplify_unit(rhsp, 1.0, TRUE, TRUE, changed);
-	    if (rhs->kind == RHS_OP)
-		simplify_zero(rhsp, 0.0, 0, TRUE, TRUE, changed);
-	    break;
+	if (op == NULL || lisp_list_length(lisp_cdr(obj)) != op->num_args)
+	    return FALSE;
 
-	case OP_DIV :
-	    simplify_unit(rhsp, 1.0, FALSE, TRUE, changed);
-	    break;
+	lisp_free(lisp_car(obj));
+	obj->v.cons.car = lisp_make_symbol(op->name);
+    }
 
-	case OP_POW :
-	    simplify_unit(rhsp, 1.0, FALSE, TRUE, changed);
-	    if (rhs->kind == RHS_OP)
-		simplify_zero(rhsp, 0.0, 1, FALSE, TRUE, changed);
-	    break;
+    for (lst = lisp_cdr(obj); lst != NULL; lst = lisp_cdr(lst))
+	if (!canonicalize_op_names(lisp_car(lst)))
+	    return FALSE;
 
-	default :
-	    break;
-    }
+    return TRUE;
 }
 
-static void
-simplify_ops_recursively (statement_t *stmt, int *changed)
+static int
+pattern_depth (lisp_object_t *pattern)
 {
-    while (stmt != 0)
-    {
-	switch (stmt->kind)
-	{
-	    case STMT_NIL :
-		break;
+    lisp_object_t *lst;
+    int depth = 0;
 
-	    case STMT_PHI_ASSIGN :
-		simplify_rhs(&stmt->v.assign.rhs2, changed);
-	    case STMT_ASSIGN :
-		simplify_rhs(&stmt->v.assign.rhs, changed);
-		break;
+    if (!lisp_cons_p(pattern))
+	return 0;
 
-	    case STMT_IF_COND :
-		simplify_rhs(&stmt->v.if_cond.condition, changed);
-		simplify_ops_recursively(stmt->v.if_cond.consequent, changed);
-		simplify_ops_recursively(stmt->v.if_cond.alternative, changed);
-		simplify_ops_recursively(stmt->v.if_cond.exit, changed);
-		break;
+    for (lst = lisp_cdr(pattern); lst != NULL; lst = lisp_cdr(lst))
+	depth = MAX(depth, pattern_depth(lisp_car(lst)));
 
-	    case STMT_WHILE_LOOP :
-		simplify_rhs(&stmt->v.while_loop.invariant, changed);
-		simplify_ops_recursively(stmt->v.while_loop.entry, changed);
-		simplify_ops_recursively(stmt->v.while_loop.body, changed);
+    return depth + 1;
+}
+
+static gboolean
+is_valid_replacement (lisp_object_t *replacement, int num_subs)
+{
+    lisp_object_t *lst;
+
+    if (lisp_number_p(replacement))
+	return TRUE;
+
+    if (lisp_symbol_p(replacement))
+    {
+	int index = rewrite_sub_index(replacement);
+
+	return index >= 0 && index < num_subs;
+    }
+
+    if (!lisp_cons_p(replacement))
+	return FALSE;
+
+    for (lst = lisp_cdr(replacement); lst != NULL; lst = lisp_cdr(lst))
+	if (!is_valid_replacement(lisp_car(lst), num_subs))
+	    return FALSE;
+
+    return TRUE;
+}
+
+static gboolean
+is_valid_guard (lisp_object_t *guard, int num_subs)
+{
+    const char *name;
+    int num_refs, i;
+
+    if (!lisp_cons_p(guard) || !lisp_symbol_p(lisp_car(guard)))
+	return FALSE;
+
+    name = lisp_symbol(lisp_car(guard));
+
+    if (strcmp(name, "=") == 0 || strcmp(name, "!=") == 0)
+    {
+	if (lisp_list_length(guard) != 3 || !lisp_number_p(lisp_list_nth(guard, 2)))
+	    return FALSE;
+	num_refs = 1;
+    }
+    else if (strcmp(name, "const") == 0 || strcmp(name, "nonconst") == 0 || strcmp(name, "nonneg") == 0)
+    {
+	if (lisp_list_length(guard) != 2)
+	    return FALSE;
+	num_refs = 1;
+    }
+    else if (strcmp(name, "same") == 0)
+    {
+	if (lisp_list_length(guard) != 3)
+	    return FALSE;
+	num_refs = 2;
+    }
+    else
+	return FALSE;
+
+    for (i = 1; i <= num_refs; ++i)
+    {
+	int index = rewrite_sub_index(lisp_list_nth(guard, i));
+
+	if (index < 0 || index >= num_subs)
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+add_rewrite_rule (lisp_object_t *obj)
+{
+    rewrite_rule_t *rule;
+    lisp_object_t *lst;
+    operation_t *op;
+    int index;
+
+    if (!lisp_cons_p(obj) || lisp_list_length(obj) < 3 || !lisp_symbol_p(lisp_car(obj)))
+	return FALSE;
+
+    rule = g_new0(rewrite_rule_t, 1);
+
+    rule->name = lisp_symbol(lisp_car(obj));
+    if (!lisp_compile_pattern(&lisp_list_nth_cdr(obj, 1)->v.cons.car, &rule->num_subs))
+	goto fail;
+    rule->pattern = lisp_list_nth(obj, 1);
+    rule->replacement = lisp_list_nth(obj, 2);
+    rule->guards = lisp_list_nth_cdr(obj, 3);
+
+    if (rule->num_subs > MAX_REWRITE_SUBS
+	|| !lisp_cons_p(rule->pattern)
+	|| !canonicalize_op_names(rule->pattern)
+	|| !canonicalize_op_names(rule->replacement)
+	|| !is_valid_replacement(rule->replacement, rule->num_subs))
+	goto fail;
+
+    for (lst = rule->guards; lst != NULL; lst = lisp_cdr(lst))
+	if (!is_valid_guard(lisp_car(lst), rule->num_subs))
+	    goto fail;
+
+    op = lookup_op_by_name(lisp_symbol(lisp_car(rule->pattern)));
+    if (op == NULL)
+	goto fail;
+    index = compiler_op_index(op);
+
+    /* append, so that rules are tried in the order they are given */
+    if (rewrite_rules[index] == NULL)
+	rewrite_rules[index] = rule;
+    else
+    {
+	rewrite_rule_t *last = rewrite_rules[index];
+
+	while (last->next != NULL)
+	    last = last->next;
+	last->next = rule;
+    }
+
+    rewrite_look_through_depth = MAX(rewrite_look_through_depth, pattern_depth(rule->pattern) - 1);
+
+    return TRUE;
+
+ fail:
+    g_free(rule);
+    return FALSE;
+}
+
+static void
+init_rewrite_rules (void)
+{
+    char *source = g_strdup(rewrite_rules_source);
+    lisp_stream_t stream;
+
+    lisp_stream_init_string(&stream, source);
+
+    for (;;)
+    {
+	lisp_object_t *obj = lisp_read(&stream);
+
+	if (lisp_type(obj) == LISP_TYPE_EOF)
+	    break;
+	g_assert(lisp_type(obj) != LISP_TYPE_PARSE_ERROR);
+
+	/* the rule keeps pointers into obj, so we don't free it */
+	if (!add_rewrite_rule(obj))
+	{
+	    fprintf(stderr, "invalid rewrite rule: ");
+	    lisp_dump(obj, stderr);
+	    fprintf(stderr, "\n");
+	}
+    }
+
+    g_free(source);
+
+    init_pools(&rewrite_pools);
+    init_pools_allocator(&rewrite_allocator, &rewrite_pools);
+    rewrite_primaries = g_hash_table_new(g_direct_hash, g_direct_equal);
+}
+
+static lisp_object_t* rhs_to_lisp (rhs_t *rhs, int depth);
+
+static lisp_object_t*
+primary_to_lisp (primary_t *primary, int depth)
+{
+    lisp_object_t *obj = NULL;
+
+    if (primary->kind == PRIMARY_CONST)
+    {
+	if (primary->const_type == TYPE_INT)
+	    obj = lisp_make_integer_with_allocator(&rewrite_allocator, primary->v.constant.int_value);
+	else if (primary->const_type == TYPE_FLOAT)
+	    obj = lisp_make_real_with_allocator(&rewrite_allocator, primary->v.constant.float_value);
+    }
+    else
+    {
+	statement_t *def = primary->v.value->def;
+
+	g_assert(primary->kind == PRIMARY_VALUE);
+
+	if (depth > 0 && def->kind == STMT_ASSIGN
+	    && (def->v.assign.rhs->kind == RHS_TUPLE
+		|| (def->v.assign.rhs->kind == RHS_OP && def->v.assign.rhs->v.op.op->is_pure)))
+	    obj = rhs_to_lisp(def->v.assign.rhs, depth - 1);
+    }
+
+    /* can only be matched by #?(any) */
+    if (obj == NULL)
+	obj = lisp_make_symbol_with_allocator(&rewrite_allocator, "%opaque");
+
+    g_hash_table_insert(rewrite_primaries, obj, primary);
+
+    return obj;
+}
+
+static lisp_object_t*
+rhs_to_lisp (rhs_t *rhs, int depth)
+{
+    int num_primaries, i;
+    primary_t *primaries = get_rhs_primaries(rhs, &num_primaries);
+    lisp_object_t *args = lisp_nil();
+    const char *head;
+
+    if (rhs->kind == RHS_OP)
+	head = rhs->v.op.op->name;
+    else
+    {
+	g_assert(rhs->kind == RHS_TUPLE);
+	head = "tuple";
+    }
+
+    for (i = num_primaries - 1; i >= 0; --i)
+	args = lisp_make_cons_with_allocator(&rewrite_allocator, primary_to_lisp(&primaries[i], depth), args);
+
+    return lisp_make_cons_with_allocator(&rewrite_allocator,
+					 lisp_make_symbol_with_allocator(&rewrite_allocator, head),
+					 args);
+}
+
+static primary_t*
+rewrite_sub_primary (lisp_object_t *ref, lisp_object_t **vars)
+{
+    return (primary_t*)g_hash_table_lookup(rewrite_primaries, vars[rewrite_sub_index(ref)]);
+}
+
+/* pow and sqrt differ for negative numbers, -0.0 and -inf, so rules
+   trading one for the other must know that none of those can occur.
+   NaNs are fine because they propagate through both. */
+static gboolean
+primary_is_nonnegative (primary_t *primary)
+{
+    rhs_t *rhs;
+
+    if (primary->kind == PRIMARY_CONST)
+    {
+	if (primary->const_type == TYPE_INT)
+	    return primary->v.constant.int_value >= 0;
+	if (primary->const_type == TYPE_FLOAT)
+	    return !signbit(primary->v.constant.float_value);
+	return FALSE;
+    }
+
+    g_assert(primary->kind == PRIMARY_VALUE);
+
+    if (primary->v.value->def->kind != STMT_ASSIGN)
+	return FALSE;
+    rhs = primary->v.value->def->v.assign.rhs;
+    if (rhs->kind != RHS_OP)
+	return FALSE;
+
+    if (compiler_op_index(rhs->v.op.op) == OP_ABS)
+	return TRUE;
+    /* -0.0 * -0.0 is 0.0 */
+    if (compiler_op_index(rhs->v.op.op) == OP_MUL)
+	return primaries_equal(&rhs->v.op.args[0], &rhs->v.op.args[1]);
+
+    return FALSE;
+}
+
+static gboolean
+rewrite_guard_holds (lisp_object_t *guard, lisp_object_t **vars)
+{
+    const char *name = lisp_symbol(lisp_car(guard));
+    lisp_object_t *sub = vars[rewrite_sub_index(lisp_list_nth(guard, 1))];
+    primary_t *primary = rewrite_sub_primary(lisp_list_nth(guard, 1), vars);
+
+    if (strcmp(name, "=") == 0)
+	return lisp_number_p(sub) && lisp_real(sub) == lisp_real(lisp_list_nth(guard, 2));
+    else if (strcmp(name, "!=") == 0)
+	return lisp_number_p(sub) && lisp_real(sub) != lisp_real(lisp_list_nth(guard, 2));
+    else if (strcmp(name, "const") == 0)
+	return primary != NULL && primary->kind == PRIMARY_CONST;
+    else if (strcmp(name, "nonconst") == 0)
+	return primary != NULL && primary->kind == PRIMARY_VALUE;
+    else if (strcmp(name, "nonneg") == 0)
+	return primary != NULL && primary_is_nonnegative(primary);
+    else if (strcmp(name, "same") == 0)
+    {
+	primary_t *other = rewrite_sub_primary(lisp_list_nth(guard, 2), vars);
+
+	return primary != NULL && other != NULL && primaries_equal(primary, other);
+    }
+
+    g_assert_not_reached();
+    return FALSE;
+}
+
+static gboolean
+replacement_is_buildable (lisp_object_t *replacement, lisp_object_t **vars, gboolean can_emit, gboolean nested)
+{
+    lisp_object_t *lst;
+
+    if (lisp_number_p(replacement))
+	return TRUE;
+
+    if (lisp_symbol_p(replacement))
+	return rewrite_sub_primary(replacement, vars) != NULL;
+
+    if (nested && !can_emit)
+	return FALSE;
+
+    for (lst = lisp_cdr(replacement); lst != NULL; lst = lisp_cdr(lst))
+	if (!replacement_is_buildable(lisp_car(lst), vars, can_emit, TRUE))
+	    return FALSE;
+
+    return TRUE;
+}
+
+static rhs_t* build_replacement_rhs (lisp_object_t *replacement, lisp_object_t **vars,
+				     statement_t ***loc, statement_t *parent);
+
+static primary_t
+build_replacement_primary (lisp_object_t *replacement, lisp_object_t **vars, statement_t ***loc, statement_t *parent)
+{
+    if (lisp_integer_p(replacement))
+	return make_int_const_primary(lisp_integer(replacement));
+    else if (lisp_real_p(replacement))
+	return make_float_const_primary(lisp_real(replacement));
+    else if (lisp_symbol_p(replacement))
+	return *rewrite_sub_primary(replacement, vars);
+    else
+    {
+	rhs_t *rhs = build_replacement_rhs(replacement, vars, loc, parent);
+	value_t *lhs = make_lhs(make_temporary(rhs_type(rhs)));
+
+	*loc = compiler_emit_stmt_before(make_assign(lhs, rhs), *loc, parent);
+
+	return make_value_primary(lhs);
+    }
+}
+
+static rhs_t*
+build_replacement_rhs (lisp_object_t *replacement, lisp_object_t **vars, statement_t ***loc, statement_t *parent)
+{
+    const char *head;
+    int length, i;
+
+    if (!lisp_cons_p(replacement))
+	return make_primary_rhs(build_replacement_primary(replacement, vars, loc, parent));
+
+    head = lisp_symbol(lisp_car(replacement));
+    length = lisp_list_length(lisp_cdr(replacement));
+
+    {
+	primary_t args[length];
+
+	for (i = 0; i < length; ++i)
+	    args[i] = build_replacement_primary(lisp_list_nth(replacement, i + 1), vars, loc, parent);
+
+	if (strcmp(head, "tuple") == 0)
+	    return make_tuple_rhs_from_array(length, args);
+	return make_op_rhs_from_array(compiler_op_index(lookup_op_by_name(head)), args);
+    }
+}
+
+/* builds a replacement which is a number or a sub-pattern reference
+   as a primary of the given type.  x - x must be 0.0 if x is a float,
+   for example. */
+static gboolean
+build_replacement_primary_of_type (lisp_object_t *replacement, lisp_object_t **vars, type_t type, primary_t *result)
+{
+    double number;
+
+    if (lisp_symbol_p(replacement))
+    {
+	primary_t *primary = rewrite_sub_primary(replacement, vars);
+
+	if (primary_type(primary) == type)
+	{
+	    *result = *primary;
+	    return TRUE;
+	}
+
+	if (primary->kind != PRIMARY_CONST)
+	    return FALSE;
+	if (primary->const_type == TYPE_INT)
+	    number = primary->v.constant.int_value;
+	else if (primary->const_type == TYPE_FLOAT)
+	    number = primary->v.constant.float_value;
+	else
+	    return FALSE;
+    }
+    else
+	number = lisp_real(replacement);
+
+    if (type == TYPE_INT && number == (int)number)
+	*result = make_int_const_primary((int)number);
+    else if (type == TYPE_FLOAT)
+	*result = make_float_const_primary(number);
+    else
+	return FALSE;
+
+    return TRUE;
+}
+
+/* loc is where statements for nested applications in the replacement
+   are emitted.  If it's NULL, rules which need them are not applied. */
+static gboolean
+rewrite_rhs (rhs_t **rhsp, statement_t *stmt, statement_t **loc)
+{
+    rhs_t *rhs = *rhsp;
+    lisp_object_t *obj;
+    rewrite_rule_t *rule;
+
+    if (rhs->kind != RHS_OP || rewrite_rules[compiler_op_index(rhs->v.op.op)] == NULL)
+	return FALSE;
+
+    reset_pools(&rewrite_pools);
+    g_hash_table_remove_all(rewrite_primaries);
+
+    obj = rhs_to_lisp(rhs, rewrite_look_through_depth);
+
+    for (rule = rewrite_rules[compiler_op_index(rhs->v.op.op)]; rule != NULL; rule = rule->next)
+    {
+	lisp_object_t *vars[MAX_REWRITE_SUBS];
+	lisp_object_t *guard;
+	rhs_t *new_rhs;
+
+	if (!lisp_match_pattern(rule->pattern, obj, vars, rule->num_subs))
+	    continue;
+
+	for (guard = rule->guards; guard != NULL; guard = lisp_cdr(guard))
+	    if (!rewrite_guard_holds(lisp_car(guard), vars))
+		break;
+	if (guard != NULL)
+	    continue;
+
+	if (!replacement_is_buildable(rule->replacement, vars, loc != NULL, FALSE))
+	    continue;
+
+	if (lisp_cons_p(rule->replacement))
+	    new_rhs = build_replacement_rhs(rule->replacement, vars, &loc, stmt->parent);
+	else
+	{
+	    primary_t primary;
+
+	    if (!build_replacement_primary_of_type(rule->replacement, vars, rhs_type(rhs), &primary))
+		continue;
+	    new_rhs = make_primary_rhs(primary);
+	}
+
+#ifdef DEBUG_OUTPUT
+	g_print("applying rewrite rule %s\n", rule->name);
+#endif
+
+	compiler_replace_rhs(rhsp, new_rhs, stmt);
+
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+simplify_ops_recursively (statement_t **stmtp, int *changed)
+{
+    while (*stmtp != 0)
+    {
+	statement_t *stmt = *stmtp;
+
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+	    case STMT_PHI_ASSIGN :
+		break;
+
+	    case STMT_ASSIGN :
+		if (rewrite_rhs(&stmt->v.assign.rhs, stmt, stmtp))
+		    *changed = 1;
+		break;
+
+	    case STMT_IF_COND :
+		if (rewrite_rhs(&stmt->v.if_cond.condition, stmt, stmtp))
+		    *changed = 1;
+		simplify_ops_recursively(&stmt->v.if_cond.consequent, changed);
+		simplify_ops_recursively(&stmt->v.if_cond.alternative, changed);
+		break;
+
+	    case STMT_WHILE_LOOP :
+		/* the invariant is evaluated in every iteration, so we
+		   can't emit statements for it */
+		if (rewrite_rhs(&stmt->v.while_loop.invariant, stmt, NULL))
+		    *changed = 1;
+		simplify_ops_recursively(&stmt->v.while_loop.body, changed);
 		break;
 
 	    default :
 		g_assert_not_reached();
 	}
 
-	stmt = stmt->next;
+	/* statements might have been inserted before stmt */
+	stmtp = &stmt->next;
     }
 }
 
@@ -3577,7 +4496,7 @@ simplify_ops (void)
 {
     int changed = 0;
 
-    simplify_ops_recursively(first_stmt, &changed);
+    simplify_ops_recursively(&first_stmt, &changed);
 
     return changed;
 }
@@ -4594,6 +5513,196 @@ compiler_slice_code_for_const (statement_t *stmt, int const_type)
     COMPILER_SLICE_CODE(stmt, slice_flag, &_const_predicate, (void*)const_type);
 }
 
+/*** time invariance ***/
+
+/* This finds filters whose whole output is the same for all frames,
+   which the command line tool then renders only once per animation.
+   Splitting the pixel code of other filters into a t-invariant stage,
+   whose results are kept in a per-pixel buffer across frames, and a
+   t-dependent stage is not done: the stages would need their own
+   slice flags and template directives, and the template is not part
+   of this tree.
+
+   The constants analysis treats every image sample as depending on
+   t, because the time argument of origVal defaults to t.  For input
+   images that are stills this is not true, so to find out whether a
+   filter's output changes from frame to frame we do our own
+   propagation, which ignores the time argument when sampling input
+   images.  The caller has to make sure that no input is a movie. */
+
+static gboolean
+is_input_image (primary_t *image)
+{
+    while (image->kind == PRIMARY_VALUE)
+    {
+	statement_t *def = image->v.value->def;
+	rhs_t *rhs;
+
+	if (def == NULL || def->kind != STMT_ASSIGN)
+	    return FALSE;
+
+	rhs = def->v.assign.rhs;
+	if (rhs->kind == RHS_PRIMARY)
+	    image = &rhs->v.primary;
+	else if (rhs->kind == RHS_OP
+		 && (compiler_op_index(rhs->v.op.op) == OP_STRIP_RESIZE
+		     || compiler_op_index(rhs->v.op.op) == OP_RESIZE_IMAGE))
+	    image = &rhs->v.op.args[0];
+	else
+	    return compiler_stmt_is_assign_with_op(def, OP_USERVAL_IMAGE);
+    }
+
+    return FALSE;
+}
+
+static gboolean
+rhs_depends_on_time (rhs_t *rhs, value_set_t *dependent)
+{
+    int num_primaries, i, op_index = -1;
+    primary_t *primaries;
+
+    switch (rhs->kind)
+    {
+	case RHS_INTERNAL :
+	    return (rhs->v.internal->const_type & CONST_T) == 0;
+
+	case RHS_FILTER :
+	    return TRUE;
+
+	case RHS_CLOSURE :
+	    /* native filters render their image arguments at the
+	       current time */
+	    if (rhs->v.closure.filter->kind == FILTER_NATIVE)
+		return TRUE;
+	    break;
+
+	case RHS_OP :
+	    if (!rhs->v.op.op->is_pure)
+		return TRUE;
+	    op_index = compiler_op_index(rhs->v.op.op);
+	    break;
+
+	default :
+	    break;
+    }
+
+    primaries = get_rhs_primaries(rhs, &num_primaries);
+    for (i = 0; i < num_primaries; ++i)
+    {
+	if (op_index == OP_ORIG_VAL && i == 3 && is_input_image(&primaries[2]))
+	    continue;
+
+	/* ops other than these might sample closures at the current
+	   time */
+	if (op_index >= 0 && op_index != OP_ORIG_VAL
+	    && op_index != OP_STRIP_RESIZE && op_index != OP_RESIZE_IMAGE
+	    && op_index != OP_IMAGE_PIXEL_WIDTH && op_index != OP_IMAGE_PIXEL_HEIGHT
+	    && primary_type(&primaries[i]) == TYPE_IMAGE
+	    && !is_input_image(&primaries[i]))
+	    return TRUE;
+
+	if (primaries[i].kind == PRIMARY_VALUE
+	    && compiler_value_set_contains(dependent, primaries[i].v.value))
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+mark_if_depends_on_time (value_t *lhs, gboolean depends, value_set_t *dependent, gboolean *changed)
+{
+    if (depends && !compiler_value_set_contains(dependent, lhs))
+    {
+	compiler_value_set_add(dependent, lhs);
+	*changed = TRUE;
+    }
+}
+
+static void
+analyze_phis_time (statement_t *phis, gboolean control_depends, value_set_t *dependent, gboolean *changed)
+{
+    for (; phis != NULL; phis = phis->next)
+    {
+	if (phis->kind == STMT_NIL)
+	    continue;
+
+	g_assert(phis->kind == STMT_PHI_ASSIGN);
+
+	mark_if_depends_on_time(phis->v.assign.lhs,
+				control_depends
+				|| rhs_depends_on_time(phis->v.assign.rhs, dependent)
+				|| rhs_depends_on_time(phis->v.assign.rhs2, dependent),
+				dependent, changed);
+    }
+}
+
+static void
+analyze_stmts_time (statement_t *stmt, gboolean control_depends, value_set_t *dependent, gboolean *changed)
+{
+    gboolean depends;
+
+    for (; stmt != NULL; stmt = stmt->next)
+    {
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_ASSIGN :
+		mark_if_depends_on_time(stmt->v.assign.lhs,
+					control_depends || rhs_depends_on_time(stmt->v.assign.rhs, dependent),
+					dependent, changed);
+		break;
+
+	    case STMT_IF_COND :
+		depends = control_depends || rhs_depends_on_time(stmt->v.if_cond.condition, dependent);
+		analyze_stmts_time(stmt->v.if_cond.consequent, depends, dependent, changed);
+		analyze_stmts_time(stmt->v.if_cond.alternative, depends, dependent, changed);
+		analyze_phis_time(stmt->v.if_cond.exit, depends, dependent, changed);
+		break;
+
+	    case STMT_WHILE_LOOP :
+		depends = control_depends || rhs_depends_on_time(stmt->v.while_loop.invariant, dependent);
+		analyze_phis_time(stmt->v.while_loop.entry, depends, dependent, changed);
+		analyze_stmts_time(stmt->v.while_loop.body, depends, dependent, changed);
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+}
+
+/* Whether the output of the filter is the same for all frames if all
+   input images are stills. */
+static gboolean
+output_is_time_invariant (statement_t *first)
+{
+    value_set_t *dependent = compiler_new_value_set();
+    gboolean changed, result = FALSE;
+    statement_t *stmt;
+
+    do
+    {
+	changed = FALSE;
+	analyze_stmts_time(first, FALSE, dependent, &changed);
+    } while (changed);
+
+    for (stmt = first; stmt != NULL; stmt = stmt->next)
+	if (compiler_stmt_is_assign_with_op(stmt, OP_OUTPUT_TUPLE))
+	{
+	    primary_t arg = compiler_stmt_op_assign_arg(stmt, 0);
+
+	    result = arg.kind != PRIMARY_VALUE || !compiler_value_set_contains(dependent, arg.v.value);
+	    break;
+	}
+
+    compiler_free_value_set(dependent);
+
+    return result;
+}
+
 /*** compiling and loading ***/
 
 #ifdef OPENSTEP
@@ -4633,6 +5742,8 @@ compiler_alloc_pools_if_necessary ()
 
     init_pools(&compiler_pools);
     vector_variables = g_hash_table_new(g_direct_hash, g_direct_equal);
+    stmt_regions = g_hash_table_new(g_direct_hash, g_direct_equal);
+    current_stmt_region = scanner_null_region;
 
     pools_alloced = 1;
 }
@@ -4640,12 +5751,28 @@ compiler_alloc_pools_if_necessary ()
 void
 compiler_free_pools (mathmap_t *mathmap)
 {
+    pools_statistics_t stats;
+
+    pools_get_statistics(&compiler_pools, &stats);
+    mathmap_pools_stats_add_instance(POOLS_ROLE_COMPILER, stats.bytes_requested, stats.bytes_reserved,
+				     stats.high_water, stats.num_growths);
+
     g_hash_table_unref(vector_variables);
+    g_hash_table_unref(stmt_regions);
     free_pools(&compiler_pools);
 
     pools_alloced = 0;
 }
 
+/* Runs an optimizer pass, recording it as a span in the trace. */
+#define TRACE_PASS(name,pass)		({ double __trace_start = mathmap_trace_begin(); \
+					   gboolean __changed = (pass); \
+					   mathmap_trace_end((name), "optimize", __trace_start); \
+					   __changed; })
+#define TRACE_VOID_PASS(name,pass)	do { double __trace_start = mathmap_trace_begin(); \
+					     pass; \
+					     mathmap_trace_end((name), "optimize", __trace_start); } while (0)
+
 filter_code_t*
 compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_types, int timeout, gboolean debug_output)
 {
@@ -4666,7 +5793,7 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
     inlining_history = NULL;
 
     tuple_tmp = make_temporary(TYPE_TUPLE);
-    first_stmt = gen_filter_code(filter, tuple_tmp, NULL, NULL, inlining_history);
+    TRACE_VOID_PASS("gen_filter_code", first_stmt = gen_filter_code(filter, tuple_tmp, NULL, NULL, inlining_history));
 
     emit_loc = &(last_stmt_of_block(first_stmt)->next);
 
@@ -4688,30 +5815,32 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
 	    dump_code(first_stmt, 0);
 	}
 
-	optimize_closure_application(first_stmt);
-	CHECK_SSA;
-
 	changed = FALSE;
 
-	changed = do_inlining() || changed;
+	changed = TRACE_PASS("materialize_sampled_closures", materialize_sampled_closures(filter)) || changed;
+	CHECK_SSA;
+	TRACE_VOID_PASS("optimize_closure_application", optimize_closure_application(first_stmt));
 	CHECK_SSA;
-	changed = copy_propagation() || changed;
+
+	changed = TRACE_PASS("do_inlining", do_inlining()) || changed;
 	CHECK_SSA;
-	changed = optimize_tuple_nth() || changed;
+	changed = TRACE_PASS("copy_propagation", copy_propagation()) || changed;
 	CHECK_SSA;
-	changed = optimize_make_tuple() || changed;
+	changed = TRACE_PASS("optimize_tuple_nth", optimize_tuple_nth()) || changed;
+	CHECK_SSA;
+	changed = TRACE_PASS("optimize_make_tuple", optimize_make_tuple()) || changed;
 	CHECK_SSA;
 	/*
 	changed = compiler_opt_loop_invariant_code_motion(&first_stmt) || changed;
 	CHECK_SSA;
 	*/
-	changed = common_subexpression_elimination() || changed;
+	changed = TRACE_PASS("common_subexpression_elimination", common_subexpression_elimination()) || changed;
 	CHECK_SSA;
-	changed = copy_propagation() || changed;
+	changed = TRACE_PASS("copy_propagation", copy_propagation()) || changed;
 	CHECK_SSA;
-	changed = constant_folding() || changed;
+	changed = TRACE_PASS("constant_folding", constant_folding()) || changed;
 	CHECK_SSA;
-	changed = simplify_ops() || changed;
+	changed = TRACE_PASS("simplify_ops", simplify_ops()) || changed;
 	CHECK_SSA;
 
 	if (debug_output)
@@ -4719,7 +5848,7 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
 	    printf("-------------------------------- before resize\n");
 	    dump_code(first_stmt, 0);
 	}
-	changed = compiler_opt_orig_val_resize(&first_stmt) || changed;
+	changed = TRACE_PASS("compiler_opt_orig_val_resize", compiler_opt_orig_val_resize(&first_stmt)) || changed;
 	CHECK_SSA;
 	if (debug_output)
 	{
@@ -4727,20 +5856,20 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
 	    dump_code(first_stmt, 0);
 	}
 
-	changed = compiler_opt_strip_resize(&first_stmt) || changed;
+	changed = TRACE_PASS("compiler_opt_strip_resize", compiler_opt_strip_resize(&first_stmt)) || changed;
 	CHECK_SSA;
-	changed = compiler_opt_simplify(filter, first_stmt) || changed;
+	changed = TRACE_PASS("compiler_opt_simplify", compiler_opt_simplify(filter, first_stmt)) || changed;
 	CHECK_SSA;
 
-	changed = compiler_opt_remove_dead_assignments(first_stmt) || changed;
+	changed = TRACE_PASS("compiler_opt_remove_dead_assignments", compiler_opt_remove_dead_assignments(first_stmt)) || changed;
 	CHECK_SSA;
-	changed = remove_dead_branches() || changed;
+	changed = TRACE_PASS("remove_dead_branches", remove_dead_branches()) || changed;
 	CHECK_SSA;
-	changed = remove_dead_controls() || changed;
+	changed = TRACE_PASS("remove_dead_controls", remove_dead_controls()) || changed;
     }
 
     CHECK_SSA;
-    propagate_types();
+    TRACE_VOID_PASS("propagate_types", propagate_types());
 
 #ifdef DEBUG_OUTPUT
     check_ssa(first_stmt);
@@ -4748,9 +5877,12 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
 
 #ifndef NO_CONSTANTS_ANALYSIS
     if (constant_analysis)
-	analyze_constants();
+	TRACE_VOID_PASS("analyze_constants", analyze_constants());
 #endif
 
+    TRACE_VOID_PASS("output_is_time_invariant",
+		    filter->v.mathmap.is_t_invariant = output_is_time_invariant(first_stmt));
+
     if (debug_output)
     {
 	printf("----------- final ---------------------\n");
@@ -4800,7 +5932,9 @@ compiler_compile_filters (mathmap_t *mathmap, int timeout)
 #ifdef DEBUG_OUTPUT
 	g_print("compiling filter %s\n", filter->name);
 #endif
+	constant_uservals = (filter == mathmap->main_filter) ? mathmap->constant_uservals : NULL;
 	filter_codes[i] = compiler_generate_ir_code(filter, 1, 0, timeout, debug_output && filter == mathmap->main_filter);
+	constant_uservals = NULL;
     }
 
     return filter_codes;
@@ -4840,4 +5974,5 @@ void
 init_compiler (void)
 {
     init_ops();
+    init_rewrite_rules();
 }
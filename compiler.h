@@ -67,10 +67,14 @@ typedef mathfuncs_t (*initfunc_t) (struct _mathmap_invocation_t*);
 #define MAX_OP_ARGS          9
 
 struct _filter_code_t;
+struct _statement_t;
 
 void init_compiler (void);
 
 void set_opmacros_filename (const char *filename);
+
+gboolean compiler_stmt_region (struct _statement_t *stmt, scanner_region_t *region);
+gboolean compiler_stmts_use_rand (struct _statement_t *stmts);
 int compiler_template_processor (struct _mathmap_t *mathmap, const char *directive, const char *arg, FILE *out, void *data);
 
 initfunc_t gen_and_load_c_code (struct _mathmap_t *mathmap, void **module_info,
@@ -173,7 +173,7 @@ CALLBACK_SYMBOL
 image_t*
 make_resize_image (image_t *image, float x_factor, float y_factor, mathmap_pools_t *pools)
 {
-    image_t *resize = mathmap_pools_alloc(pools, sizeof(image_t));
+    image_t *resize = mathmap_pools_alloc_accounted(pools, sizeof(image_t));
 
     g_assert(image->type != IMAGE_RESIZE);
 
@@ -188,6 +188,32 @@ make_resize_image (image_t *image, float x_factor, float y_factor, mathmap_pools
     return resize;
 }
 
+image_t*
+floatmap_alloc (int width, int height, mathmap_pools_t *pools)
+{
+    return floatmap_alloc_with_layout(width, height, FLOATMAP_LAYOUT_INTERLEAVED, pools);
+}
+
+image_t*
+floatmap_alloc_with_layout (int width, int height, int layout, mathmap_pools_t *pools)
+{
+    image_t *image = mathmap_pools_alloc_accounted(pools, sizeof(image_t));
+
+    image->type = IMAGE_FLOATMAP;
+    image->id = image_new_id();
+    image->pixel_width = width;
+    image->pixel_height = height;
+    /* the inverse of CALC_VIRTUAL_X and CALC_VIRTUAL_Y */
+    image->v.floatmap.ax = (width - 1) / 2.0;
+    image->v.floatmap.bx = (width - 1) / 2.0;
+    image->v.floatmap.ay = -(height - 1) / 2.0;
+    image->v.floatmap.by = (height - 1) / 2.0;
+    image->v.floatmap.data = mathmap_pools_alloc_accounted(pools, floatmap_storage_size(layout, width * height));
+    image->v.floatmap.layout = layout;
+
+    return image;
+}
+
 image_t*
 closure_image_alloc (mathfuncs_t *mathfuncs, filter_func_t filter_func,
 		     int num_uservals, userval_t *uservals,
@@ -204,6 +230,7 @@ closure_image_alloc (mathfuncs_t *mathfuncs, filter_func_t filter_func,
     image->v.closure.num_args = num_uservals;
     image->v.closure.pools = g_new0(mathmap_pools_t, 1);
     mathmap_pools_init_global(image->v.closure.pools);
+    mathmap_pools_stats_register(image->v.closure.pools, POOLS_ROLE_CLOSURE);
     memcpy(image->v.closure.args, uservals, num_uservals * sizeof(userval_t));
 
     return image;
@@ -213,6 +240,7 @@ void
 closure_image_free (image_t *closure)
 {
     g_assert(closure->type == IMAGE_CLOSURE);
+    mathmap_pools_stats_unregister(closure->v.closure.pools);
     mathmap_pools_free(closure->v.closure.pools);
     g_free(closure->v.closure.pools);
     g_free(closure);
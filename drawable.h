@@ -26,6 +26,9 @@
 #define __DRAWABLE_H__
 
 #include <glib.h>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
 #ifdef MOVIES
 #include <quicktime.h>
 #endif
@@ -45,6 +48,7 @@ struct _cache_entry_t;
 #define IMAGE_CLOSURE		2
 #define IMAGE_FLOATMAP		3
 #define IMAGE_RESIZE		4
+#define IMAGE_TILED_FLOATMAP	5
 /* END */
 
 struct _mathmap_frame_t;
@@ -81,6 +85,12 @@ struct _input_drawable_t;
 #define NUM_FLOATMAP_CHANNELS	4
 /* END */
 
+/* TEMPLATE floatmap_layouts */
+#define FLOATMAP_LAYOUT_INTERLEAVED	0 /* float, channels interleaved */
+#define FLOATMAP_LAYOUT_PLANAR		1 /* float, one plane per channel */
+#define FLOATMAP_LAYOUT_HALF		2 /* half float, channels interleaved */
+/* END */
+
 struct _mathfuncs_t;
 
 /* TEMPLATE image */
@@ -108,20 +118,155 @@ typedef struct _image_t
 	    float bx;
 	    float ay;
 	    float by;
-	    float *data;
+	    float *data;	/* guint16* for FLOATMAP_LAYOUT_HALF */
+	    int layout;
 	} floatmap;
 	struct {
 	    struct _image_t *original;
 	    float x_factor;
 	    float y_factor;
 	} resize;
+	struct {
+	    float ax;
+	    float bx;
+	    float ay;
+	    float by;
+	    struct _tiled_floatmap_t *tiled;
+	} tiled_floatmap;
     } v;
 } image_t;
 /* END */
 
+/* Only for floatmaps with FLOATMAP_LAYOUT_INTERLEAVED. */
 #define FLOATMAP_VALUE_I(img,i,c)          ((img)->v.floatmap.data[(i)*NUM_FLOATMAP_CHANNELS + (c)])
 #define FLOATMAP_VALUE_XY(img,x,y,c)	   FLOATMAP_VALUE_I((img), ((y)*(img)->pixel_width + (x)), (c))
 
+static inline guint16
+float_to_half (float f)
+{
+#ifdef __F16C__
+    return _cvtss_sh(f, 0);
+#else
+    union { float f; guint32 u; } v;
+    guint32 sign, mant;
+    gint32 exp;
+    guint16 h;
+
+    v.f = f;
+    sign = (v.u >> 16) & 0x8000;
+    exp = (gint32)((v.u >> 23) & 0xff) - 127 + 15;
+    mant = v.u & 0x7fffff;
+
+    if (((v.u >> 23) & 0xff) == 0xff)
+	return sign | 0x7c00 | (mant != 0 ? 0x200 : 0);
+    if (exp >= 31)
+	return sign | 0x7c00;
+    if (exp <= 0)
+    {
+	int shift;
+	guint32 rem;
+
+	if (exp < -10)
+	    return sign;
+	mant |= 0x800000;
+	shift = 14 - exp;
+	h = mant >> shift;
+	rem = mant & ((1u << shift) - 1);
+	if (rem > (1u << (shift - 1)) || (rem == (1u << (shift - 1)) && (h & 1)))
+	    ++h;
+	return sign | h;
+    }
+
+    /* round to nearest even, like the hardware does */
+    h = sign | (exp << 10) | (mant >> 13);
+    if ((mant & 0x1fff) > 0x1000 || ((mant & 0x1fff) == 0x1000 && (h & 1)))
+	++h;
+    return h;
+#endif
+}
+
+static inline float
+half_to_float (guint16 h)
+{
+#ifdef __F16C__
+    return _cvtsh_ss(h);
+#else
+    union { float f; guint32 u; } v;
+    guint32 sign = (guint32)(h & 0x8000) << 16;
+    gint32 exp = (h >> 10) & 0x1f;
+    guint32 mant = h & 0x3ff;
+
+    if (exp == 0)
+    {
+	if (mant == 0)
+	    v.u = sign;
+	else
+	{
+	    exp = 1;
+	    while (!(mant & 0x400))
+	    {
+		mant <<= 1;
+		--exp;
+	    }
+	    mant &= 0x3ff;
+	    v.u = sign | ((guint32)(exp + 127 - 15) << 23) | (mant << 13);
+	}
+    }
+    else if (exp == 31)
+	v.u = sign | 0x7f800000 | (mant << 13);
+    else
+	v.u = sign | ((guint32)(exp + 127 - 15) << 23) | (mant << 13);
+
+    return v.f;
+#endif
+}
+
+/* Accessors for floatmap storage in any layout.  NUM_PIXELS is only
+   needed for FLOATMAP_LAYOUT_PLANAR. */
+static inline float
+floatmap_storage_get (void *data, int layout, int num_pixels, int i, int c)
+{
+    switch (layout)
+    {
+	case FLOATMAP_LAYOUT_PLANAR :
+	    return ((float*)data)[c * num_pixels + i];
+	case FLOATMAP_LAYOUT_HALF :
+	    return half_to_float(((guint16*)data)[i * NUM_FLOATMAP_CHANNELS + c]);
+	default :
+	    return ((float*)data)[i * NUM_FLOATMAP_CHANNELS + c];
+    }
+}
+
+static inline void
+floatmap_storage_set (void *data, int layout, int num_pixels, int i, int c, float value)
+{
+    switch (layout)
+    {
+	case FLOATMAP_LAYOUT_PLANAR :
+	    ((float*)data)[c * num_pixels + i] = value;
+	    break;
+	case FLOATMAP_LAYOUT_HALF :
+	    ((guint16*)data)[i * NUM_FLOATMAP_CHANNELS + c] = float_to_half(value);
+	    break;
+	default :
+	    ((float*)data)[i * NUM_FLOATMAP_CHANNELS + c] = value;
+	    break;
+    }
+}
+
+static inline size_t
+floatmap_storage_size (int layout, int num_pixels)
+{
+    if (layout == FLOATMAP_LAYOUT_HALF)
+	return sizeof(guint16) * NUM_FLOATMAP_CHANNELS * num_pixels;
+    return sizeof(float) * NUM_FLOATMAP_CHANNELS * num_pixels;
+}
+
+#define FLOATMAP_GET_I(img,i,c)		(floatmap_storage_get((img)->v.floatmap.data, (img)->v.floatmap.layout, \
+							      (img)->pixel_width * (img)->pixel_height, (i), (c)))
+#define FLOATMAP_SET_I(img,i,c,v)	(floatmap_storage_set((img)->v.floatmap.data, (img)->v.floatmap.layout, \
+							      (img)->pixel_width * (img)->pixel_height, (i), (c), (v)))
+
 typedef struct _input_drawable_t {
     gboolean used;
 
@@ -146,6 +291,7 @@ typedef struct _input_drawable_t {
 	    int num_frames;
 	    struct _cache_entry_t **cache_entries;
 	    char *image_filename;
+	    volatile gint read_failed;	/* decoding it again failed */
 #ifdef MOVIES
 	    quicktime_t *movie;
 #endif
@@ -178,12 +324,23 @@ input_drawable_t* alloc_cmdline_movie_input_drawable (const char *filename);
 #endif
 
 image_t* floatmap_alloc (int width, int height, mathmap_pools_t *pools);
+image_t* floatmap_alloc_with_layout (int width, int height, int layout, mathmap_pools_t *pools);
 image_t* floatmap_copy (image_t *floatmap, mathmap_pools_t *pools);
 
 /* TEMPLATE make_resize_image */
 image_t* make_resize_image (image_t *image, float x_factor, float y_factor, mathmap_pools_t *pools);
 /* END */
 
+/* TEMPLATE tiled_floatmap */
+image_t* render_image_lazily (struct _mathmap_invocation_t *invocation, image_t *image,
+			      int width, int height, float t, mathmap_pools_t *pools);
+float* get_tiled_floatmap_pixel (struct _mathmap_invocation_t *invocation, image_t *img,
+				 float x, float y, float t, mathmap_pools_t *pools);
+/* END */
+
+image_t* tiled_floatmap_flatten (struct _mathmap_invocation_t *invocation, image_t *img, int layout,
+				 mathmap_pools_t *pools);
+
 void floatmap_get_channel_column (float *dst, image_t *img, int col, int channel);
 void floatmap_get_channel_row (float *dst, image_t *img, int row, int channel);
 void floatmap_set_channel_column (image_t *img, int col, int channel, float *src);
@@ -0,0 +1,538 @@
+/* -*- c -*- */
+
+/*
+ * fastmath.h
+ *
+ * MathMap
+ *
+ * Copyright (C) 2004-2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Single precision replacements for libm and GSL, used by generated
+   code compiled with the fast precision mode.  They are branch-light
+   and free of table lookups, so loops calling them can be
+   vectorized.  The error bounds are against the correctly rounded
+   float result, measured over the stated ranges:
+
+     fast_sinf, fast_cosf	2 ulp for |x| <= 8192
+     fast_atanf, fast_atan2f	4 ulp
+     fast_asinf, fast_acosf	4 ulp
+     fast_expf, fast_logf	2 ulp
+     fast_powf			2 * (1 + |y * log x|) ulp
+     fast_gammaf		1e-6 relative for -5 < x < 35, away from poles
+     Carlson integrals		5e-7 relative
+
+   Arguments outside those ranges still give sensible, if less
+   accurate, results. */
+
+#ifndef __FASTMATH_H__
+#define __FASTMATH_H__
+
+#include <math.h>
+#include <complex.h>
+
+typedef union
+{
+    float f;
+    int i;
+    unsigned int u;
+} fast_float_bits_t;
+
+static inline float
+fast_ldexpf (float x, int n)
+{
+    fast_float_bits_t b;
+
+    /* 2^n for the normal range, which is all exp needs */
+    n = n < -126 ? -126 : n > 127 ? 127 : n;
+    b.i = (n + 127) << 23;
+    return x * b.f;
+}
+
+/* sin and cos on [-pi/4, pi/4] */
+static inline float
+fast_sin_kernel (float x)
+{
+    float x2 = x * x;
+
+    return x + x * x2 * (-1.6666654611e-1f + x2 * (8.3321608736e-3f + x2 * -1.9515295891e-4f));
+}
+
+static inline float
+fast_cos_kernel (float x)
+{
+    float x2 = x * x;
+
+    return 1.0f - 0.5f * x2 + x2 * x2 * (4.166664568298827e-2f + x2 * (-1.388731625493765e-3f
+									 + x2 * 2.443315711809948e-5f));
+}
+
+/* Reduction by pi/2, done in double so it stays exact for all
+   reasonable arguments.  Returns the quadrant. */
+static inline int
+fast_reduce_half_pi (float x, float *r)
+{
+    double n = rint(x * 0.63661977236758134308);
+
+    /* pi/2 in two parts, the first of which has only 33 bits */
+    *r = (float)((x - n * 1.57079632673412561417) - n * 6.07710050650619224932e-11);
+    return (int)n;
+}
+
+static inline float
+fast_sinf (float x)
+{
+    float r;
+    int q = fast_reduce_half_pi(x, &r);
+    float s = (q & 1) ? fast_cos_kernel(r) : fast_sin_kernel(r);
+
+    return (q & 2) ? -s : s;
+}
+
+static inline float
+fast_cosf (float x)
+{
+    float r;
+    int q = fast_reduce_half_pi(x, &r);
+    float c = (q & 1) ? fast_sin_kernel(r) : fast_cos_kernel(r);
+
+    return ((q + 1) & 2) ? -c : c;
+}
+
+static inline float
+fast_tanf (float x)
+{
+    return fast_sinf(x) / fast_cosf(x);
+}
+
+static inline float
+fast_atanf (float x)
+{
+    float a = fabsf(x);
+    float z, z2, r;
+
+    if (a > 2.414213562373095f)
+    {
+	r = 1.57079632679489661923f;
+	z = -1.0f / a;
+    }
+    else if (a > 0.4142135623730950f)
+    {
+	r = 0.78539816339744830962f;
+	z = (a - 1.0f) / (a + 1.0f);
+    }
+    else
+    {
+	r = 0.0f;
+	z = a;
+    }
+    z2 = z * z;
+    r += z + z * z2 * (-3.33329491539e-1f + z2 * (1.99777106478e-1f + z2 * (-1.38776856032e-1f
+									  + z2 * 8.05374449538e-2f)));
+    return x < 0.0f ? -r : r;
+}
+
+static inline float
+fast_atan2f (float y, float x)
+{
+    float r;
+
+    if (x == 0.0f)
+	return y > 0.0f ? 1.57079632679489661923f : y < 0.0f ? -1.57079632679489661923f : 0.0f;
+    r = fast_atanf(y / x);
+    if (x < 0.0f)
+	r += y < 0.0f ? -3.14159265358979323846f : 3.14159265358979323846f;
+    return r;
+}
+
+static inline float
+fast_asinf (float x)
+{
+    return fast_atan2f(x, sqrtf((1.0f - x) * (1.0f + x)));
+}
+
+static inline float
+fast_acosf (float x)
+{
+    return fast_atan2f(sqrtf((1.0f - x) * (1.0f + x)), x);
+}
+
+static inline float
+fast_expf (float x)
+{
+    float n, r, p;
+
+    if (x > 88.72283935546875f)
+	return HUGE_VALF;
+    if (x < -103.9720840454f)
+	return 0.0f;
+
+    n = rintf(x * 1.44269504088896341f);
+    r = (x - n * 0.693359375f) + n * 2.12194440e-4f;
+    /* e^r on [-ln2/2, ln2/2] */
+    p = 1.0f + r + r * r * (5.0000001201e-1f + r * (1.6666665459e-1f + r * (4.1665795894e-2f
+									   + r * (8.3334519073e-3f
+										  + r * (1.3981999507e-3f
+											 + r * 1.9875691500e-4f)))));
+    if (n < -126.0f)
+	return fast_ldexpf(fast_ldexpf(p, (int)n + 64), -64);
+    return fast_ldexpf(p, (int)n);
+}
+
+static inline float
+fast_logf (float x)
+{
+    fast_float_bits_t b;
+    int e;
+    float m, s, s2, r;
+
+    if (!(x > 0.0f))
+	return x == 0.0f ? -HUGE_VALF : NAN;
+    if (isinf(x))
+	return x;
+
+    b.f = x;
+    if (b.i < 0x00800000)
+    {
+	/* denormal */
+	b.f = x * 16777216.0f;
+	e = -24;
+    }
+    else
+	e = 0;
+    e += ((b.i >> 23) & 0xff) - 127;
+    b.i = (b.i & 0x007fffff) | 0x3f800000;
+    m = b.f;
+    if (m > 1.41421356237f)
+    {
+	m *= 0.5f;
+	++e;
+    }
+
+    /* log(m) = 2 atanh(s), s = (m-1)/(m+1) */
+    s = (m - 1.0f) / (m + 1.0f);
+    s2 = s * s;
+    r = 2.0f * s + s * s2 * (6.666666666e-1f + s2 * (4.000059962e-1f + s2 * (2.852761447e-1f
+									      + s2 * 2.424980810e-1f)));
+    return e * 0.693145751953125f + (r + e * 1.428606765330187045e-6f);
+}
+
+static inline float
+fast_powf (float x, float y)
+{
+    if (x > 0.0f)
+	return fast_expf(y * fast_logf(x));
+    return powf(x, y);
+}
+
+static inline float
+fast_fmodf (float x, float y)
+{
+    return fmodf(x, y);
+}
+
+/* Lanczos approximation with g = 5 and six terms */
+static inline float
+fast_gammaf (float x)
+{
+    double a, t;
+
+    if (x < 0.5f)
+    {
+	/* reflection, with sin(pi x) reduced exactly first */
+	float n = rintf(x);
+	float s = fast_sinf(3.14159265358979323846f * (x - n));
+
+	if (s == 0.0f)
+	    return NAN;
+	if ((int)n & 1)
+	    s = -s;
+	return 3.14159265358979323846f / (s * fast_gammaf(1.0f - x));
+    }
+
+    /* The series cancels badly and t^(x+0.5) needs more than float
+       precision for large x, so this is done in double.  Above 35 the
+       result overflows to infinity, like the float result of the
+       precise gamma. */
+    x -= 1.0f;
+    a = 1.000000000190015
+	+ 76.18009172947146 / (x + 1.0)
+	- 86.50532032941677 / (x + 2.0)
+	+ 24.01409824083091 / (x + 3.0)
+	- 1.231739572450155 / (x + 4.0)
+	+ 1.208650973866179e-3 / (x + 5.0)
+	- 5.395239384953e-6 / (x + 6.0);
+    t = x + 5.5;
+    return 2.5066282746310002 * a * exp((x + 0.5) * log(t) - t);
+}
+
+/* Carlson's symmetric elliptic integrals by duplication, with the
+   tolerances from Numerical Recipes for single precision. */
+static inline float
+fast_ellint_rf (float x, float y, float z)
+{
+    float xt = x, yt = y, zt = z, ave, dx, dy, dz, e2, e3;
+
+    for (;;)
+    {
+	float sx = sqrtf(xt), sy = sqrtf(yt), sz = sqrtf(zt);
+	float lambda = sx * (sy + sz) + sy * sz;
+
+	xt = 0.25f * (xt + lambda);
+	yt = 0.25f * (yt + lambda);
+	zt = 0.25f * (zt + lambda);
+	ave = (xt + yt + zt) * (1.0f / 3.0f);
+	dx = (ave - xt) / ave;
+	dy = (ave - yt) / ave;
+	dz = (ave - zt) / ave;
+	if (fmaxf(fmaxf(fabsf(dx), fabsf(dy)), fabsf(dz)) <= 0.0025f)
+	    break;
+    }
+    e2 = dx * dy - dz * dz;
+    e3 = dx * dy * dz;
+    return (1.0f + (e2 * (1.0f / 24.0f) - 0.1f - (3.0f / 44.0f) * e3) * e2 + (1.0f / 14.0f) * e3) / sqrtf(ave);
+}
+
+static inline float
+fast_ellint_rd (float x, float y, float z)
+{
+    float xt = x, yt = y, zt = z, sum = 0.0f, fac = 1.0f, ave, dx, dy, dz;
+    float ea, eb, ec, ed, ee;
+
+    for (;;)
+    {
+	float sx = sqrtf(xt), sy = sqrtf(yt), sz = sqrtf(zt);
+	float lambda = sx * (sy + sz) + sy * sz;
+
+	sum += fac / (sz * (zt + lambda));
+	fac *= 0.25f;
+	xt = 0.25f * (xt + lambda);
+	yt = 0.25f * (yt + lambda);
+	zt = 0.25f * (zt + lambda);
+	ave = 0.2f * (xt + yt + 3.0f * zt);
+	dx = (ave - xt) / ave;
+	dy = (ave - yt) / ave;
+	dz = (ave - zt) / ave;
+	if (fmaxf(fmaxf(fabsf(dx), fabsf(dy)), fabsf(dz)) <= 0.0015f)
+	    break;
+    }
+    ea = dx * dy;
+    eb = dz * dz;
+    ec = ea - eb;
+    ed = ea - 6.0f * eb;
+    ee = ed + ec + ec;
+    return 3.0f * sum + fac * (1.0f + ed * (-3.0f / 14.0f + (9.0f / 88.0f) * ed - (9.0f / 52.0f) * dz * ee)
+			       + dz * ((1.0f / 6.0f) * ee + dz * (-(9.0f / 22.0f) * ec + dz * (3.0f / 26.0f) * ea)))
+	/ (ave * sqrtf(ave));
+}
+
+static inline float
+fast_ellint_rc (float x, float y)
+{
+    float xt, yt, w, ave, s;
+
+    if (y > 0.0f)
+    {
+	xt = x;
+	yt = y;
+	w = 1.0f;
+    }
+    else
+    {
+	xt = x - y;
+	yt = -y;
+	w = sqrtf(x) / sqrtf(xt);
+    }
+    for (;;)
+    {
+	float lambda = 2.0f * sqrtf(xt) * sqrtf(yt) + yt;
+
+	xt = 0.25f * (xt + lambda);
+	yt = 0.25f * (yt + lambda);
+	ave = (xt + yt + yt) * (1.0f / 3.0f);
+	s = (yt - ave) / ave;
+	if (fabsf(s) <= 0.0012f)
+	    break;
+    }
+    return w * (1.0f + s * s * (0.3f + s * (1.0f / 7.0f + s * (0.375f + s * (9.0f / 22.0f))))) / sqrtf(ave);
+}
+
+static inline float
+fast_ellint_rj (float x, float y, float z, float p)
+{
+    float xt = x, yt = y, zt = z, pt = p, sum = 0.0f, fac = 1.0f, ave, dx, dy, dz, dp;
+    float ea, eb, ec, ed, ee;
+
+    for (;;)
+    {
+	float sx = sqrtf(xt), sy = sqrtf(yt), sz = sqrtf(zt);
+	float lambda = sx * (sy + sz) + sy * sz;
+	float alpha = pt * (sx + sy + sz) + sx * sy * sz;
+	float beta = pt * (pt + lambda) * (pt + lambda);
+
+	alpha *= alpha;
+	sum += fac * fast_ellint_rc(alpha, beta);
+	fac *= 0.25f;
+	xt = 0.25f * (xt + lambda);
+	yt = 0.25f * (yt + lambda);
+	zt = 0.25f * (zt + lambda);
+	pt = 0.25f * (pt + lambda);
+	ave = 0.2f * (xt + yt + zt + pt + pt);
+	dx = (ave - xt) / ave;
+	dy = (ave - yt) / ave;
+	dz = (ave - zt) / ave;
+	dp = (ave - pt) / ave;
+	if (fmaxf(fmaxf(fabsf(dx), fabsf(dy)), fmaxf(fabsf(dz), fabsf(dp))) <= 0.0015f)
+	    break;
+    }
+    ea = dx * (dy + dz) + dy * dz;
+    eb = dx * dy * dz;
+    ec = dp * dp;
+    ed = ea - 3.0f * ec;
+    ee = eb + 2.0f * dp * (ea - ec);
+    return 3.0f * sum + fac * (1.0f + ed * (-3.0f / 14.0f + (9.0f / 88.0f) * ed - (9.0f / 52.0f) * ee)
+			       + eb * (1.0f / 6.0f + dp * (-3.0f / 11.0f + dp * (3.0f / 26.0f)))
+			       + dp * ea * (1.0f / 3.0f - dp * (3.0f / 22.0f)) - (1.0f / 3.0f) * dp * ec)
+	/ (ave * sqrtf(ave));
+}
+
+/* Legendre forms, in GSL's conventions.  The Carlson forms only
+   hold for |phi| <= pi/2, so phi is reduced to m pi + r with |r| <=
+   pi/2 first, using that each integral grows by twice the complete
+   one every pi. */
+static inline float
+fast_ellint_Kcomp (float k)
+{
+    return fast_ellint_rf(0.0f, 1.0f - k * k, 1.0f);
+}
+
+static inline float
+fast_ellint_Ecomp (float k)
+{
+    float k2 = k * k;
+
+    return fast_ellint_rf(0.0f, 1.0f - k2, 1.0f) - k2 * (1.0f / 3.0f) * fast_ellint_rd(0.0f, 1.0f - k2, 1.0f);
+}
+
+static inline float
+fast_ellint_reduce (float phi, float *m)
+{
+    /* in double, so that r keeps its precision for large phi */
+    double md = rint(phi * (1.0 / 3.14159265358979323846));
+
+    *m = (float)md;
+    return (float)(phi - md * 3.14159265358979323846);
+}
+
+static inline float
+fast_ellint_F (float phi, float k)
+{
+    float m, r = fast_ellint_reduce(phi, &m);
+    float s = fast_sinf(r), c = fast_cosf(r);
+    float f = s * fast_ellint_rf(c * c, 1.0f - k * k * s * s, 1.0f);
+
+    if (m != 0.0f)
+	f += 2.0f * m * fast_ellint_Kcomp(k);
+    return f;
+}
+
+static inline float
+fast_ellint_E (float phi, float k)
+{
+    float m, r = fast_ellint_reduce(phi, &m);
+    float s = fast_sinf(r), c = fast_cosf(r);
+    float k2 = k * k, d = 1.0f - k2 * s * s;
+    float e = s * fast_ellint_rf(c * c, d, 1.0f) - k2 * s * s * s * (1.0f / 3.0f) * fast_ellint_rd(c * c, d, 1.0f);
+
+    if (m != 0.0f)
+	e += 2.0f * m * fast_ellint_Ecomp(k);
+    return e;
+}
+
+static inline float
+fast_ellint_P (float phi, float k, float n)
+{
+    float m, r = fast_ellint_reduce(phi, &m);
+    float s = fast_sinf(r), c = fast_cosf(r);
+    float d = 1.0f - k * k * s * s;
+    float p = s * fast_ellint_rf(c * c, d, 1.0f)
+	- n * s * s * s * (1.0f / 3.0f) * fast_ellint_rj(c * c, d, 1.0f, 1.0f + n * s * s);
+
+    if (m != 0.0f)
+    {
+	float kc2 = 1.0f - k * k;
+
+	p += 2.0f * m * (fast_ellint_rf(0.0f, kc2, 1.0f)
+			 - n * (1.0f / 3.0f) * fast_ellint_rj(0.0f, kc2, 1.0f, 1.0f + n));
+    }
+    return p;
+}
+
+static inline float
+fast_ellint_D (float phi, float k)
+{
+    float m, r = fast_ellint_reduce(phi, &m);
+    float s = fast_sinf(r), c = fast_cosf(r);
+    float d = s * s * s * (1.0f / 3.0f) * fast_ellint_rd(c * c, 1.0f - k * k * s * s, 1.0f);
+
+    if (m != 0.0f)
+	d += 2.0f * m * (1.0f / 3.0f) * fast_ellint_rd(0.0f, 1.0f - k * k, 1.0f);
+    return d;
+}
+
+/* complex functions */
+static inline float _Complex
+fast_cexpf (float _Complex z)
+{
+    float e = fast_expf(crealf(z));
+
+    return e * fast_cosf(cimagf(z)) + e * fast_sinf(cimagf(z)) * I;
+}
+
+static inline float _Complex
+fast_clogf (float _Complex z)
+{
+    return fast_logf(hypotf(crealf(z), cimagf(z))) + fast_atan2f(cimagf(z), crealf(z)) * I;
+}
+
+static inline float _Complex
+fast_cpowf (float _Complex z, float _Complex w)
+{
+    if (z == 0.0f)
+	return 0.0f;
+    return fast_cexpf(w * fast_clogf(z));
+}
+
+static inline float _Complex
+fast_csinf (float _Complex z)
+{
+    float a = crealf(z), b = cimagf(z);
+    float ep = fast_expf(b), em = 1.0f / ep;
+
+    return fast_sinf(a) * 0.5f * (ep + em) + fast_cosf(a) * 0.5f * (ep - em) * I;
+}
+
+static inline float _Complex
+fast_ccosf (float _Complex z)
+{
+    float a = crealf(z), b = cimagf(z);
+    float ep = fast_expf(b), em = 1.0f / ep;
+
+    return fast_cosf(a) * 0.5f * (ep + em) - fast_sinf(a) * 0.5f * (ep - em) * I;
+}
+
+#endif
@@ -119,6 +119,8 @@
 				 r; })
 
 #define RAND(a,b)             (g_random_double_range((a), (b)))
+#define RAND_BEGIN_PIXEL()
+#define POOLS_STATS_BEGIN_PIXEL()
 #define CLAMP01(x)            (MAX(0,MIN(1,(x))))
 
 #define USERVAL_INT_ACCESS(x)        (ARG((x)).v.int_const)
@@ -0,0 +1,114 @@
+/*
+ * native.c
+ *
+ * MathMap
+ *
+ * Copyright (C) 2012 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "../../jump.h"
+#include "../../mathmap.h"
+
+#include "native.h"
+
+/* The filter code of a standalone renderer comes from the template of
+   the C backend, so it's the same code the JIT compiles. */
+#define JIT_TEMPLATE_FILENAME	"new_template.c"
+
+static void
+output_uservals (filter_t *filter, FILE *out)
+{
+    int i;
+
+    for (i = 0; i < filter->num_uservals; ++i)
+    {
+	userval_info_t *info;
+
+	for (info = filter->userval_infos; info != NULL; info = info->next)
+	    if (info->index == i)
+		break;
+	g_assert(info != NULL);
+
+	fprintf(out, "    { \"%s\", %d, ", info->name, info->type);
+	switch (info->type)
+	{
+	    case USERVAL_INT_CONST :
+		fprintf(out, "%d, %d, %d, 0 },\n",
+			info->v.int_const.min, info->v.int_const.max, info->v.int_const.default_value);
+		break;
+
+	    case USERVAL_FLOAT_CONST :
+		/* enough digits to get the same floats back */
+		fprintf(out, "%.9g, %.9g, %.9g, 0 },\n",
+			info->v.float_const.min, info->v.float_const.max, info->v.float_const.default_value);
+		break;
+
+	    case USERVAL_BOOL_CONST :
+		fprintf(out, "0, 1, %d, 0 },\n", info->v.bool_const.default_value);
+		break;
+
+	    case USERVAL_IMAGE :
+		fprintf(out, "0, 0, 0, 0x%x },\n", info->v.image.flags);
+		break;
+
+	    default :
+		fprintf(out, "0, 0, 0, 0 },\n");
+		break;
+	}
+    }
+}
+
+static int
+native_template_processor (mathmap_t *mathmap, const char *directive, const char *arg, FILE *out, void *data)
+{
+    if (strcmp(directive, "jit_code") == 0)
+    {
+	char *template_path = g_strdup_printf("%s/%s", TEMPLATE_DIR, JIT_TEMPLATE_FILENAME);
+
+	if (!process_template_file(mathmap, template_path, out, compiler_template_processor, data))
+	{
+	    fprintf(stderr, _("Could not process template file `%s'\n"), template_path);
+	    exit(1);
+	}
+
+	g_free(template_path);
+    }
+    else if (strcmp(directive, "precision_defines") == 0)
+    {
+	/* the JIT passes this with -D */
+	if (get_compile_precision() == MATHMAP_PRECISION_FAST)
+	    fputs("#define MATHMAP_FAST_MATH\n", out);
+    }
+    else if (strcmp(directive, "native_uservals") == 0)
+	output_uservals(mathmap->main_filter, out);
+    else
+	return compiler_template_processor(mathmap, directive, arg, out, data);
+    return 1;
+}
+
+int
+native_generate_plug_in (char *filter, char *output_filename)
+{
+    return generate_plug_in (filter, output_filename,
+			     "native_template.c", 1, native_template_processor);
+}
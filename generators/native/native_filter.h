@@ -0,0 +1,43 @@
+/*
+ * native_filter.h
+ *
+ * MathMap
+ *
+ * Copyright (C) 2012 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __NATIVE_FILTER_H__
+#define __NATIVE_FILTER_H__
+
+/* What a standalone renderer knows about the user values of its
+   filter.  The table is written by the native generator, in the order
+   of the user value indexes, and ends with an entry without a name.
+   The limits and default only apply to int, float and bool values. */
+typedef struct
+{
+    const char *name;
+    int type;			/* USERVAL_* */
+    double min;
+    double max;
+    double default_value;
+    unsigned int image_flags;
+} native_userval_t;
+
+extern const char native_filter_name[];
+extern const native_userval_t native_filter_uservals[];
+
+#endif
@@ -0,0 +1,498 @@
+/* -*- c -*- */
+
+/*
+ * native_main.c
+ *
+ * MathMap
+ *
+ * Copyright (C) 2012 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <glib.h>
+
+#include "../../mathmap.h"
+#include "../../userval.h"
+#include "../../drawable.h"
+#include "../../rwimg/readimage.h"
+#include "../../rwimg/writeimage.h"
+
+#include "native_filter.h"
+
+/* The main program of the standalone renderers made by the native
+   generator.  It's linked with the generated filter code and the
+   runtime, and renders still images the way the command line does. */
+
+/* from the generated code */
+mathfuncs_t mathmapinit (mathmap_invocation_t *invocation);
+
+typedef struct _cache_entry_t
+{
+    guchar *data;
+} cache_entry_t;
+
+/* Input images are decoded at a reduced size no smaller than this, if
+   their format allows it.  Zero means full size. */
+static int input_min_width = 0, input_min_height = 0;
+
+static char **define_names = NULL;
+static char **define_values = NULL;
+static int num_defines = 0;
+
+/*** host interface ***/
+
+color_t
+mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y)
+{
+    guchar *p;
+
+    g_assert (drawable != NULL);
+
+    if (x < 0 || x >= drawable->image.pixel_width)
+	return invocation->edge_color_x;
+    if (y < 0 || y >= drawable->image.pixel_height)
+	return invocation->edge_color_y;
+    if (frame < 0 || frame >= drawable->v.cmdline.num_frames)
+	return MAKE_RGBA_COLOR(255, 255, 255, 255);
+
+    p = drawable->v.cmdline.cache_entries[frame]->data + 3 * (drawable->image.pixel_width * y + x);
+
+    return MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+}
+
+guchar*
+mathmap_get_frame_data (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame,
+			int *row_stride, int *bpp)
+{
+    if (frame < 0 || frame >= drawable->v.cmdline.num_frames)
+	return NULL;
+
+    *row_stride = 3 * drawable->image.pixel_width;
+    *bpp = 3;
+
+    return drawable->v.cmdline.cache_entries[frame]->data;
+}
+
+/* the frames are never evicted */
+void
+mathmap_release_frame_data (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame)
+{
+}
+
+void
+drawable_get_pixel_inc (mathmap_invocation_t *invocation, input_drawable_t *drawable, int *inc_x, int *inc_y)
+{
+    *inc_x = *inc_y = 1;
+}
+
+gradient_t*
+get_default_gradient (void)
+{
+    return NULL;
+}
+
+input_drawable_t*
+get_default_input_drawable (void)
+{
+    return NULL;
+}
+
+void
+mathmap_message_dialog (const char *message)
+{
+    printf ("%s\n", message);
+}
+
+void
+save_debug_tuples (mathmap_invocation_t *invocation, int row, int col)
+{
+}
+
+void
+delete_expression_marker (void)
+{
+}
+
+/* Input images are decoded once and stay in memory, since there is
+   only one image to render. */
+input_drawable_t*
+alloc_cmdline_image_input_drawable (const char *filename)
+{
+    int width, height;
+    guchar *data = read_image_scaled(filename, input_min_width, input_min_height, &width, &height);
+    input_drawable_t *drawable;
+    cache_entry_t *cache_entry;
+
+    if (data == NULL)
+	return NULL;
+
+    drawable = alloc_input_drawable(INPUT_DRAWABLE_CMDLINE_IMAGE, width, height);
+
+    cache_entry = g_new(cache_entry_t, 1);
+    cache_entry->data = data;
+
+    drawable->v.cmdline.cache_entries = g_new(cache_entry_t*, 1);
+    drawable->v.cmdline.cache_entries[0] = cache_entry;
+    drawable->v.cmdline.num_frames = 1;
+    drawable->v.cmdline.image_filename = g_strdup(filename);
+
+    return drawable;
+}
+
+/*** the filter ***/
+
+static mathmap_t*
+make_filter_mathmap (void)
+{
+    mathmap_t *mathmap = g_new0(mathmap_t, 1);
+    filter_t *filter = g_new0(filter_t, 1);
+    const native_userval_t *userval;
+
+    filter->kind = FILTER_MATHMAP;
+    filter->name = g_strdup(native_filter_name);
+
+    /* registered in index order, so they get the same indexes */
+    for (userval = native_filter_uservals; userval->name != NULL; ++userval)
+    {
+	userval_info_t **infos = &filter->userval_infos;
+
+	switch (userval->type)
+	{
+	    case USERVAL_INT_CONST :
+		register_int_const(infos, userval->name,
+				   (int)userval->min, (int)userval->max, (int)userval->default_value);
+		break;
+
+	    case USERVAL_FLOAT_CONST :
+		register_float_const(infos, userval->name,
+				     userval->min, userval->max, userval->default_value);
+		break;
+
+	    case USERVAL_BOOL_CONST :
+		register_bool(infos, userval->name, (int)userval->default_value);
+		break;
+
+	    case USERVAL_COLOR :
+		register_color(infos, userval->name);
+		break;
+
+	    case USERVAL_CURVE :
+		register_curve(infos, userval->name);
+		break;
+
+	    case USERVAL_GRADIENT :
+		register_gradient(infos, userval->name);
+		break;
+
+	    case USERVAL_IMAGE :
+		register_image(infos, userval->name, userval->image_flags);
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+
+	++filter->num_uservals;
+    }
+
+    mathmap->filters = mathmap->main_filter = filter;
+    mathmap->initfunc = mathmapinit;
+
+    return mathmap;
+}
+
+static const char*
+lookup_define (const char *name)
+{
+    int i;
+
+    for (i = num_defines - 1; i >= 0; --i)
+	if (strcmp(define_names[i], name) == 0)
+	    return define_values[i];
+
+    return NULL;
+}
+
+/* Sets the user values of INVOCATION that are defined with -D.  Input
+   images must be defined.  Returns an error message, which must be
+   freed, if a value cannot be set. */
+static char*
+set_uservals_from_defines (mathmap_invocation_t *invocation)
+{
+    userval_info_t *info;
+
+    for (info = invocation->mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+    {
+	userval_t *userval = &invocation->uservals[info->index];
+	const char *value = lookup_define(info->name);
+	input_drawable_t *drawable;
+
+	if (value == NULL)
+	{
+	    if (info->type == USERVAL_IMAGE)
+		return g_strdup_printf(_("No value defined for input image `%s'."), info->name);
+	}
+	else
+	    switch (info->type)
+	    {
+		case USERVAL_INT_CONST :
+		    userval->v.int_const = atoi(value);
+		    break;
+
+		case USERVAL_FLOAT_CONST :
+		    userval->v.float_const = g_ascii_strtod(value, NULL);
+		    break;
+
+		case USERVAL_BOOL_CONST :
+		    userval->v.bool_const = (float)atoi(value);
+		    break;
+
+		case USERVAL_IMAGE :
+		    drawable = alloc_cmdline_image_input_drawable(value);
+		    if (drawable == NULL)
+			return g_strdup_printf(_("Cannot read input image `%s'."), value);
+		    assign_image_userval_drawable(info, userval, drawable);
+		    break;
+
+		default :
+		    return g_strdup(_("Can only define user values for types int, float, bool and image."));
+	    }
+    }
+
+    return NULL;
+}
+
+/*** main ***/
+
+static void
+usage (const char *program)
+{
+    printf(_("Usage: %s [option ...] <outfile>\n"
+	     "  renders the filter %s to <outfile>\n"
+	     "Options:\n"
+	     "  -D<name>=<value>            define user value\n"
+	     "  -i, --intersampling         use intersampling\n"
+	     "  -o, --oversampling          use oversampling\n"
+	     "  -s, --size=WIDTHxHEIGHT     sets the output image size\n"
+	     "  -j, --frame-threads=NUM     render with NUM threads\n"
+	     "      --interpolation=KIND    sample input images with KIND\n"
+	     "                              (bilinear, bicubic or lanczos)\n"
+	     "      --seed=NUM              seed rand() with NUM (default 0)\n"
+	     "      --help                  display this help and exit\n"),
+	   program, native_filter_name);
+}
+
+#define OPTION_HELP		256
+#define OPTION_INTERPOLATION	257
+#define OPTION_SEED		258
+
+int
+main (int argc, char *argv[])
+{
+    static struct option long_options[] =
+	{
+	    { "help", no_argument, 0, OPTION_HELP },
+	    { "intersampling", no_argument, 0, 'i' },
+	    { "oversampling", no_argument, 0, 'o' },
+	    { "size", required_argument, 0, 's' },
+	    { "frame-threads", required_argument, 0, 'j' },
+	    { "interpolation", required_argument, 0, OPTION_INTERPOLATION },
+	    { "seed", required_argument, 0, OPTION_SEED },
+	    { 0, 0, 0, 0 }
+	};
+
+    mathmap_t *mathmap;
+    mathmap_invocation_t *invocation;
+    userval_info_t *info;
+    image_t *closure;
+    mathmap_frame_t *frame;
+    guchar *output;
+    char *output_filename;
+    char *message;
+    int img_width = 0, img_height = 0;
+    gboolean size_is_set = FALSE;
+    int antialiasing = 0, supersampling = 0;
+    int interpolation = INTERPOLATION_BILINEAR;
+    guint32 rand_seed = 0;
+    int num_threads = get_num_cpus();
+    int c;
+
+    init_gettext();
+
+    define_names = g_new(char*, argc);
+    define_values = g_new(char*, argc);
+
+    while ((c = getopt_long(argc, argv, "D:ios:j:", long_options, NULL)) != -1)
+    {
+	char *p;
+
+	switch (c)
+	{
+	    case OPTION_HELP :
+		usage(argv[0]);
+		return 0;
+
+	    case OPTION_INTERPOLATION :
+		if (strcmp(optarg, "bilinear") == 0)
+		    interpolation = INTERPOLATION_BILINEAR;
+		else if (strcmp(optarg, "bicubic") == 0)
+		    interpolation = INTERPOLATION_BICUBIC;
+		else if (strcmp(optarg, "lanczos") == 0)
+		    interpolation = INTERPOLATION_LANCZOS;
+		else
+		{
+		    fprintf(stderr, _("Error: Unknown interpolation `%s'.  Use bilinear, bicubic or lanczos.\n"), optarg);
+		    return 1;
+		}
+		antialiasing = 1;
+		break;
+
+	    case OPTION_SEED :
+		rand_seed = strtoul(optarg, NULL, 0);
+		break;
+
+	    case 'D' :
+		p = strchr(optarg, '=');
+		if (p == NULL)
+		{
+		    fprintf(stderr, _("Error: Option to -D is malformed: `%s'.\n"), optarg);
+		    return 1;
+		}
+		define_names[num_defines] = g_strndup(optarg, p - optarg);
+		define_values[num_defines] = g_strdup(p + 1);
+		++num_defines;
+		break;
+
+	    case 'i' :
+		antialiasing = 1;
+		break;
+
+	    case 'o' :
+		supersampling = 1;
+		break;
+
+	    case 's' :
+		if (sscanf(optarg, "%dx%d", &img_width, &img_height) != 2 || img_width <= 0 || img_height <= 0)
+		{
+		    fprintf(stderr, _("Error: Invalid image size.  Syntax is <width>x<height>.  Example: 1024x768.\n"));
+		    return 1;
+		}
+		size_is_set = TRUE;
+		break;
+
+	    case 'j' :
+		num_threads = atoi(optarg);
+		if (num_threads <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of frame threads must be positive.\n"));
+		    return 1;
+		}
+		break;
+
+	    default :
+		usage(argv[0]);
+		return 1;
+	}
+    }
+
+    if (optind + 1 != argc)
+    {
+	usage(argv[0]);
+	return 1;
+    }
+    output_filename = argv[optind];
+
+    mathmap = make_filter_mathmap();
+
+    /* Input images are addressed in normalized coordinates, so they
+       only need as many pixels as the canvas has.  If the canvas size
+       comes from the first input, it's full size. */
+    if (size_is_set)
+    {
+	input_min_width = img_width;
+	input_min_height = img_height;
+    }
+    else
+	for (info = mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+	{
+	    const char *value;
+
+	    if (info->type != USERVAL_IMAGE)
+		continue;
+
+	    value = lookup_define(info->name);
+	    if (value == NULL)
+	    {
+		fprintf(stderr, _("Error: No value defined for input image `%s'.\n"), info->name);
+		return 1;
+	    }
+
+	    if (!probe_image_size(value, &img_width, &img_height))
+	    {
+		fprintf(stderr, _("Error: Could not read input image `%s'.\n"), value);
+		return 1;
+	    }
+
+	    size_is_set = TRUE;
+
+	    break;
+	}
+
+    if (!size_is_set)
+    {
+	fprintf(stderr, _("Error: Image size not set and no input images given.\n"));
+	return 1;
+    }
+
+    invocation = invoke_mathmap(mathmap, NULL, img_width, img_height, TRUE);
+
+    message = set_uservals_from_defines(invocation);
+    if (message != NULL)
+    {
+	fprintf(stderr, _("Error: %s\n"), message);
+	return 1;
+    }
+
+    invocation_set_interpolation(invocation, antialiasing ? interpolation : INTERPOLATION_NEAREST);
+    invocation->supersampling = supersampling;
+    invocation->output_bpp = 4;
+    invocation->rand_seed = rand_seed;
+
+    output = g_malloc((size_t)invocation->row_stride * img_height);
+
+    closure = closure_image_alloc(&invocation->mathfuncs, NULL,
+				  mathmap->main_filter->num_uservals, invocation->uservals,
+				  img_width, img_height);
+    frame = invocation_new_frame(invocation, closure, 0, 0.0);
+
+    call_invocation_parallel_and_join(frame, closure, 0, 0, img_width, img_height, output, num_threads);
+
+    invocation_free_frame(frame);
+    closure_image_free(closure);
+
+    write_image(output_filename, img_width, img_height, output,
+		invocation->output_bpp, invocation->row_stride, IMAGE_FORMAT_PNG);
+
+    g_free(output);
+    free_invocation(invocation);
+
+    return 0;
+}
@@ -134,6 +134,13 @@ static int
 my_atoi (const char *start, const char *stop)
 {
     int value = 0;
+    int sign = 1;
+
+    if (start < stop && *start == '-')
+    {
+	sign = -1;
+	++start;
+    }
 
     while (start < stop)
     {
@@ -141,7 +148,7 @@ my_atoi (const char *start, const char *stop)
 	++start;
     }
 
-    return value;
+    return sign * value;
 }
 
 #define SCAN_FUNC_NAME _scan_mmap
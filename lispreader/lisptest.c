@@ -1,5 +1,9 @@
 /* $Id: lisptest.c 191 2004-07-02 21:20:49Z schani $ */
 
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
 #include "lispreader.h"
 
 static lisp_object_t*
@@ -24,6 +28,51 @@ free_test (void)
     }
 }
 
+/* integers from mapped files are parsed by the reader itself */
+static void
+integer_test (void)
+{
+    static const char source[] = "(-42 0 17 -0 -2147483647)";
+    static const int expected[] = { -42, 0, 17, 0, -2147483647 };
+    char path[] = "/tmp/lisptestXXXXXX";
+    lisp_stream_t stream;
+    lisp_object_t *obj, *lst;
+    int fd, i;
+
+    fd = mkstemp(path);
+    if (fd == -1 || write(fd, source, strlen(source)) != (ssize_t)strlen(source))
+    {
+	fprintf(stderr, "cannot write %s\n", path);
+	exit(1);
+    }
+    close(fd);
+
+    if (lisp_stream_init_path(&stream, path) == 0)
+    {
+	fprintf(stderr, "cannot read %s\n", path);
+	exit(1);
+    }
+
+    obj = lisp_read(&stream);
+    for (lst = obj, i = 0; lisp_type(lst) == LISP_TYPE_CONS; lst = lisp_cdr(lst), ++i)
+	if (lisp_type(lisp_car(lst)) != LISP_TYPE_INTEGER || lisp_integer(lisp_car(lst)) != expected[i])
+	{
+	    fprintf(stderr, "integer %d read as ", expected[i]);
+	    lisp_dump(lisp_car(lst), stderr);
+	    fprintf(stderr, "\n");
+	    exit(1);
+	}
+    if (i != sizeof(expected) / sizeof(expected[0]))
+    {
+	fprintf(stderr, "read %d integers\n", i);
+	exit(1);
+    }
+
+    lisp_free(obj);
+    lisp_stream_free_path(&stream);
+    unlink(path);
+}
+
 int
 main (void)
 {
@@ -34,6 +83,7 @@ main (void)
     printf("\n");
 
     free_test();
+    integer_test();
 
     lisp_stream_init_file(&stream, stdin);
 
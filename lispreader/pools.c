@@ -24,8 +24,104 @@
 #include <stdio.h>
 #include <assert.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define USE_MMAP
+#include <sys/mman.h>
+#include <pthread.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifdef __linux__
+#define RELEASE_ZEROES_PAGES
+#endif
+#endif
+
 #include "pools.h"
 
+/* Pool chunks are anonymous mappings, which the kernel zeroes when
+   they are first touched.  Freed chunks are kept in a cache for the
+   next pools that need a chunk of the same size, so compiling or
+   reading over and over again doesn't map and fault in fresh memory
+   each time.  Small cached chunks stay resident and are cleared when
+   they're reused.  On Linux the pages of big ones are given back with
+   madvise(MADV_DONTNEED), which makes the kernel zero them again
+   lazily.  Other systems don't guarantee that, so there every reused
+   chunk is cleared. */
+
+#define CHUNK_CACHE_DEPTH          4
+#define FIRST_RELEASED_POOL        6      /* 1 MB with 64 bit longs */
+
+#ifdef USE_MMAP
+static long *chunk_cache[NUM_POOLS][CHUNK_CACHE_DEPTH];
+static int chunk_cache_fill[NUM_POOLS];
+static pthread_mutex_t chunk_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static size_t
+pool_byte_size (int index)
+{
+    return GRANULARITY * (FIRST_POOL_SIZE << index);
+}
+
+static long*
+alloc_chunk (int index)
+{
+    size_t byte_size = pool_byte_size(index);
+#ifdef USE_MMAP
+    void *p = 0;
+
+    pthread_mutex_lock(&chunk_cache_mutex);
+    if (chunk_cache_fill[index] > 0)
+	p = chunk_cache[index][--chunk_cache_fill[index]];
+    pthread_mutex_unlock(&chunk_cache_mutex);
+
+    if (p != 0)
+    {
+#ifdef RELEASE_ZEROES_PAGES
+	if (index < FIRST_RELEASED_POOL)
+#endif
+	    memset(p, 0, byte_size);
+	return (long*)p;
+    }
+
+    p = mmap(0, byte_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+	return 0;
+
+    return (long*)p;
+#else
+    return (long*)calloc(1, byte_size);
+#endif
+}
+
+static void
+free_chunk (int index, long *chunk)
+{
+#ifdef USE_MMAP
+    size_t byte_size = pool_byte_size(index);
+
+#ifdef RELEASE_ZEROES_PAGES
+    if (index >= FIRST_RELEASED_POOL)
+	madvise(chunk, byte_size, MADV_DONTNEED);
+#endif
+
+    pthread_mutex_lock(&chunk_cache_mutex);
+    if (chunk_cache_fill[index] < CHUNK_CACHE_DEPTH)
+    {
+	chunk_cache[index][chunk_cache_fill[index]++] = chunk;
+	chunk = 0;
+    }
+    pthread_mutex_unlock(&chunk_cache_mutex);
+
+    if (chunk != 0)
+	munmap(chunk, byte_size);
+#else
+    free(chunk);
+#endif
+}
+
 int
 init_pools (pools_t *pools)
 {
@@ -33,23 +129,60 @@ init_pools (pools_t *pools)
 
     pools->active_pool = 0;
     pools->fill_ptr = 0;
+    pools->bytes_requested = 0;
+    pools->high_water = 0;
+    pools->num_growths = 0;
 
     for (i = 0; i < NUM_POOLS; ++i)
 	pools->pools[i] = 0;
 
-    pools->pools[0] = (long*)malloc(GRANULARITY * FIRST_POOL_SIZE);
+    pools->pools[0] = alloc_chunk(0);
     if (pools->pools[0] == 0)
 	return 0;
 
-    memset(pools->pools[0], 0, GRANULARITY * FIRST_POOL_SIZE);
-
     return 1;
 }
 
+/* The bytes up to the fill pointer, counting the unused ends of the
+   pools that were moved past. */
+size_t
+_pools_bytes_in_use (pools_t *pools)
+{
+    size_t bytes = pools->fill_ptr;
+    int i;
+
+    for (i = 0; i < pools->active_pool; ++i)
+	if (pools->pools[i] != 0)
+	    bytes += FIRST_POOL_SIZE << i;
+
+    return bytes * GRANULARITY;
+}
+
+void
+pools_get_statistics (pools_t *pools, pools_statistics_t *stats)
+{
+    size_t in_use = _pools_bytes_in_use(pools);
+    int i;
+
+    stats->bytes_requested = pools->bytes_requested;
+    stats->high_water = in_use > pools->high_water ? in_use : pools->high_water;
+    stats->num_growths = pools->num_growths;
+
+    stats->bytes_reserved = 0;
+    for (i = 0; i < NUM_POOLS; ++i)
+	if (pools->pools[i] != 0)
+	    stats->bytes_reserved += pool_byte_size(i);
+}
+
 #ifndef __GNUC__
 void
 reset_pools (pools_t *pools)
 {
+    size_t in_use = _pools_bytes_in_use(pools);
+
+    if (in_use > pools->high_water)
+	pools->high_water = in_use;
+
     pools->active_pool = 0;
     pools->fill_ptr = 0;
 }
@@ -63,7 +196,7 @@ free_pools (pools_t *pools)
     /* printf("alloced %d pools\n", active_pool + 1); */
     for (i = 0; i < NUM_POOLS; ++i)
 	if (pools->pools[i] != 0)
-	    free(pools->pools[i]);
+	    free_chunk(i, pools->pools[i]);
 }
 
 #ifdef __GNUC__
@@ -90,22 +223,17 @@ pools_alloc (pools_t *pools, size_t byte_size)
 	pools->fill_ptr = 0;
 
 	new_pool_size = FIRST_POOL_SIZE << pools->active_pool;
-	/* TODO: if the requested block is too big to fit into the
-	   pool to be allocated, it should simply be skipped, which
-	   would save memory. */
-	if (pools->pools[pools->active_pool] == 0)
+	/* a pool that's too small for the requested block is skipped
+	   without being allocated */
+	if (size < new_pool_size && pools->pools[pools->active_pool] == 0)
 	{
-	    size_t new_pool_byte_size = GRANULARITY * new_pool_size;
-
-	    /* printf("allocing pool %d with size %ld\n", pools->active_pool, (long)new_pool_byte_size); */
+	    /* printf("allocing pool %d with size %ld\n", pools->active_pool, (long)pool_byte_size(pools->active_pool)); */
 
-	    pools->pools[pools->active_pool] = (long*)malloc(new_pool_byte_size);
+	    pools->pools[pools->active_pool] = alloc_chunk(pools->active_pool);
 	    if (pools->pools[pools->active_pool] == 0)
 		return 0;
-	    /* FIXME: either remove the memset here or memset the pool
-	       even if it's not newly allocated, because pools can be
-	       reset. */
-	    memset(pools->pools[pools->active_pool], 0, new_pool_byte_size);
+
+	    ++pools->num_growths;
 	}
 	pool_size = new_pool_size;
     }
@@ -114,6 +242,7 @@ pools_alloc (pools_t *pools, size_t byte_size)
 
     p = pools->pools[pools->active_pool] + pools->fill_ptr;
     pools->fill_ptr += size;
+    pools->bytes_requested += byte_size;
 
     return p;
 }
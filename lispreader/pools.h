@@ -35,10 +35,23 @@ typedef struct
     int active_pool;
     size_t fill_ptr;
     long *pools[NUM_POOLS];
+    size_t bytes_requested;	/* since init, not reset by reset_pools() */
+    size_t high_water;		/* in bytes, as of the last reset */
+    int num_growths;
 } pools_t;
 
+typedef struct
+{
+    size_t bytes_requested;
+    size_t bytes_reserved;
+    size_t high_water;
+    int num_growths;
+} pools_statistics_t;
+
 int init_pools (pools_t *pools);
 void free_pools (pools_t *pools);
+size_t _pools_bytes_in_use (pools_t *pools);
+void pools_get_statistics (pools_t *pools, pools_statistics_t *stats);
 
 #ifdef __GNUC__
 void* _pools_alloc (pools_t *pools, size_t size);
@@ -54,6 +67,7 @@ pools_alloc (pools_t *pools, size_t size)
 
     p = pools->pools[pools->active_pool] + pools->fill_ptr;
     pools->fill_ptr += padded_size;
+    pools->bytes_requested += size;
 
     return p;
 }
@@ -65,6 +79,11 @@ void* pools_alloc (pools_t *pools, size_t size);
 static inline void
 reset_pools (pools_t *pools)
 {
+    size_t in_use = _pools_bytes_in_use(pools);
+
+    if (in_use > pools->high_water)
+	pools->high_water = in_use;
+
     pools->active_pool = 0;
     pools->fill_ptr = 0;
 }
@@ -147,6 +147,8 @@
 #define FLAG_SUPERSAMPLING      2
 #define FLAG_ANIMATION          4
 #define FLAG_PERIODIC           8
+#define FLAG_SPECIALIZE         16
+#define FLAG_PROFILE            32
 
 #define MAX_EXPRESSION_LENGTH   65536
 
@@ -195,6 +197,8 @@ static void dialog_text_changed (GtkTextBuffer * buffer, gpointer user_data);
 static void dialog_text_update (void);
 static void dialog_antialiasing_update (GtkWidget *widget, gpointer data);
 static void dialog_supersampling_update (GtkWidget *widget, gpointer data);
+static void dialog_specialize_update (GtkWidget *widget, gpointer data);
+static void dialog_profile_update (GtkWidget *widget, gpointer data);
 static void dialog_auto_preview_update (GtkWidget *widget, gpointer data);
 static void dialog_fast_preview_update (GtkWidget *widget, gpointer data);
 static void dialog_edge_behaviour_update (GtkWidget *widget, gpointer data);
@@ -233,7 +237,7 @@ GimpPlugInInfo PLUG_IN_INFO = {
 
 
 static mathmap_vals_t mmvals = {
-	FLAG_ANTIALIASING | FLAG_PERIODIC, /* flags */
+	FLAG_ANTIALIASING | FLAG_PERIODIC | FLAG_SPECIALIZE, /* flags */
 	DEFAULT_NUMBER_FRAMES,	/* frames */
 	0.0,			/* t */
 	DEFAULT_EXPRESSION	/* expression */
@@ -635,6 +639,9 @@ run (const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals
     GimpDrawable *gimp_drawable;
     int default_preview_width, default_preview_height;
 
+    if (getenv("MATHMAP_TRACE") != NULL)
+	mathmap_trace_open(getenv("MATHMAP_TRACE"));
+
     init_mathmap_engine();
 
     if (strncmp(name, "mathmap_", 8) == 0)
@@ -975,13 +982,38 @@ update_gradient (void)
 
 /*****/
 
+static char**
+get_support_paths (void)
+{
+    static char *support_paths[3];
+
+    if (!support_paths[0])
+    {
+	support_paths[0] = get_rc_file_name(NULL, FALSE);
+	support_paths[1] = get_rc_file_name(NULL, TRUE);
+	support_paths[2] = NULL;
+    }
+
+    return support_paths;
+}
+
+static void
+set_invocation_options (mathmap_invocation_t *invocation)
+{
+    invocation_set_antialiasing(invocation, mmvals.flags & FLAG_ANTIALIASING);
+    invocation->supersampling = mmvals.flags & FLAG_SUPERSAMPLING;
+
+    invocation->edge_behaviour_x = edge_behaviour_x_mode;
+    invocation->edge_behaviour_y = edge_behaviour_y_mode;
+    invocation->edge_color_x = MAKE_RGBA_COLOR_FLOAT(edge_color_x.r, edge_color_x.g, edge_color_x.b, edge_color_x.a);
+    invocation->edge_color_y = MAKE_RGBA_COLOR_FLOAT(edge_color_y.r, edge_color_y.g, edge_color_y.b, edge_color_y.a);
+}
+
 static gboolean
 generate_code (void)
 {
     if (expression_changed)
     {
-	static char *support_paths[3];
-
 	mathmap_t *new_mathmap;
 
 	if (run_mode == GIMP_RUN_INTERACTIVE && expression_entry != 0)
@@ -990,14 +1022,8 @@ generate_code (void)
 	if (mathmap != 0)
 	    unload_mathmap(mathmap);
 
-	if (!support_paths[0])
-	{
-	    support_paths[0] = get_rc_file_name(NULL, FALSE);
-	    support_paths[1] = get_rc_file_name(NULL, TRUE);
-	    support_paths[2] = NULL;
-	}
-
-	new_mathmap = compile_mathmap(mmvals.expression, support_paths, DEFAULT_OPTIMIZATION_TIMEOUT, FALSE);
+	set_compile_profiling(mmvals.flags & FLAG_PROFILE ? TRUE : FALSE);
+	new_mathmap = compile_mathmap(mmvals.expression, get_support_paths(), DEFAULT_OPTIMIZATION_TIMEOUT, FALSE);
 
 	if (new_mathmap == 0)
 	{
@@ -1045,19 +1071,38 @@ generate_code (void)
     }
 
     if (invocation != 0)
-    {
-	invocation_set_antialiasing(invocation, mmvals.flags & FLAG_ANTIALIASING);
-	invocation->supersampling = mmvals.flags & FLAG_SUPERSAMPLING;
-
-	invocation->edge_behaviour_x = edge_behaviour_x_mode;
-	invocation->edge_behaviour_y = edge_behaviour_y_mode;
-	invocation->edge_color_x = MAKE_RGBA_COLOR_FLOAT(edge_color_x.r, edge_color_x.g, edge_color_x.b, edge_color_x.a);
-	invocation->edge_color_y = MAKE_RGBA_COLOR_FLOAT(edge_color_y.r, edge_color_y.g, edge_color_y.b, edge_color_y.a);
-    }
+	set_invocation_options(invocation);
 
     return invocation != 0;
 }
 
+/* For the final render we compile a version of the mathmap with the
+   current userval values as constants.  Returns the invocation to
+   render with, which is the preview invocation if specialization is
+   disabled or not possible. */
+static mathmap_invocation_t*
+make_final_render_invocation (void)
+{
+    mathmap_t *specialized;
+    mathmap_invocation_t *specialized_invocation;
+
+    if (!(mmvals.flags & FLAG_SPECIALIZE))
+	return invocation;
+
+    specialized = specialize_mathmap(mathmap, mmvals.expression, invocation->uservals,
+				     get_support_paths(), DEFAULT_OPTIMIZATION_TIMEOUT);
+    if (specialized == mathmap)
+	return invocation;
+
+    specialized_invocation = invoke_mathmap(specialized, invocation, sel_width, sel_height, TRUE);
+    g_assert(specialized_invocation != NULL);
+
+    specialized_invocation->output_bpp = invocation->output_bpp;
+    set_invocation_options(specialized_invocation);
+
+    return specialized_invocation;
+}
+
 /*****/
 
 static void
@@ -1146,9 +1191,11 @@ do_mathmap (int frame_num, float current_t)
 
     if (generate_code())
     {
+	mathmap_invocation_t *render_invocation = make_final_render_invocation();
 	mathmap_frame_t *frame;
-	image_t *closure = closure_image_alloc(&invocation->mathfuncs, NULL,
-					       invocation->mathmap->main_filter->num_uservals, invocation->uservals,
+	image_t *closure = closure_image_alloc(&render_invocation->mathfuncs, NULL,
+					       render_invocation->mathmap->main_filter->num_uservals,
+					       render_invocation->uservals,
 					       sel_width, sel_height);
 
 	/* Initialize pixel region */
@@ -1164,7 +1211,7 @@ do_mathmap (int frame_num, float current_t)
 	    strcpy(progress_info, _("Mathmapping..."));
 	gimp_progress_init(progress_info);
 
-	frame = invocation_new_frame(invocation, closure,
+	frame = invocation_new_frame(render_invocation, closure,
 				     frame_num, current_t);
 
 	for (pr = gimp_pixel_rgns_register(1, &dest_rgn);
@@ -1175,8 +1222,8 @@ do_mathmap (int frame_num, float current_t)
 	    int region_width = dest_rgn.w;
 	    int region_height = dest_rgn.h;
 
-	    invocation->row_stride = dest_rgn.rowstride;
-	    invocation->output_bpp = gimp_drawable_bpp(GIMP_DRAWABLE_ID(output_drawable));
+	    render_invocation->row_stride = dest_rgn.rowstride;
+	    render_invocation->output_bpp = gimp_drawable_bpp(GIMP_DRAWABLE_ID(output_drawable));
 
 	    call_invocation_parallel_and_join(frame, closure, region_x, region_y, region_width, region_height,
 					      dest_rgn.data, NUM_FINAL_RENDER_CPUS);
@@ -1195,6 +1242,9 @@ do_mathmap (int frame_num, float current_t)
 	gimp_drawable_update(GIMP_DRAWABLE_ID(output_drawable), sel_x1, sel_y1, sel_width, sel_height);
 
 	closure_image_free(closure);
+
+	if (render_invocation->mathmap != mathmap)
+	    free_invocation(render_invocation);
     }
 } /* mathmap */
 
@@ -1324,6 +1374,25 @@ mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable,
 	return get_pixel(invocation, drawable, frame, x, y);
 }
 
+/* GIMP tiles aren't contiguous, so only the command line's decoded
+   frames are handed out. */
+guchar*
+mathmap_get_frame_data (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame,
+			int *row_stride, int *bpp)
+{
+    if (cmd_line_mode)
+	return cmdline_mathmap_get_frame_data(invocation, drawable, frame, row_stride, bpp);
+    return NULL;
+}
+
+void
+mathmap_release_frame_data (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame)
+{
+    g_assert(cmd_line_mode);
+
+    cmdline_mathmap_release_frame_data(invocation, drawable, frame);
+}
+
 void
 drawable_get_pixel_inc (mathmap_invocation_t *invocation, input_drawable_t *drawable, int *inc_x, int *inc_y)
 {
@@ -1785,7 +1854,7 @@ mathmap_dialog (int mutable_expression)
 
             /* Sampling */
 
-            table = gtk_table_new(2, 1, FALSE);
+            table = gtk_table_new(4, 1, FALSE);
 	    gtk_container_border_width(GTK_CONTAINER(table), 6);
 	    gtk_table_set_row_spacings(GTK_TABLE(table), 4);
 
@@ -1817,6 +1886,26 @@ mathmap_dialog (int mutable_expression)
 				   (GtkSignalFunc)dialog_supersampling_update, 0);
 		gtk_widget_show(toggle);
 
+		/* Specialization */
+
+		toggle = gtk_check_button_new_with_label(_("Specialize final render"));
+		gtk_toggle_button_set_state(GTK_TOGGLE_BUTTON(toggle),
+					    mmvals.flags & FLAG_SPECIALIZE);
+		gtk_table_attach(GTK_TABLE(table), toggle, 0, 1, 2, 3, GTK_FILL, 0, 0, 0);
+		gtk_signal_connect(GTK_OBJECT(toggle), "toggled",
+				   (GtkSignalFunc)dialog_specialize_update, 0);
+		gtk_widget_show(toggle);
+
+		/* Profiling */
+
+		toggle = gtk_check_button_new_with_label(_("Mark hot spot"));
+		gtk_toggle_button_set_state(GTK_TOGGLE_BUTTON(toggle),
+					    mmvals.flags & FLAG_PROFILE);
+		gtk_table_attach(GTK_TABLE(table), toggle, 0, 1, 3, 4, GTK_FILL, 0, 0, 0);
+		gtk_signal_connect(GTK_OBJECT(toggle), "toggled",
+				   (GtkSignalFunc)dialog_profile_update, 0);
+		gtk_widget_show(toggle);
+
 	    /* Preview Options */
 
             table = gtk_table_new(2, 1, FALSE);
@@ -2129,6 +2218,9 @@ recalculate_preview (void)
 	frame->frame_render_width = preview_width;
 	frame->frame_render_height = preview_height;
 
+	if (invocation->mathmap->profile_regions != NULL)
+	    mathmap_profile_start(invocation->mathmap);
+
 	if (previewing)
 	    call_invocation_parallel_and_join(frame, closure, 0, 0, preview_width, preview_height,
 					      buf, get_num_cpus());
@@ -2138,6 +2230,15 @@ recalculate_preview (void)
 
 	invocation_free_frame(frame);
 
+	if (invocation->mathmap->profile_regions != NULL)
+	{
+	    scanner_region_t region;
+
+	    if (mathmap_profile_hottest_region(invocation->mathmap, &region))
+		set_expression_marker(region.start.row, region.start.column,
+				      region.end.row, region.end.column);
+	}
+
 	invocation->render_width = old_render_width;
 	invocation->render_height = old_render_height;
 
@@ -2312,6 +2413,34 @@ dialog_supersampling_update (GtkWidget *widget, gpointer data)
 
 /*****/
 
+static void
+dialog_specialize_update (GtkWidget *widget, gpointer data)
+{
+    mmvals.flags &= ~FLAG_SPECIALIZE;
+
+    if (GTK_TOGGLE_BUTTON(widget)->active)
+	mmvals.flags |= FLAG_SPECIALIZE;
+}
+
+/*****/
+
+static void
+dialog_profile_update (GtkWidget *widget, gpointer data)
+{
+    mmvals.flags &= ~FLAG_PROFILE;
+
+    if (GTK_TOGGLE_BUTTON(widget)->active)
+	mmvals.flags |= FLAG_PROFILE;
+
+    /* the counters are compiled in */
+    expression_changed = 1;
+
+    if (auto_preview)
+	dialog_update_preview();
+}
+
+/*****/
+
 static void
 dialog_auto_preview_update (GtkWidget *widget, gpointer data)
 {
@@ -51,6 +51,9 @@
 #define IMAGE_FLAG_UNIT		0x0001 /* unit coordinate system (vs. pixel) */
 #define IMAGE_FLAG_SQUARE	0x0002 /* square pixels */
 
+#define MATHMAP_PRECISION_PRECISE	0 /* libm and GSL in double precision */
+#define MATHMAP_PRECISION_FAST		1 /* float approximations from fastmath.h */
+
 #define FILTER_MATHMAP		1
 #define FILTER_NATIVE		2
 
@@ -79,6 +82,10 @@ typedef struct _filter_t
 	    variable_t *variables;
 
 	    top_level_decl_t *decl;
+
+	    /* set by the compiler if the output is the same for all
+	       frames, provided the input images are stills */
+	    gboolean is_t_invariant;
 	} mathmap;
 	struct
 	{
@@ -92,6 +99,35 @@ typedef struct _filter_t
     struct _filter_t *next;
 } filter_t;
 
+/* TEMPLATE profiling */
+typedef struct
+{
+    unsigned long long count;
+    unsigned long long cycles;
+} profile_counter_t;
+
+profile_counter_t* mathmap_profile_counters (void);
+unsigned long long mathmap_profile_ticks (void);
+/* END */
+
+/* TEMPLATE pools_statistics */
+void* mathmap_pools_alloc_accounted (mathmap_pools_t *pools, size_t size);
+void mathmap_pools_stats_begin_pixel (mathmap_pools_t *pools);
+/* END */
+
+/* TEMPLATE tracing */
+double mathmap_trace_begin (void);
+void mathmap_trace_end (const char *name, const char *category, double start);
+/* END */
+
+/* The source regions of a mathmap compiled for profiling.  Counter I
+   of the generated code is for REGIONS[I]. */
+typedef struct _profile_regions_t
+{
+    int num_regions;
+    scanner_region_t *regions;
+} profile_regions_t;
+
 /* TEMPLATE mathmap */
 typedef struct _mathmap_t
 {
@@ -100,6 +136,7 @@ typedef struct _mathmap_t
     filter_t *main_filter;
 
     unsigned int flags;
+    int precision;		/* MATHMAP_PRECISION_* it was compiled with */
 
     /* for CC */
     initfunc_t initfunc;
@@ -108,6 +145,15 @@ typedef struct _mathmap_t
 
     void *module_info;
 
+    /* If non-NULL, the scalar uservals of the main filter were
+       compiled in as constants with these values. */
+    userval_t *constant_uservals;
+    /* Specialized versions of this mathmap, linked by next. */
+    struct _mathmap_t *specializations;
+
+    /* non-NULL if compiled with profiling counters */
+    struct _profile_regions_t *profile_regions;
+
     struct _mathmap_t *next;
 } mathmap_t;
 /* END */
@@ -129,6 +175,103 @@ extern color_t gradient_samples[USER_GRADIENT_POINTS];
 extern int fast_image_source_scale;
 #endif
 
+/* Wall-clock seconds spent in the phases of the last compile, for
+   benchmarking.  Each field is reset when its phase starts. */
+typedef struct
+{
+    double parse;
+    double optimize;
+    double codegen;
+    double cc;
+    double link;
+    double load;
+} compile_timings_t;
+
+extern compile_timings_t last_compile_timings;
+
+double mathmap_wall_time (void);
+
+gboolean mathmap_trace_open (const char *filename);
+void mathmap_trace_close (void);
+void mathmap_trace_instant (const char *name, const char *category);
+
+#define PERF_COUNTER_CYCLES		0
+#define PERF_COUNTER_INSTRUCTIONS	1
+#define PERF_COUNTER_CACHE_MISSES	2
+#define PERF_COUNTER_BRANCH_MISSES	3
+#define PERF_COUNTER_PAGE_FAULTS	4
+#define NUM_PERF_COUNTERS		5
+
+/* Hardware and software event counts.  Counters the host doesn't
+   allow are marked invalid. */
+typedef struct
+{
+    guint64 values[NUM_PERF_COUNTERS];
+    gboolean valid[NUM_PERF_COUNTERS];
+} perf_counts_t;
+
+typedef struct
+{
+    int fds[NUM_PERF_COUNTERS];
+} perf_counter_group_t;
+
+/* Kinds of threads counted per thread.  Each kind has its own range
+   of thread indexes. */
+#define PERF_THREAD_BAND		0	/* renders a band of rows */
+#define PERF_THREAD_FRAME		1	/* renders whole frames */
+#define NUM_PERF_THREAD_KINDS		2
+
+extern const char *perf_counter_names[NUM_PERF_COUNTERS];
+extern const char *perf_thread_kind_names[NUM_PERF_THREAD_KINDS];
+
+gboolean perf_counters_open (perf_counter_group_t *group, gboolean inherit);
+void perf_counters_read (perf_counter_group_t *group, perf_counts_t *counts);
+void perf_counters_close (perf_counter_group_t *group);
+void perf_counts_add (perf_counts_t *sum, perf_counts_t *counts);
+
+void perf_counters_enable_per_thread (int max_threads);
+int perf_counters_get_per_thread (int kind, perf_counts_t **counts);
+gboolean perf_counters_begin_thread (perf_counter_group_t *group, int kind, int thread_index,
+				     gboolean inherit);
+void perf_counters_end_thread (perf_counter_group_t *group, int kind, int thread_index);
+
+#define POOLS_ROLE_INVOCATION	0
+#define POOLS_ROLE_FRAME	1
+#define POOLS_ROLE_SLICE	2
+#define POOLS_ROLE_PIXEL	3
+#define POOLS_ROLE_CLOSURE	4
+#define POOLS_ROLE_COMPILER	5
+#define POOLS_ROLE_OTHER	6
+#define NUM_POOLS_ROLES		7
+
+/* Pool usage summed over all instances of a role since statistics were
+   enabled.  HIGH_WATER is that of the instance that
+   got fullest.  BYTES_RESERVED and NUM_GROWTHS are estimates, except
+   for the compiler's pools. */
+typedef struct
+{
+    guint64 num_instances;
+    guint64 num_allocs;
+    guint64 bytes_requested;
+    guint64 bytes_reserved;
+    guint64 num_growths;
+    guint64 high_water;
+} pools_role_statistics_t;
+
+void set_pools_statistics (gboolean enabled);
+gboolean get_pools_statistics (void);
+void mathmap_pools_stats_register (mathmap_pools_t *pools, int role);
+void mathmap_pools_stats_reset (mathmap_pools_t *pools);
+void mathmap_pools_stats_unregister (mathmap_pools_t *pools);
+void mathmap_pools_stats_add_instance (int role, guint64 bytes_requested, guint64 bytes_reserved,
+				       guint64 high_water, guint64 num_growths);
+void mathmap_pools_get_statistics (pools_role_statistics_t stats[NUM_POOLS_ROLES]);
+void mathmap_pools_print_statistics (FILE *out);
+
+void mathmap_profile_start (mathmap_t *mathmap);
+gboolean mathmap_profile_hottest_region (mathmap_t *mathmap, scanner_region_t *region);
+void mathmap_profile_print_hot_spots (mathmap_t *mathmap, const char *source, FILE *out, int max_spots);
+
 /* TEMPLATE edge_behaviour */
 #define EDGE_BEHAVIOUR_COLOR          1
 #define EDGE_BEHAVIOUR_WRAP           2
@@ -137,6 +280,11 @@ extern int fast_image_source_scale;
 /* END */
 #define EDGE_BEHAVIOUR_MASK	      0xff
 
+#define INTERPOLATION_NEAREST	      0
+#define INTERPOLATION_BILINEAR	      1
+#define INTERPOLATION_BICUBIC	      2
+#define INTERPOLATION_LANCZOS	      3
+
 #define EDGE_BEHAVIOUR_X_FLAG	      0x0100
 #define EDGE_BEHAVIOUR_Y_FLAG	      0x0200
 
@@ -165,12 +313,17 @@ typedef struct _mathmap_invocation_t
 
     /* FIXME: These should eventually go into image_t */
     int antialiasing;
+    int interpolation;		/* INTERPOLATION_* */
     orig_val_pixel_func_t orig_val_func;
 
     int supersampling;
 
     int output_bpp;
 
+    int floatmap_layout;	/* FLOATMAP_LAYOUT_* of lazily rendered tiles and their flattened copies */
+
+    guint32 rand_seed;		/* seeds rand() together with t */
+
     int edge_behaviour_x, edge_behaviour_y;
     color_t edge_color_x, edge_color_y;
 
@@ -191,6 +344,9 @@ typedef struct _mathmap_invocation_t
     GCond *native_filter_cache_cond;
     native_filter_cache_entry_t *native_filter_cache;
 
+    /* RENDERs done outside of frames and slices */
+    struct _lazy_render_scope_t *lazy_renders;
+
     /* FIXME: remove - it's in the closure */
     mathfuncs_t mathfuncs;
 
@@ -210,6 +366,7 @@ typedef struct _mathmap_frame_t
 
     void *xy_vars;
     mathmap_pools_t pools;
+    struct _lazy_render_scope_t *lazy_renders;	/* RENDERs done by the frame code */
 } mathmap_frame_t;
 
 typedef struct _mathmap_slice_t
@@ -221,6 +378,7 @@ typedef struct _mathmap_slice_t
 
     void *y_vars;
     mathmap_pools_t pools;
+    struct _lazy_render_scope_t *lazy_renders;	/* RENDERs done by the slice code */
 } mathmap_slice_t;
 /* END */
 
@@ -241,6 +399,12 @@ typedef struct
 #define M_PI     3.14159265358979323846
 #endif
 
+/* TEMPLATE rand */
+guint32 mathmap_rand_begin (void);
+void mathmap_rand_end (guint32 outer_count);
+float mathmap_rand (mathmap_invocation_t *invocation, float x, float y, float t, float a, float b);
+/* END */
+
 /* TEMPLATE llvm_mathfuncs */
 void llvm_filter_init_frame (mathmap_frame_t *mmframe, image_t *closure);
 void llvm_filter_init_slice (mathmap_slice_t *slice, image_t *closure);
@@ -250,6 +414,9 @@ void llvm_filter_calc_lines (mathmap_slice_t *slice, image_t *closure, int first
 
 int cmdline_main (int argc, char *argv[]);
 color_t cmdline_mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y);
+guchar* cmdline_mathmap_get_frame_data (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame,
+					int *row_stride, int *bpp);
+void cmdline_mathmap_release_frame_data (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame);
 
 userval_info_t* arg_decls_to_uservals (filter_t *filter, arg_decl_t *arg_decls);
 void register_args_as_uservals (filter_t *filter, arg_decl_t *arg_decls);
@@ -271,19 +438,29 @@ void finish_parsing_filter (mathmap_t *mathmap);
 
 int check_mathmap (char *expression);
 mathmap_t* parse_mathmap (char *expression);
+void set_compile_precision (int precision);
+int get_compile_precision (void);
+void set_compile_profiling (gboolean profiling);
+gboolean get_compile_profiling (void);
 mathmap_t* compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend);
+mathmap_t* specialize_mathmap (mathmap_t *mathmap, char *expression, userval_t *uservals,
+			       char **support_paths, int timeout);
 mathmap_invocation_t* invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template_invocation,
 				      int img_width, int img_height, gboolean copy_first_image);
 
 mathmap_frame_t* invocation_new_frame (mathmap_invocation_t *invocation, image_t *closure,
 				       int current_frame, float current_t);
 void invocation_free_frame (mathmap_frame_t *frame);
+void invocation_forget_input_images (mathmap_invocation_t *invocation);
 
 void invocation_init_slice (mathmap_slice_t *slice, image_t *image, mathmap_frame_t *frame, int region_x, int region_y,
 			    int region_width, int region_height, float sampling_offset_x, float sampling_offset_y);
 void invocation_deinit_slice (mathmap_slice_t *slice);
 
 void invocation_set_antialiasing (mathmap_invocation_t *invocation, gboolean antialising);
+void invocation_set_interpolation (mathmap_invocation_t *invocation, int interpolation);
+
+color_t get_orig_val_interpolated_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *img, int frame);
 
 gpointer call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
 				   int region_x, int region_y, int region_width, int region_height,
@@ -306,6 +483,13 @@ void carry_over_uservals_from_template (mathmap_invocation_t *invocation, mathma
 					gboolean copy_first_image);
 
 color_t mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y);
+/* Returns the decoded pixels of FRAME as rows of *BPP byte RGB or
+   RGBA pixels, *ROW_STRIDE bytes apart, or NULL if they are not
+   available contiguously.  Pixels that are returned stay valid until
+   they are given back with mathmap_release_frame_data(). */
+guchar* mathmap_get_frame_data (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame,
+				int *row_stride, int *bpp);
+void mathmap_release_frame_data (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame);
 
 typedef int (*template_processor_func_t) (mathmap_t *mathmap, const char *directive, const char *arg, FILE *out, void *data);
 
@@ -341,6 +525,15 @@ typedef GThread* thread_handle_t;
 typedef gpointer thread_handle_t;
 #endif
 
+/* Storage class of per-thread state, like the rand() draw counter. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define MATHMAP_THREAD_LOCAL	_Thread_local
+#elif defined(_MSC_VER)
+#define MATHMAP_THREAD_LOCAL	__declspec(thread)
+#else
+#define MATHMAP_THREAD_LOCAL	__thread
+#endif
+
 thread_handle_t mathmap_thread_start (void (*func) (gpointer), gpointer data);
 void mathmap_thread_join (thread_handle_t thread);
 void mathmap_thread_kill (thread_handle_t thread);
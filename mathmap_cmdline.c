@@ -29,6 +29,17 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#ifndef __MINGW32__
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <glob.h>
+#endif
 
 #include <glib.h>
 
@@ -50,6 +61,7 @@
 
 #include "generators/blender/blender.h"
 #include "generators/nacl/nacl.h"
+#include "generators/native/native.h"
 
 typedef struct _define_t
 {
@@ -58,67 +70,185 @@ typedef struct _define_t
     struct _define_t *next;
 } define_t;
 
+struct _daemon_image_t;
+
 typedef struct _cache_entry_t
 {
     input_drawable_t *drawable;
     int frame;
     guchar *data;
+    struct _daemon_image_t *daemon_image; /* owns DATA if not NULL */
     int timestamp;
+    volatile gint pins;		/* frames being rendered that read it */
 } cache_entry_t;
 
+/* The input image cache is used by all render threads, and with -j
+   by several frames at once.  The cache and the cache entries of the
+   drawables are only changed with cache_mutex held.  While a frame is
+   rendered, pin_input_images() keeps the entries of its input images
+   pinned.  Pinned entries are never evicted, so the render threads
+   read them without locking.  Images are decoded outside the lock.
+   Entries are allocated one by one and never freed, which lets the
+   cache grow beyond cache_size if more entries than that are pinned
+   at once. */
 static int cache_size = 16;
-static cache_entry_t *cache = 0;
+static cache_entry_t **cache = NULL;
+static int num_cache_entries = 0;
 static int current_time = 0;
+static GMutex *cache_mutex = NULL;
 
 static long num_pixels_requested = 0;
 
+/* If an input image can't be decoded again after it was evicted from
+   the cache, the process exits, unless this is false, in which case
+   the failure is only counted in num_input_read_failures and the
+   image reads as white. */
+static gboolean input_read_failures_are_fatal = TRUE;
+static volatile gint num_input_read_failures = 0;
+
+/* Input images are decoded at a reduced size no smaller than this, if
+   their format allows it.  Zero means full size. */
+static int input_min_width = 0, input_min_height = 0;
+
+static void
+lock_input_cache (void)
+{
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized))
+    {
+	if (!g_thread_supported())
+	    g_thread_init(NULL);
+	cache_mutex = g_mutex_new();
+	g_once_init_leave(&initialized, 1);
+    }
+
+    g_mutex_lock(cache_mutex);
+}
+
+static void
+unlock_input_cache (void)
+{
+    g_mutex_unlock(cache_mutex);
+}
+
+static void unref_daemon_image (struct _daemon_image_t *image);
+
+/* Frees the pixels of CACHE_ENTRY, or lets go of them if they belong
+   to the daemon's image cache. */
+static void
+free_cache_entry_data (cache_entry_t *cache_entry)
+{
+    if (cache_entry->daemon_image != NULL)
+	unref_daemon_image(cache_entry->daemon_image);
+    else
+	free(cache_entry->data);
+
+    cache_entry->data = NULL;
+    cache_entry->daemon_image = NULL;
+}
+
+/* Must be called with the cache locked. */
 static cache_entry_t*
 get_free_cache_entry (void)
 {
-    int lru_index = -1;
+    cache_entry_t *lru_entry = NULL;
     int i;
 
-    if (cache == 0)
-	cache = g_new0(cache_entry_t, cache_size);
-    g_assert(cache != 0);
+    for (i = 0; i < num_cache_entries; ++i)
+	if (cache[i]->drawable == NULL)
+	    return cache[i];
+	else if (cache[i]->pins == 0
+		 && (lru_entry == NULL || cache[i]->timestamp < lru_entry->timestamp))
+	    lru_entry = cache[i];
+
+    if (lru_entry == NULL || num_cache_entries < cache_size)
+    {
+	cache = g_renew(cache_entry_t*, cache, num_cache_entries + 1);
+	cache[num_cache_entries] = g_new0(cache_entry_t, 1);
+	return cache[num_cache_entries++];
+    }
+
+    g_atomic_pointer_set(&lru_entry->drawable->v.cmdline.cache_entries[lru_entry->frame], NULL);
+    lru_entry->drawable = NULL;
+
+    free_cache_entry_data(lru_entry);
+
+    return lru_entry;
+}
+
+/* Input images decoded ahead of time by preload_input_images(),
+   waiting to be claimed by decode_input_image(). */
+typedef struct
+{
+    const char *filename;
+    guchar *data;
+    int width, height;
+} preloaded_image_t;
+
+static preloaded_image_t *preloaded_images = NULL;
+static int num_preloaded_images = 0;
+
+/* Must be called with the cache locked. */
+static guchar*
+claim_preloaded_image (const char *filename, int *width, int *height)
+{
+    int i;
 
-    for (i = 0; i < cache_size; ++i)
-	if (cache[i].drawable == 0)
+    for (i = 0; i < num_preloaded_images; ++i)
+	if (preloaded_images[i].data != NULL && strcmp(preloaded_images[i].filename, filename) == 0)
 	{
-	    lru_index = i;
-	    break;
-	}
-	else
-	    if (lru_index < 0 || cache[i].timestamp < cache[lru_index].timestamp)
-		lru_index = i;
+	    guchar *data = preloaded_images[i].data;
 
-    if (cache[lru_index].drawable != 0)
-	cache[lru_index].drawable->v.cmdline.cache_entries[cache[lru_index].frame] = 0;
+	    *width = preloaded_images[i].width;
+	    *height = preloaded_images[i].height;
+	    preloaded_images[i].data = NULL;
 
-    if (cache[lru_index].data != 0)
-    {
-	free(cache[lru_index].data);
-	cache[lru_index].data = 0;
-    }
+	    return data;
+	}
 
-    return &cache[lru_index];
+    return NULL;
 }
 
-static cache_entry_t*
-get_cache_entry_for_image (const char *filename, int *width, int *height)
+static guchar* ref_daemon_image (const char *filename, int *width, int *height,
+				 struct _daemon_image_t **image);
+
+/* Returns the decoded pixels of FILENAME, or NULL if it can't be
+   read.  If the pixels belong to the daemon's image cache, sets
+   *DAEMON_IMAGE to their owner, otherwise to NULL.  Must be called
+   with the cache locked, which is released while the image is
+   decoded. */
+static guchar*
+decode_input_image (const char *filename, int *width, int *height,
+		    struct _daemon_image_t **daemon_image)
 {
-    cache_entry_t *cache_entry = get_free_cache_entry();
+    guchar *data = claim_preloaded_image(filename, width, height);
+
+    *daemon_image = NULL;
 
-    cache_entry->data = read_image(filename, width, height);
-    if (cache_entry->data == 0)
+    if (data != NULL)
+	return data;
+
+    unlock_input_cache();
+
+    data = ref_daemon_image(filename, width, height, daemon_image);
+    if (data == NULL)
     {
-	fprintf(stderr, _("Error: Cannot read input image `%s'.\n"), filename);
-	exit(1);
+	double trace_start = mathmap_trace_begin();
+
+	data = read_image_scaled(filename, input_min_width, input_min_height, width, height);
+
+	mathmap_trace_end("decode image", "io", trace_start);
     }
+    if (data == NULL)
+	fprintf(stderr, _("Error: Cannot read input image `%s'.\n"), filename);
 
-    return cache_entry;
+    lock_input_cache();
+
+    return data;
 }
 
+/* Must be called with the cache locked. */
 static void
 bind_cache_entry_to_drawable (cache_entry_t *cache_entry, input_drawable_t *drawable, int frame)
 {
@@ -127,45 +257,70 @@ bind_cache_entry_to_drawable (cache_entry_t *cache_entry, input_drawable_t *draw
 
     cache_entry->drawable = drawable;
     cache_entry->frame = frame;
-    cache_entry->timestamp = current_time;
+    cache_entry->timestamp = ++current_time;
+    cache_entry->pins = 0;
 
-    drawable->v.cmdline.cache_entries[frame] = cache_entry;
+    g_atomic_pointer_set(&drawable->v.cmdline.cache_entries[frame], cache_entry);
 }
 
-color_t
-mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y)
+/* Returns the cache entry holding FRAME, decoding it if necessary,
+   or NULL if there is no such frame.  Must be called with the cache
+   locked, which is released while decoding. */
+static cache_entry_t*
+get_frame_cache_entry (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame)
 {
-    guchar *p;
-    int num_frames;
     cache_entry_t **cache_entries;
 
     g_assert (drawable != NULL);
     g_assert (drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE || drawable->kind == INPUT_DRAWABLE_CMDLINE_MOVIE);
 
-    ++num_pixels_requested;
-
-    if (x < 0 || x >= drawable->image.pixel_width)
-	return invocation->edge_color_x;
-    if (y < 0 || y >= drawable->image.pixel_height)
-	return invocation->edge_color_y;
-
-    num_frames = drawable->v.cmdline.num_frames;
     cache_entries = drawable->v.cmdline.cache_entries;
 
-    if (frame < 0 || frame >= num_frames)
-	return MAKE_RGBA_COLOR(255, 255, 255, 255);
+    if (frame < 0 || frame >= drawable->v.cmdline.num_frames)
+	return NULL;
+
+    if (g_atomic_int_get(&drawable->v.cmdline.read_failed))
+	return NULL;
 
     if (cache_entries[frame] == 0)
     {
 	cache_entry_t *cache_entry;
 
+	mathmap_trace_instant("input cache miss", "cache");
+
 	if (drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE)
 	{
+	    struct _daemon_image_t *daemon_image;
 	    int width, height;
+	    guchar *data = decode_input_image(drawable->v.cmdline.image_filename, &width, &height,
+					      &daemon_image);
 
-	    cache_entry = get_cache_entry_for_image(drawable->v.cmdline.image_filename, &width, &height);
+	    if (data == NULL)
+	    {
+		if (input_read_failures_are_fatal)
+		    exit(1);
+		/* don't try again for every pixel */
+		g_atomic_int_set(&drawable->v.cmdline.read_failed, 1);
+		g_atomic_int_inc(&num_input_read_failures);
+		return NULL;
+	    }
 
 	    g_assert(width == drawable->image.pixel_width && height == drawable->image.pixel_height);
+
+	    /* another thread might have decoded it in the meantime */
+	    if (cache_entries[frame] != NULL)
+	    {
+		if (daemon_image != NULL)
+		    unref_daemon_image(daemon_image);
+		else
+		    free(data);
+		cache_entries[frame]->timestamp = ++current_time;
+		return cache_entries[frame];
+	    }
+
+	    cache_entry = get_free_cache_entry();
+	    cache_entry->data = data;
+	    cache_entry->daemon_image = daemon_image;
 	}
 #ifdef MOVIES
 	else
@@ -188,11 +343,139 @@ mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable,
 	bind_cache_entry_to_drawable(cache_entry, drawable, frame);
     }
     else
-	cache_entries[frame]->timestamp = current_time;
+	cache_entries[frame]->timestamp = ++current_time;
+
+    return cache_entries[frame];
+}
+
+/* Returns the entry holding FRAME if it is pinned, without locking.
+   Callers are rendering a frame, which holds the pin, so the entry
+   can't be evicted while they read it. */
+static cache_entry_t*
+get_pinned_frame_cache_entry (input_drawable_t *drawable, int frame)
+{
+    cache_entry_t *cache_entry;
+
+    if (frame < 0 || frame >= drawable->v.cmdline.num_frames)
+	return NULL;
+
+    cache_entry = g_atomic_pointer_get(&drawable->v.cmdline.cache_entries[frame]);
+    if (cache_entry == NULL || g_atomic_int_get(&cache_entry->pins) <= 0
+	|| cache_entry->drawable != drawable || cache_entry->frame != frame)
+	return NULL;
+
+    return cache_entry;
+}
+
+color_t
+mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y)
+{
+    cache_entry_t *cache_entry;
+    color_t color;
+    guchar *p;
+
+    g_assert (drawable != NULL);
+
+    if (x < 0 || x >= drawable->image.pixel_width)
+	return invocation->edge_color_x;
+    if (y < 0 || y >= drawable->image.pixel_height)
+	return invocation->edge_color_y;
+
+    cache_entry = get_pinned_frame_cache_entry(drawable, frame);
+    if (cache_entry != NULL)
+    {
+	p = cache_entry->data + 3 * (drawable->image.pixel_width * y + x);
+	return MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+    }
+
+    lock_input_cache();
+
+    ++num_pixels_requested;
+
+    cache_entry = get_frame_cache_entry(invocation, drawable, frame);
+    if (cache_entry == NULL)
+	color = MAKE_RGBA_COLOR(255, 255, 255, 255);
+    else
+    {
+	p = cache_entry->data + 3 * (drawable->image.pixel_width * y + x);
+	color = MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+    }
+
+    unlock_input_cache();
+
+    return color;
+}
+
+/* Only the frames pinned by the frame being rendered are handed out,
+   and they stay pinned until it's done, so there's nothing to do in
+   mathmap_release_frame_data(). */
+guchar*
+mathmap_get_frame_data (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame,
+			int *row_stride, int *bpp)
+{
+    cache_entry_t *cache_entry = get_pinned_frame_cache_entry(drawable, frame);
+
+    if (cache_entry == NULL)
+	return NULL;
+
+    *row_stride = 3 * drawable->image.pixel_width;
+    *bpp = 3;
+
+    return cache_entry->data;
+}
+
+void
+mathmap_release_frame_data (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame)
+{
+}
+
+/* Decodes the input images of INVOCATION if necessary and pins them
+   until unpin_input_images(), so that the render threads can read
+   them without locking.  Called around rendering each frame. */
+static void
+pin_input_images (mathmap_invocation_t *invocation)
+{
+    userval_info_t *info;
+
+    lock_input_cache();
+    for (info = invocation->mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+	if (info->type == USERVAL_IMAGE && invocation->uservals[info->index].v.image != NULL
+	    && invocation->uservals[info->index].v.image->type == IMAGE_DRAWABLE)
+	{
+	    input_drawable_t *drawable = invocation->uservals[info->index].v.image->v.drawable;
+	    cache_entry_t *cache_entry;
+
+	    if (drawable->kind != INPUT_DRAWABLE_CMDLINE_IMAGE)
+		continue;
+
+	    cache_entry = get_frame_cache_entry(invocation, drawable, 0);
+	    if (cache_entry != NULL)
+		g_atomic_int_inc(&cache_entry->pins);
+	}
+    unlock_input_cache();
+}
+
+static void
+unpin_input_images (mathmap_invocation_t *invocation)
+{
+    userval_info_t *info;
+
+    lock_input_cache();
+    for (info = invocation->mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+	if (info->type == USERVAL_IMAGE && invocation->uservals[info->index].v.image != NULL
+	    && invocation->uservals[info->index].v.image->type == IMAGE_DRAWABLE)
+	{
+	    input_drawable_t *drawable = invocation->uservals[info->index].v.image->v.drawable;
+	    cache_entry_t *cache_entry;
 
-    p = cache_entries[frame]->data + 3 * (drawable->image.pixel_width * y + x);
+	    if (drawable->kind != INPUT_DRAWABLE_CMDLINE_IMAGE)
+		continue;
 
-    return MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+	    cache_entry = drawable->v.cmdline.cache_entries[0];
+	    if (cache_entry != NULL && cache_entry->pins > 0)
+		g_atomic_int_add(&cache_entry->pins, -1);
+	}
+    unlock_input_cache();
 }
 
 void
@@ -201,6 +484,134 @@ drawable_get_pixel_inc (mathmap_invocation_t *invocation, input_drawable_t *draw
     *inc_x = *inc_y = 1;
 }
 
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+typedef struct
+{
+    volatile gint next_image;
+} preload_state_t;
+
+static void
+preload_worker (gpointer _state)
+{
+    preload_state_t *state = (preload_state_t*)_state;
+
+    for (;;)
+    {
+	int i = g_atomic_int_exchange_and_add(&state->next_image, 1);
+	preloaded_image_t *image;
+	double trace_start;
+
+	if (i >= num_preloaded_images)
+	    break;
+
+	image = &preloaded_images[i];
+	trace_start = mathmap_trace_begin();
+	image->data = read_image_scaled(image->filename, input_min_width, input_min_height,
+					&image->width, &image->height);
+	mathmap_trace_end("decode image", "io", trace_start);
+    }
+}
+#endif
+
+/* Decodes the NUM_FILENAMES input images using up to NUM_THREADS
+   threads.  The decoded images are kept until the drawables for them
+   are allocated, so each input is decoded only once.  Images that
+   cannot be read are left for decode_input_image() to report. */
+static void
+preload_input_images (const char **filenames, int num_filenames, int num_threads)
+{
+    int i;
+
+    g_assert(preloaded_images == NULL);
+
+    /* all inputs must fit into the cache at once, otherwise they'd be
+       evicted and decoded again during rendering */
+    cache_size = MAX(cache_size, num_filenames);
+
+    preloaded_images = g_new0(preloaded_image_t, num_filenames);
+    num_preloaded_images = num_filenames;
+    for (i = 0; i < num_filenames; ++i)
+	preloaded_images[i].filename = filenames[i];
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    num_threads = CLAMP(num_threads, 1, num_filenames);
+    if (num_threads > 1)
+    {
+	preload_state_t state;
+	thread_handle_t *threads = g_new(thread_handle_t, num_threads);
+
+	if (!g_thread_supported())
+	    g_thread_init(NULL);
+
+	state.next_image = 0;
+	for (i = 0; i < num_threads; ++i)
+	    threads[i] = mathmap_thread_start(preload_worker, &state);
+	for (i = 0; i < num_threads; ++i)
+	    mathmap_thread_join(threads[i]);
+
+	g_free(threads);
+	return;
+    }
+#endif
+
+    for (i = 0; i < num_filenames; ++i)
+    {
+	double trace_start = mathmap_trace_begin();
+
+	preloaded_images[i].data = read_image_scaled(filenames[i], input_min_width, input_min_height,
+						     &preloaded_images[i].width, &preloaded_images[i].height);
+
+	mathmap_trace_end("decode image", "io", trace_start);
+    }
+}
+
+/* Frees the preloaded images that were never claimed. */
+static void
+free_preloaded_images (void)
+{
+    int i;
+
+    for (i = 0; i < num_preloaded_images; ++i)
+	if (preloaded_images[i].data != NULL)
+	    free(preloaded_images[i].data);
+
+    g_free(preloaded_images);
+    preloaded_images = NULL;
+    num_preloaded_images = 0;
+}
+
+/* Hands DATA, decoded from FILENAME by someone else, to the next
+   decode_input_image() for FILENAME. */
+static void
+add_preloaded_image (const char *filename, guchar *data, int width, int height)
+{
+    int i;
+
+    for (i = 0; i < num_preloaded_images; ++i)
+	if (preloaded_images[i].data == NULL)
+	    break;
+
+    if (i == num_preloaded_images)
+	preloaded_images = g_renew(preloaded_image_t, preloaded_images, ++num_preloaded_images);
+
+    preloaded_images[i].filename = filename;
+    preloaded_images[i].data = data;
+    preloaded_images[i].width = width;
+    preloaded_images[i].height = height;
+}
+
+static gboolean
+have_movie_input_drawables (void)
+{
+    int i;
+
+    for (i = 0; i < get_num_input_drawables(); ++i)
+	if (get_nth_input_drawable(i)->kind == INPUT_DRAWABLE_CMDLINE_MOVIE)
+	    return TRUE;
+
+    return FALSE;
+}
+
 gradient_t*
 get_default_gradient (void)
 {
@@ -268,18 +679,67 @@ input_drawable_t*
 alloc_cmdline_image_input_drawable (const char *filename)
 {
     int width, height;
-    cache_entry_t *cache_entry = get_cache_entry_for_image(filename, &width, &height);
-    input_drawable_t *drawable = alloc_input_drawable(INPUT_DRAWABLE_CMDLINE_IMAGE, width, height);
+    cache_entry_t *cache_entry;
+    input_drawable_t *drawable;
+    struct _daemon_image_t *daemon_image;
+    guchar *data;
+
+    lock_input_cache();
+
+    data = decode_input_image(filename, &width, &height, &daemon_image);
+    if (data == NULL)
+    {
+	unlock_input_cache();
+	return NULL;
+    }
+
+    drawable = alloc_input_drawable(INPUT_DRAWABLE_CMDLINE_IMAGE, width, height);
 
     drawable->v.cmdline.cache_entries = g_new0(cache_entry_t*, 1);
     drawable->v.cmdline.num_frames = 1;
     drawable->v.cmdline.image_filename = strdup(filename);
 
+    cache_entry = get_free_cache_entry();
+    cache_entry->data = data;
+    cache_entry->daemon_image = daemon_image;
     bind_cache_entry_to_drawable(cache_entry, drawable, 0);
 
+    unlock_input_cache();
+
     return drawable;
 }
 
+/* The input image cache entries of DRAWABLE must not outlive it. */
+static void
+release_cache_entries (input_drawable_t *drawable)
+{
+    int i;
+
+    lock_input_cache();
+    for (i = 0; i < num_cache_entries; ++i)
+	if (cache[i]->drawable == drawable)
+	{
+	    g_assert(cache[i]->pins == 0);
+	    free_cache_entry_data(cache[i]);
+	    cache[i]->drawable = NULL;
+	}
+    unlock_input_cache();
+}
+
+/* Frees INVOCATION together with the cached data of its input images. */
+static void
+free_cmdline_invocation (mathmap_invocation_t *invocation)
+{
+    userval_info_t *info;
+
+    for (info = invocation->mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+	if (info->type == USERVAL_IMAGE && invocation->uservals[info->index].v.image != NULL
+	    && invocation->uservals[info->index].v.image->type == IMAGE_DRAWABLE)
+	    release_cache_entries(invocation->uservals[info->index].v.image->v.drawable);
+
+    free_invocation(invocation);
+}
+
 #ifdef MOVIES
 input_drawable_t*
 alloc_cmdline_movie_input_drawable (const char *filename)
@@ -331,6 +791,18 @@ parse_image_size (char *str, int *width, int *height)
     return 1;
 }
 
+/* Parses a region given as X,Y,WIDTH,HEIGHT. */
+static gboolean
+parse_region (const char *str, int *x, int *y, int *width, int *height)
+{
+    int length;
+
+    if (sscanf(str, "%d,%d,%d,%d%n", x, y, width, height, &length) != 4 || str[length] != '\0')
+	return FALSE;
+
+    return *x >= 0 && *y >= 0 && *width > 0 && *height > 0;
+}
+
 static gboolean
 is_ident_char (char c)
 {
@@ -501,38 +973,2075 @@ lookup_define (define_t *defines, const char *name)
     return NULL;
 }
 
-static void
-usage (void)
+/* Sets the user values of INVOCATION that are defined in DEFINES.
+   Input images must be defined.  Returns an error message, which must
+   be freed, if a value cannot be set. */
+static char*
+set_uservals_from_defines (mathmap_invocation_t *invocation, define_t *defines, int *num_input_drawables)
 {
-    printf("Usage:\n"
-	   "  mathmap --version\n"
-	   "      print out version number\n"
-	   "  mathmap --help\n"
-	   "      print this help text\n"
-	   "  mathmap [option ...] [<script>] <outfile>\n"
-	   "      transform one or more inputs with <script> and write\n"
-	   "      the result to <outfile>\n"
-	   "  mathmap --htmldoc [<script>] <outfile>\n"
-	   "      outputs HTML documentation for the filters in\n"
-	   "      the script to <outfile>\n"
-	   "Options:\n"
-	   "  -f, --script-file=FILENAME  read script from FILENAME\n"
-	   "  -D<name>=<value>            define user value\n"
-#ifdef MOVIES
-	   "  -M, --movie=FILENAME        input movie FILENAME\n"
-	   "  -F, --frames=NUM            output movie has NUM frames\n"
-#endif
-	   "  -i, --intersampling         use intersampling\n"
-	   "  -o, --oversampling          use oversampling\n"
-	   "  -s, --size=WIDTHxHEIGHT     sets the output image size\n"
-	   "  -c, --cache=NUM             cache NUM input images (default %d)\n"
-	   "  -g, --generator=GEN         generate plug-in code with GEN\n"
-	   "\n"
-	   "Report bugs and suggestions to schani@complang.tuwien.ac.at\n",
-	   cache_size);
-}
+    userval_info_t *userval_info;
 
-#define OPTION_VERSION				256
+    for (userval_info = invocation->mathmap->main_filter->userval_infos;
+	 userval_info != NULL;
+	 userval_info = userval_info->next)
+    {
+	userval_t *userval = &invocation->uservals[userval_info->index];
+	define_t *define = lookup_define(defines, userval_info->name);
+	input_drawable_t *drawable;
+
+	if (define == NULL)
+	{
+	    if (userval_info->type == USERVAL_IMAGE)
+		return g_strdup_printf(_("No value defined for input image `%s'."), userval_info->name);
+	}
+	else
+	    switch (userval_info->type)
+	    {
+		case USERVAL_INT_CONST :
+		    userval->v.int_const = atoi(define->value);
+		    break;
+
+		case USERVAL_FLOAT_CONST :
+		    userval->v.float_const = g_ascii_strtod(define->value, NULL);
+		    break;
+
+		case USERVAL_BOOL_CONST :
+		    userval->v.bool_const = (float)atoi(define->value);
+		    break;
+
+		case USERVAL_IMAGE :
+		    drawable = alloc_cmdline_image_input_drawable(define->value);
+		    if (drawable == NULL)
+			return g_strdup_printf(_("Cannot read input image `%s'."), define->value);
+		    assign_image_userval_drawable(userval_info, userval, drawable);
+		    ++*num_input_drawables;
+		    break;
+
+		default :
+		    return g_strdup(_("Can only define user values for types int, float, bool and image."));
+	    }
+    }
+
+    return NULL;
+}
+
+/*** benchmarking ***/
+
+static void
+write_json_double (FILE *out, const char *name, double value)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    fprintf(out, "  \"%s\": %s,\n", name, g_ascii_formatd(buf, sizeof(buf), "%.6f", value));
+}
+
+/* Prints one line with the counts that are valid, plus instructions
+   per cycle and cycles per output pixel if possible. */
+static void
+print_perf_counts (FILE *out, const char *label, perf_counts_t *counts, double num_pixels)
+{
+    int i;
+
+    fprintf(out, "%s:", label);
+    for (i = 0; i < NUM_PERF_COUNTERS; ++i)
+	if (counts->valid[i])
+	    fprintf(out, " %s %" G_GUINT64_FORMAT, perf_counter_names[i], counts->values[i]);
+    if (counts->valid[PERF_COUNTER_CYCLES] && counts->valid[PERF_COUNTER_INSTRUCTIONS]
+	&& counts->values[PERF_COUNTER_CYCLES] > 0)
+	fprintf(out, " ipc %.2f",
+		(double)counts->values[PERF_COUNTER_INSTRUCTIONS] / counts->values[PERF_COUNTER_CYCLES]);
+    if (counts->valid[PERF_COUNTER_CYCLES] && num_pixels > 0)
+	fprintf(out, " cycles/pixel %.1f", counts->values[PERF_COUNTER_CYCLES] / num_pixels);
+    fprintf(out, "\n");
+}
+
+/* Writes the compile phase timings and the render throughput of this
+   run as a JSON object to FILENAME, for the benchmark driver in
+   bench/.  NUM_PIXELS is the number of pixels that were actually
+   rendered in RENDER_TIME, which is less than the requested frames
+   if the filter doesn't depend on t.  SPECIALIZE_TIMINGS, if not
+   NULL, are those of the compile for --specialize.  PERF_TOTALS, if
+   not NULL, are the event counts summed over all renders. */
+static gboolean
+write_bench_json (const char *filename, int img_width, int img_height, int num_frames,
+		  int num_renders, double num_pixels, double render_time,
+		  compile_timings_t *compile_timings, compile_timings_t *specialize_timings,
+		  perf_counts_t *perf_totals)
+{
+    FILE *out = fopen(filename, "w");
+    long peak_rss_kb = 0;
+#ifndef __MINGW32__
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+	peak_rss_kb = usage.ru_maxrss;
+#endif
+
+    if (out == NULL)
+    {
+	fprintf(stderr, _("Error: Cannot open file `%s' for writing: %s\n"), filename, strerror(errno));
+	return FALSE;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"width\": %d,\n  \"height\": %d,\n  \"frames\": %d,\n  \"renders\": %d,\n",
+	    img_width, img_height, num_frames, num_renders);
+    write_json_double(out, "parse", compile_timings->parse);
+    write_json_double(out, "optimize", compile_timings->optimize);
+    write_json_double(out, "codegen", compile_timings->codegen);
+    write_json_double(out, "cc", compile_timings->cc);
+    write_json_double(out, "link", compile_timings->link);
+    write_json_double(out, "load", compile_timings->load);
+    if (specialize_timings != NULL)
+	write_json_double(out, "specialize",
+			  specialize_timings->parse + specialize_timings->optimize + specialize_timings->codegen
+			  + specialize_timings->cc + specialize_timings->link + specialize_timings->load);
+    write_json_double(out, "render", render_time);
+    write_json_double(out, "mpix_per_sec",
+		      render_time > 0.0 ? num_pixels / render_time / 1e6 : 0.0);
+    if (perf_totals != NULL)
+    {
+	int i;
+
+	for (i = 0; i < NUM_PERF_COUNTERS; ++i)
+	    if (perf_totals->valid[i])
+		fprintf(out, "  \"%s\": %" G_GUINT64_FORMAT ",\n", perf_counter_names[i], perf_totals->values[i]);
+	if (perf_totals->valid[PERF_COUNTER_CYCLES] && perf_totals->valid[PERF_COUNTER_INSTRUCTIONS]
+	    && perf_totals->values[PERF_COUNTER_CYCLES] > 0)
+	    write_json_double(out, "ipc", (double)perf_totals->values[PERF_COUNTER_INSTRUCTIONS]
+			      / perf_totals->values[PERF_COUNTER_CYCLES]);
+	if (perf_totals->valid[PERF_COUNTER_CYCLES] && num_pixels > 0)
+	    write_json_double(out, "cycles_per_pixel", perf_totals->values[PERF_COUNTER_CYCLES] / num_pixels);
+    }
+    fprintf(out, "  \"peak_rss_kb\": %ld\n}\n", peak_rss_kb);
+
+    fclose(out);
+
+    return TRUE;
+}
+
+/*** animation rendering ***/
+
+typedef void (*frame_output_func_t) (int frame, guchar *pixels, gpointer data);
+
+/* Renders the given region of the canvas into OUTPUT, whose rows are
+   the invocation's row stride apart. */
+static void
+render_frame_region (mathmap_invocation_t *invocation, int current_frame, int num_frames,
+		     int region_x, int region_y, int region_width, int region_height,
+		     guchar *output, int num_threads)
+{
+    float current_t = (float)current_frame / (float)num_frames;
+    image_t *closure = closure_image_alloc(&invocation->mathfuncs,
+					   NULL,
+					   invocation->mathmap->main_filter->num_uservals,
+					   invocation->uservals,
+					   invocation->img_width, invocation->img_height);
+    mathmap_frame_t *frame;
+
+    pin_input_images(invocation);
+    frame = invocation_new_frame(invocation, closure, current_frame, current_t);
+
+    call_invocation_parallel_and_join(frame, closure, region_x, region_y, region_width, region_height,
+				      output, num_threads);
+
+    invocation_free_frame(frame);
+    unpin_input_images(invocation);
+    closure_image_free(closure);
+}
+
+static void
+render_frame (mathmap_invocation_t *invocation, int current_frame, int num_frames,
+	      int img_width, int img_height, guchar *output, int num_threads)
+{
+    render_frame_region(invocation, current_frame, num_frames, 0, 0, img_width, img_height,
+			output, num_threads);
+}
+
+/* Frames are rendered concurrently by worker threads, each with its
+   own frame and pools, into a ring of output buffers.  Frame N always
+   goes into slot N modulo the number of slots, and the thread handing
+   the frames to the output function releases the slots in frame
+   order, so a worker that gets too far ahead blocks until its slot is
+   free again. */
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+#define SLOT_FREE	0
+#define SLOT_RENDERING	1
+#define SLOT_READY	2
+
+typedef struct
+{
+    mathmap_invocation_t *invocation;
+    int num_frames;
+    int img_width, img_height;
+
+    int num_slots;
+    guchar **slots;
+    int *slot_states;
+
+    int next_frame;		/* the next frame to be claimed by a worker */
+    int next_worker_index;
+
+    GMutex *mutex;
+    GCond *cond;
+} frame_pipeline_t;
+
+static void
+frame_pipeline_worker (gpointer _data)
+{
+    frame_pipeline_t *pipeline = (frame_pipeline_t*)_data;
+    perf_counter_group_t counters;
+    gboolean count_events;
+    int worker_index;
+
+    g_mutex_lock(pipeline->mutex);
+    worker_index = pipeline->next_worker_index++;
+    g_mutex_unlock(pipeline->mutex);
+
+    /* inherit, so the render thread of each frame is counted, too */
+    count_events = perf_counters_begin_thread(&counters, PERF_THREAD_FRAME, worker_index, TRUE);
+
+    for (;;)
+    {
+	int frame, slot;
+
+	g_mutex_lock(pipeline->mutex);
+	frame = pipeline->next_frame;
+	if (frame >= pipeline->num_frames)
+	{
+	    g_mutex_unlock(pipeline->mutex);
+	    break;
+	}
+	++pipeline->next_frame;
+
+	slot = frame % pipeline->num_slots;
+	if (pipeline->slot_states[slot] != SLOT_FREE)
+	{
+	    double trace_start = mathmap_trace_begin();
+
+	    while (pipeline->slot_states[slot] != SLOT_FREE)
+		g_cond_wait(pipeline->cond, pipeline->mutex);
+
+	    mathmap_trace_end("wait for free slot", "lock", trace_start);
+	}
+	pipeline->slot_states[slot] = SLOT_RENDERING;
+	g_mutex_unlock(pipeline->mutex);
+
+	render_frame(pipeline->invocation, frame, pipeline->num_frames,
+		     pipeline->img_width, pipeline->img_height, pipeline->slots[slot], 1);
+
+	g_mutex_lock(pipeline->mutex);
+	pipeline->slot_states[slot] = SLOT_READY;
+	g_cond_broadcast(pipeline->cond);
+	g_mutex_unlock(pipeline->mutex);
+    }
+
+    if (count_events)
+	perf_counters_end_thread(&counters, PERF_THREAD_FRAME, worker_index);
+}
+#endif
+
+/* Renders NUM_FRAMES frames and passes them to OUTPUT_FUNC in order.
+   If the output doesn't depend on t and no input changes from frame
+   to frame, all frames are the same, so only the first one is
+   rendered.  Returns the number of frames actually rendered. */
+static int
+render_frames (mathmap_invocation_t *invocation, int num_frames, int img_width, int img_height,
+	       int num_threads, frame_output_func_t output_func, gpointer output_data)
+{
+    size_t frame_size = (size_t)invocation->output_bpp * img_width * img_height;
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    frame_pipeline_t pipeline;
+    thread_handle_t *threads;
+    int i;
+#endif
+    int frame;
+
+    if (invocation->mathmap->main_filter->v.mathmap.is_t_invariant && !have_movie_input_drawables())
+    {
+	guchar *output = g_malloc(frame_size);
+
+	render_frame(invocation, 0, num_frames, img_width, img_height, output, 1);
+	for (frame = 0; frame < num_frames; ++frame)
+	    output_func(frame, output, output_data);
+
+	g_free(output);
+	return 1;
+    }
+
+#if !defined(USE_PTHREADS) && !defined(USE_GTHREADS)
+    num_threads = 1;
+#endif
+    num_threads = CLAMP(num_threads, 1, num_frames);
+
+    if (num_threads == 1)
+    {
+	guchar *output = g_malloc(frame_size);
+
+	for (frame = 0; frame < num_frames; ++frame)
+	{
+	    render_frame(invocation, frame, num_frames, img_width, img_height, output, 1);
+	    output_func(frame, output, output_data);
+	}
+
+	g_free(output);
+	return num_frames;
+    }
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    if (!g_thread_supported())
+	g_thread_init(NULL);
+
+    pipeline.invocation = invocation;
+    pipeline.num_frames = num_frames;
+    pipeline.img_width = img_width;
+    pipeline.img_height = img_height;
+    /* two more than workers so that output doesn't stall rendering */
+    pipeline.num_slots = MIN(num_threads + 2, num_frames);
+    pipeline.slots = g_new(guchar*, pipeline.num_slots);
+    pipeline.slot_states = g_new0(int, pipeline.num_slots);
+    for (i = 0; i < pipeline.num_slots; ++i)
+	pipeline.slots[i] = g_malloc(frame_size);
+    pipeline.next_frame = 0;
+    pipeline.next_worker_index = 0;
+    pipeline.mutex = g_mutex_new();
+    pipeline.cond = g_cond_new();
+
+    threads = g_new(thread_handle_t, num_threads);
+    for (i = 0; i < num_threads; ++i)
+	threads[i] = mathmap_thread_start(frame_pipeline_worker, &pipeline);
+
+    for (frame = 0; frame < num_frames; ++frame)
+    {
+	int slot = frame % pipeline.num_slots;
+	double trace_start = mathmap_trace_begin();
+
+	g_mutex_lock(pipeline.mutex);
+	while (pipeline.slot_states[slot] != SLOT_READY)
+	    g_cond_wait(pipeline.cond, pipeline.mutex);
+	g_mutex_unlock(pipeline.mutex);
+
+	mathmap_trace_end("wait for rendered frame", "lock", trace_start);
+
+	output_func(frame, pipeline.slots[slot], output_data);
+
+	g_mutex_lock(pipeline.mutex);
+	pipeline.slot_states[slot] = SLOT_FREE;
+	g_cond_broadcast(pipeline.cond);
+	g_mutex_unlock(pipeline.mutex);
+    }
+
+    for (i = 0; i < num_threads; ++i)
+	mathmap_thread_join(threads[i]);
+    g_free(threads);
+
+    g_cond_free(pipeline.cond);
+    g_mutex_free(pipeline.mutex);
+    for (i = 0; i < pipeline.num_slots; ++i)
+	g_free(pipeline.slots[i]);
+    g_free(pipeline.slot_states);
+    g_free(pipeline.slots);
+#endif
+
+    return num_frames;
+}
+
+typedef struct
+{
+    int img_width, img_height;
+    int bpp;
+    int num_frames;
+    const char *filename;
+    gboolean is_sequence;	/* FILENAME is a printf pattern for the frame number */
+#ifdef MOVIES
+    quicktime_t *movie;		/* NULL if not writing a movie */
+    guchar **rows;
+#endif
+} frame_writer_t;
+
+static void
+write_frame (int frame, guchar *pixels, gpointer _data)
+{
+    frame_writer_t *writer = (frame_writer_t*)_data;
+    double trace_start = mathmap_trace_begin();
+
+#ifdef MOVIES
+    if (writer->movie != NULL)
+    {
+	int i;
+
+	for (i = 0; i < writer->img_height; ++i)
+	    writer->rows[i] = pixels + writer->img_width * writer->bpp * i;
+
+	fprintf(stderr, _("writing frame %d\n"), frame);
+	assert(quicktime_encode_video(writer->movie, writer->rows, 0) == 0);
+	mathmap_trace_end("encode image", "io", trace_start);
+	return;
+    }
+#endif
+
+    if (writer->is_sequence)
+    {
+	char *filename = g_strdup_printf(writer->filename, frame);
+
+	write_image(filename, writer->img_width, writer->img_height, pixels,
+		    writer->bpp, writer->img_width * writer->bpp, IMAGE_FORMAT_PNG);
+	g_free(filename);
+    }
+    else if (frame == writer->num_frames - 1)
+	write_image(writer->filename, writer->img_width, writer->img_height, pixels,
+		    writer->bpp, writer->img_width * writer->bpp, IMAGE_FORMAT_PNG);
+
+    mathmap_trace_end("encode image", "io", trace_start);
+}
+
+static void
+discard_frame (int frame, guchar *pixels, gpointer data)
+{
+}
+
+/* Renders a single frame BAND_ROWS rows at a time and hands the rows
+   to the image writer as soon as they are finished, so only one band
+   has to be in memory. */
+static gboolean
+render_frame_streaming (mathmap_invocation_t *invocation, int img_width, int img_height,
+			int band_rows, int num_threads, const char *filename)
+{
+    image_writer_t *writer;
+    image_t *closure;
+    mathmap_frame_t *frame;
+    guchar *band;
+    int band_y;
+
+    writer = open_image_writing(filename, img_width, img_height,
+				invocation->output_bpp, invocation->row_stride, IMAGE_FORMAT_PNG);
+    if (writer == NULL)
+	return FALSE;
+
+    band_rows = MIN(band_rows, img_height);
+    band = g_malloc((size_t)invocation->row_stride * band_rows);
+
+    closure = closure_image_alloc(&invocation->mathfuncs,
+				  NULL,
+				  invocation->mathmap->main_filter->num_uservals,
+				  invocation->uservals,
+				  img_width, img_height);
+    pin_input_images(invocation);
+    frame = invocation_new_frame(invocation, closure, 0, 0.0);
+
+    for (band_y = 0; band_y < img_height; band_y += band_rows)
+    {
+	int num_rows = MIN(band_rows, img_height - band_y);
+	int num_written = 0;
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+	gpointer call = call_invocation_parallel(frame, closure, 0, band_y, img_width, num_rows,
+						 band, num_threads);
+
+	/* Write out the finished prefix of the band while the rest is
+	   still being rendered.  The last scan happens after all
+	   threads are done, so no row is missed. */
+	for (;;)
+	{
+	    gboolean is_done = invocation_call_is_done(call);
+	    int num_finished = num_written;
+
+	    while (num_finished < num_rows && invocation->rows_finished[band_y + num_finished])
+		++num_finished;
+
+	    if (num_finished > num_written)
+	    {
+		double trace_start = mathmap_trace_begin();
+
+		write_lines(writer, band + num_written * invocation->row_stride, num_finished - num_written);
+		num_written = num_finished;
+
+		mathmap_trace_end("encode rows", "io", trace_start);
+	    }
+	    else if (!is_done)
+		g_usleep(1000);
+
+	    if (is_done)
+		break;
+	}
+
+	join_invocation_call(call);
+#else
+	call_invocation_parallel_and_join(frame, closure, 0, band_y, img_width, num_rows, band, 1);
+#endif
+
+	/* in case the renderer doesn't report finished rows */
+	if (num_written < num_rows)
+	    write_lines(writer, band + num_written * invocation->row_stride, num_rows - num_written);
+    }
+
+    invocation_free_frame(frame);
+    unpin_input_images(invocation);
+    closure_image_free(closure);
+
+    g_free(band);
+    free_image_writer(writer);
+
+    return TRUE;
+}
+
+/* Whether FILENAME contains exactly one printf conversion, which must
+   be for an int, like "frame%04d.png". */
+static gboolean
+is_frame_sequence_pattern (const char *filename)
+{
+    const char *p = strchr(filename, '%');
+
+    if (p == NULL)
+	return FALSE;
+
+    ++p;
+    while (isdigit(*p))
+	++p;
+
+    return *p == 'd' && strchr(p, '%') == NULL;
+}
+
+/*** render configuration ***/
+
+/* The render options of the command line, for the modes that make
+   more than one invocation. */
+typedef struct
+{
+    int num_threads;
+    int antialiasing;
+    int supersampling;
+    int interpolation;
+    int floatmap_layout;
+    guint32 rand_seed;
+    int compile_time_limit;
+} render_config_t;
+
+static void
+apply_render_config (mathmap_invocation_t *invocation, render_config_t *config)
+{
+    invocation_set_interpolation(invocation, config->antialiasing ? config->interpolation : INTERPOLATION_NEAREST);
+    invocation->supersampling = config->supersampling;
+    invocation->output_bpp = 4;
+    invocation->floatmap_layout = config->floatmap_layout;
+    invocation->rand_seed = config->rand_seed;
+}
+
+/*** batch rendering ***/
+
+/* In batch mode one compiled filter is applied to many input images,
+   each of which goes to the first input image of the filter that is
+   not defined with -D.  The images pass through three stages, each in
+   its own thread: image N+1 is decoded while image N is rendered and
+   image N-1 is written.  Image N uses slot N modulo BATCH_NUM_SLOTS,
+   so the decoder can't get further ahead than that.  The invocation
+   is reused for as long as the images have the same size. */
+
+#define BATCH_NUM_SLOTS		3
+
+#define BATCH_SLOT_FREE		0
+#define BATCH_SLOT_DECODED	1
+#define BATCH_SLOT_RENDERED	2
+
+typedef struct
+{
+    int state;
+    const char *input_filename;
+    guchar *input;		/* NULL if the input can't be read */
+    int input_width, input_height;
+    char *output_filename;
+    guchar *output;		/* NULL if the image wasn't rendered */
+    int output_width, output_height;
+} batch_slot_t;
+
+typedef struct
+{
+    char **inputs;
+    int num_inputs;
+    const char *output_pattern;
+
+    mathmap_t *mathmap;
+    userval_info_t *batch_userval;	/* the input image that changes */
+    define_t *defines;
+    render_config_t *config;
+    int img_width, img_height;	/* zero to render at the size of each input */
+
+    mathmap_invocation_t *invocation;
+
+    batch_slot_t slots[BATCH_NUM_SLOTS];
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    GMutex *mutex;
+    GCond *cond;
+#endif
+} batch_t;
+
+/* Whether FILENAME contains exactly one printf conversion, which must
+   be for a string, like "out/%s.png". */
+static gboolean
+is_batch_output_pattern (const char *filename)
+{
+    const char *p = strchr(filename, '%');
+
+    return p != NULL && p[1] == 's' && strchr(p + 2, '%') == NULL;
+}
+
+/* Substitutes the name of INPUT_FILENAME, without directory and
+   extension, into PATTERN. */
+static char*
+make_batch_output_filename (const char *pattern, const char *input_filename)
+{
+    char *base = g_path_get_basename(input_filename);
+    char *dot = strrchr(base, '.');
+    char *filename;
+
+    if (dot != NULL && dot != base)
+	*dot = '\0';
+
+    filename = g_strdup_printf(pattern, base);
+    g_free(base);
+
+    return filename;
+}
+
+/* Returns an error message, which must be freed, if two of the
+   NULL-terminated INPUTS would be written to the same file, like
+   `a/x.jpg' and `b/x.png'. */
+static char*
+check_batch_output_filenames (const char *pattern, char **inputs)
+{
+    GHashTable *outputs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    char *message = NULL;
+    int i;
+
+    for (i = 0; inputs[i] != NULL && message == NULL; ++i)
+    {
+	char *filename = make_batch_output_filename(pattern, inputs[i]);
+	const char *other = g_hash_table_lookup(outputs, filename);
+
+	if (other != NULL)
+	{
+	    message = g_strdup_printf(_("The inputs `%s' and `%s' would both be written to `%s'."),
+				      other, inputs[i], filename);
+	    g_free(filename);
+	}
+	else
+	    g_hash_table_insert(outputs, filename, inputs[i]);
+    }
+
+    g_hash_table_destroy(outputs);
+
+    return message;
+}
+
+/* Expands SPEC, which is either a glob pattern or `@' followed by the
+   name of a file listing one input per line, into a NULL-terminated
+   vector of filenames in *INPUTS.  Returns an error message, which
+   must be freed, if there are no inputs. */
+static char*
+expand_batch_inputs (const char *spec, char ***inputs)
+{
+    GPtrArray *array = g_ptr_array_new();
+
+    if (spec[0] == '@')
+    {
+	GError *error = NULL;
+	char *contents;
+	char **lines;
+	int i;
+
+	if (!g_file_get_contents(spec + 1, &contents, NULL, &error))
+	{
+	    char *message = g_strdup(error->message);
+
+	    g_error_free(error);
+	    g_ptr_array_free(array, TRUE);
+	    return message;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; ++i)
+	{
+	    g_strstrip(lines[i]);
+	    if (lines[i][0] != '\0')
+		g_ptr_array_add(array, g_strdup(lines[i]));
+	}
+
+	g_strfreev(lines);
+	g_free(contents);
+    }
+    else
+    {
+#ifndef __MINGW32__
+	glob_t matches;
+	size_t i;
+
+	if (glob(spec, 0, NULL, &matches) == 0)
+	{
+	    for (i = 0; i < matches.gl_pathc; ++i)
+		g_ptr_array_add(array, g_strdup(matches.gl_pathv[i]));
+	    globfree(&matches);
+	}
+#else
+	g_ptr_array_add(array, g_strdup(spec));
+#endif
+    }
+
+    if (array->len == 0)
+    {
+	g_ptr_array_free(array, TRUE);
+	return g_strdup_printf(_("No input images match `%s'."), spec);
+    }
+
+    g_ptr_array_add(array, NULL);
+    *inputs = (char**)g_ptr_array_free(array, FALSE);
+
+    return NULL;
+}
+
+static void
+decode_batch_slot (batch_slot_t *slot)
+{
+    double trace_start = mathmap_trace_begin();
+
+    slot->input = read_image_scaled(slot->input_filename, input_min_width, input_min_height,
+				    &slot->input_width, &slot->input_height);
+
+    mathmap_trace_end("decode image", "io", trace_start);
+}
+
+/* Renders the decoded input of SLOT.  Returns an error message, which
+   must be freed, or NULL. */
+static char*
+render_batch_slot (batch_t *batch, batch_slot_t *slot)
+{
+    int img_width = batch->img_width, img_height = batch->img_height;
+
+    if (slot->input == NULL)
+	return g_strdup_printf(_("Cannot read input image `%s'."), slot->input_filename);
+
+    if (img_width == 0)
+    {
+	img_width = slot->input_width;
+	img_height = slot->input_height;
+    }
+
+    /* the drawable for the input claims the decoded image */
+    add_preloaded_image(slot->input_filename, slot->input, slot->input_width, slot->input_height);
+    slot->input = NULL;
+
+    if (batch->invocation != NULL
+	&& (batch->invocation->img_width != img_width || batch->invocation->img_height != img_height))
+    {
+	free_cmdline_invocation(batch->invocation);
+	batch->invocation = NULL;
+    }
+
+    if (batch->invocation == NULL)
+    {
+	define_t batch_define;
+	int num_input_drawables = 0;
+	char *error;
+
+	batch_define.name = batch->batch_userval->name;
+	batch_define.value = (char*)slot->input_filename;
+	batch_define.next = batch->defines;
+
+	batch->invocation = invoke_mathmap(batch->mathmap, NULL, img_width, img_height, TRUE);
+
+	error = set_uservals_from_defines(batch->invocation, &batch_define, &num_input_drawables);
+	if (error != NULL)
+	{
+	    free_cmdline_invocation(batch->invocation);
+	    batch->invocation = NULL;
+	    return error;
+	}
+
+	apply_render_config(batch->invocation, batch->config);
+    }
+    else
+    {
+	userval_t *userval = &batch->invocation->uservals[batch->batch_userval->index];
+	input_drawable_t *drawable = alloc_cmdline_image_input_drawable(slot->input_filename);
+
+	if (drawable == NULL)
+	    return g_strdup_printf(_("Cannot read input image `%s'."), slot->input_filename);
+
+	release_cache_entries(userval->v.image->v.drawable);
+	invocation_forget_input_images(batch->invocation);
+	assign_image_userval_drawable(batch->batch_userval, userval, drawable);
+    }
+
+    slot->output_width = img_width;
+    slot->output_height = img_height;
+    slot->output = g_malloc((size_t)batch->invocation->output_bpp * img_width * img_height);
+
+    render_frame(batch->invocation, 0, 1, img_width, img_height, slot->output, batch->config->num_threads);
+
+    return NULL;
+}
+
+static void
+write_batch_slot (batch_slot_t *slot)
+{
+    if (slot->output != NULL)
+    {
+	double trace_start = mathmap_trace_begin();
+
+	write_image(slot->output_filename, slot->output_width, slot->output_height, slot->output,
+		    4, slot->output_width * 4, IMAGE_FORMAT_PNG);
+
+	mathmap_trace_end("encode image", "io", trace_start);
+
+	g_free(slot->output);
+	slot->output = NULL;
+    }
+
+    g_free(slot->output_filename);
+    slot->output_filename = NULL;
+}
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+static void
+wait_for_batch_slot (batch_t *batch, batch_slot_t *slot, int state)
+{
+    double trace_start = mathmap_trace_begin();
+
+    g_mutex_lock(batch->mutex);
+    while (slot->state != state)
+	g_cond_wait(batch->cond, batch->mutex);
+    g_mutex_unlock(batch->mutex);
+
+    mathmap_trace_end("wait for batch slot", "lock", trace_start);
+}
+
+static void
+set_batch_slot_state (batch_t *batch, batch_slot_t *slot, int state)
+{
+    g_mutex_lock(batch->mutex);
+    slot->state = state;
+    g_cond_broadcast(batch->cond);
+    g_mutex_unlock(batch->mutex);
+}
+
+static void
+batch_decoder (gpointer _data)
+{
+    batch_t *batch = (batch_t*)_data;
+    int i;
+
+    for (i = 0; i < batch->num_inputs; ++i)
+    {
+	batch_slot_t *slot = &batch->slots[i % BATCH_NUM_SLOTS];
+
+	wait_for_batch_slot(batch, slot, BATCH_SLOT_FREE);
+	slot->input_filename = batch->inputs[i];
+	decode_batch_slot(slot);
+	set_batch_slot_state(batch, slot, BATCH_SLOT_DECODED);
+    }
+}
+
+static void
+batch_writer (gpointer _data)
+{
+    batch_t *batch = (batch_t*)_data;
+    int i;
+
+    for (i = 0; i < batch->num_inputs; ++i)
+    {
+	batch_slot_t *slot = &batch->slots[i % BATCH_NUM_SLOTS];
+
+	wait_for_batch_slot(batch, slot, BATCH_SLOT_RENDERED);
+	write_batch_slot(slot);
+	set_batch_slot_state(batch, slot, BATCH_SLOT_FREE);
+    }
+}
+#endif
+
+/* Renders all inputs of BATCH, reporting the ones that fail.  Returns
+   the number of failures. */
+static int
+run_batch (batch_t *batch)
+{
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    thread_handle_t decoder, writer;
+#endif
+    int num_failed = 0;
+    int i;
+
+    memset(batch->slots, 0, sizeof(batch->slots));
+    batch->invocation = NULL;
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    if (!g_thread_supported())
+	g_thread_init(NULL);
+
+    batch->mutex = g_mutex_new();
+    batch->cond = g_cond_new();
+
+    decoder = mathmap_thread_start(batch_decoder, batch);
+    writer = mathmap_thread_start(batch_writer, batch);
+#endif
+
+    for (i = 0; i < batch->num_inputs; ++i)
+    {
+	batch_slot_t *slot = &batch->slots[i % BATCH_NUM_SLOTS];
+	char *error;
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+	wait_for_batch_slot(batch, slot, BATCH_SLOT_DECODED);
+#else
+	slot->input_filename = batch->inputs[i];
+	decode_batch_slot(slot);
+#endif
+
+	slot->output_filename = make_batch_output_filename(batch->output_pattern, slot->input_filename);
+
+	error = render_batch_slot(batch, slot);
+	if (error != NULL)
+	{
+	    fprintf(stderr, _("Error: %s\n"), error);
+	    g_free(error);
+	    ++num_failed;
+	}
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+	set_batch_slot_state(batch, slot, BATCH_SLOT_RENDERED);
+#else
+	write_batch_slot(slot);
+#endif
+    }
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    mathmap_thread_join(decoder);
+    mathmap_thread_join(writer);
+
+    g_cond_free(batch->cond);
+    g_mutex_free(batch->mutex);
+#endif
+
+    if (batch->invocation != NULL)
+	free_cmdline_invocation(batch->invocation);
+    free_preloaded_images();
+
+    return num_failed;
+}
+
+/*** tiled rendering ***/
+
+/* With --region, only a rectangle of the canvas is rendered, with the
+   same coordinates it has in the full image, so tiles rendered on
+   different machines can be put together with --merge.  Native
+   filters still see whole images, because they render their inputs
+   at the size of the canvas, not of the region. */
+
+typedef struct
+{
+    char *filename;
+    int x, y;
+    image_reader_t *reader;	/* open while the output rows cross the tile */
+    guchar *line;
+} merge_tile_t;
+
+/* Parses a tile for --merge, given as X,Y:FILENAME. */
+static gboolean
+parse_merge_tile (const char *str, merge_tile_t *tile)
+{
+    int length;
+
+    if (sscanf(str, "%d,%d:%n", &tile->x, &tile->y, &length) != 2 || str[length] == '\0'
+	|| tile->x < 0 || tile->y < 0)
+	return FALSE;
+
+    tile->filename = g_strdup(str + length);
+    tile->reader = NULL;
+    tile->line = NULL;
+
+    return TRUE;
+}
+
+static void
+close_merge_tile (merge_tile_t *tile)
+{
+    if (tile->reader != NULL)
+	free_image_reader(tile->reader);
+    tile->reader = NULL;
+    g_free(tile->line);
+    tile->line = NULL;
+}
+
+/* Writes the IMG_WIDTH x IMG_HEIGHT image OUTPUT_FILENAME from
+   TILES, one row at a time, so that only a row of each tile is in
+   memory.  A tile is opened when the rows reach it and closed after
+   its last row.  Pixels that no tile covers are transparent black,
+   and where tiles overlap, the later one wins.  Pixels, alpha
+   included, are written just like a render writes them, so merging
+   the tiles of a render gives the same file as rendering it whole.
+   Returns an error message, which must be freed, or NULL. */
+static char*
+merge_tiles (merge_tile_t *tiles, int num_tiles, int img_width, int img_height, const char *output_filename)
+{
+    image_writer_t *writer;
+    guchar *row;
+    char *error = NULL;
+    int y, i;
+
+    writer = open_image_writing(output_filename, img_width, img_height, 4, img_width * 4, IMAGE_FORMAT_PNG);
+    if (writer == NULL)
+	return g_strdup_printf(_("Cannot write output image `%s'."), output_filename);
+
+    row = g_malloc((size_t)img_width * 4);
+
+    for (y = 0; y < img_height && error == NULL; ++y)
+    {
+	memset(row, 0, (size_t)img_width * 4);
+
+	for (i = 0; i < num_tiles; ++i)
+	{
+	    merge_tile_t *tile = &tiles[i];
+
+	    if (y == tile->y)
+	    {
+		tile->reader = open_image_reading(tile->filename);
+		if (tile->reader == NULL)
+		{
+		    error = g_strdup_printf(_("Cannot read tile `%s'."), tile->filename);
+		    break;
+		}
+		if (tile->x + tile->reader->width > img_width || tile->y + tile->reader->height > img_height)
+		{
+		    error = g_strdup_printf(_("Tile `%s' doesn't fit into the image."), tile->filename);
+		    break;
+		}
+		tile->line = g_malloc((size_t)tile->reader->width * 4);
+	    }
+
+	    if (tile->reader == NULL)
+		continue;
+
+	    read_lines_rgba(tile->reader, tile->line, 1);
+	    memcpy(row + tile->x * 4, tile->line, (size_t)tile->reader->width * 4);
+
+	    if (y == tile->y + tile->reader->height - 1)
+		close_merge_tile(tile);
+	}
+
+	if (error == NULL)
+	    write_lines(writer, row, 1);
+    }
+
+    for (i = 0; i < num_tiles; ++i)
+	close_merge_tile(&tiles[i]);
+
+    g_free(row);
+    free_image_writer(writer);
+
+    if (error != NULL)
+	unlink(output_filename);
+
+    return error;
+}
+
+#ifndef __MINGW32__
+/* Renders the IMG_WIDTH x IMG_HEIGHT image by running NUM_WORKERS
+   copies of this program, each of which renders a band of rows with
+   --region into a tile next to the output, and merges the tiles.  The
+   workers get the options in ARGV before OPTIND, which getopt() has
+   moved in front of the arguments, with the output filename, the last
+   argument, replaced by their tile, and share NUM_THREADS threads.
+   Returns an error message, which must be freed, or NULL. */
+static char*
+run_tile_workers (int argc, char *argv[], int optind, int img_width, int img_height,
+		  int num_workers, int num_threads)
+{
+    const char *output_filename = argv[argc - 1];
+    merge_tile_t *tiles;
+    pid_t *pids;
+    char *error = NULL;
+    int i;
+
+    num_workers = MIN(num_workers, img_height);
+    tiles = g_new0(merge_tile_t, num_workers);
+    pids = g_new(pid_t, num_workers);
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < num_workers; ++i)
+    {
+	int y = img_height * i / num_workers;
+	int band_height = img_height * (i + 1) / num_workers - y;
+	GPtrArray *args = g_ptr_array_new();
+	int j;
+
+	tiles[i].filename = g_strdup_printf("%s.tile%d.png", output_filename, i);
+	tiles[i].x = 0;
+	tiles[i].y = y;
+
+	for (j = 0; j < optind; ++j)
+	    if (j < optind - 1 || strcmp(argv[j], "--") != 0)
+		g_ptr_array_add(args, g_strdup(argv[j]));
+	g_ptr_array_add(args, g_strdup_printf("--size=%dx%d", img_width, img_height));
+	g_ptr_array_add(args, g_strdup_printf("--frame-threads=%d", MAX(num_threads / num_workers, 1)));
+	g_ptr_array_add(args, g_strdup_printf("--region=0,%d,%d,%d", y, img_width, band_height));
+	g_ptr_array_add(args, g_strdup("--"));
+	for (j = optind; j < argc - 1; ++j)
+	    g_ptr_array_add(args, g_strdup(argv[j]));
+	g_ptr_array_add(args, g_strdup(tiles[i].filename));
+	g_ptr_array_add(args, NULL);
+
+	pids[i] = fork();
+	if (pids[i] == 0)
+	{
+	    execvp(argv[0], (char**)args->pdata);
+	    fprintf(stderr, _("Error: Cannot run `%s': %s\n"), argv[0], strerror(errno));
+	    _exit(127);
+	}
+
+	g_strfreev((char**)g_ptr_array_free(args, FALSE));
+
+	if (pids[i] < 0)
+	{
+	    error = g_strdup_printf(_("Cannot start worker: %s"), strerror(errno));
+	    g_free(tiles[i].filename);
+	    break;
+	}
+    }
+
+    /* all workers that were started must be waited for */
+    num_workers = i;
+    for (i = 0; i < num_workers; ++i)
+    {
+	int status;
+
+	if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+	    if (error == NULL)
+		error = g_strdup_printf(_("Worker %d failed."), i);
+	}
+    }
+
+    if (error == NULL)
+	error = merge_tiles(tiles, num_workers, img_width, img_height, output_filename);
+
+    for (i = 0; i < num_workers; ++i)
+    {
+	unlink(tiles[i].filename);
+	g_free(tiles[i].filename);
+    }
+    g_free(tiles);
+    g_free(pids);
+
+    return error;
+}
+#endif
+
+/*** render daemon ***/
+
+/* In daemon mode, mathmap listens on a UNIX socket and renders jobs
+   sent by clients, keeping compiled filters and decoded input images
+   in caches, so that a job only has to pay for rendering when its
+   filter and inputs have been seen before.  A job is a series of
+   lines, ended by an empty line:
+
+     expression <length>	followed by <length> bytes of script
+     script <filename>		read the script from <filename>
+     filter <name>		read the script <name>.mm from the filter
+				directory
+     size <width>x<height>	optional if there are input images
+     define <name>=<value>	user value, repeatable
+     output <filename>		PNG file to write
+
+   Scripts, input images and output files must be in the root
+   directory.  The reply is a line "ok <seconds>" or "error
+   <message>".  A client can send more jobs on the same connection.
+   The socket is only accessible to the user running the daemon.
+
+   Every connection is read by its own thread, so a slow client
+   doesn't hold up the others, and one that stalls for longer than
+   DAEMON_READ_TIMEOUT is dropped.  Complete jobs go to a queue, from
+   which a pool of job threads takes them.  A job is set up -- its
+   filter compiled, its inputs decoded and its invocation allocated --
+   with daemon_mutex held, because the compiler and the image caches
+   aren't reentrant, but jobs render and write their output
+   concurrently, each with all the render threads.  The input images
+   of a job stay pinned in the input image cache until it is done, so
+   rendering never decodes, and their pixels are shared with the
+   daemon's image cache instead of being copied. */
+
+/* seconds */
+#define DAEMON_READ_TIMEOUT		60
+/* scripts are small, so this is only a sanity check */
+#define DAEMON_MAX_EXPRESSION_LENGTH	((size_t)1 << 20)
+/* connections beyond this are refused */
+#define DAEMON_MAX_CONNECTIONS		64
+
+static int daemon_max_filters = 8;
+static size_t daemon_max_image_bytes = (size_t)256 << 20;
+static int daemon_num_job_threads = 4;
+
+#ifndef __MINGW32__
+typedef struct
+{
+    char *script;
+    mathmap_t *mathmap;
+    int last_used;
+    int users;			/* jobs using it, which keep it from being evicted */
+} daemon_filter_t;
+
+typedef struct _daemon_image_t
+{
+    char *filename;
+    int min_width, min_height;
+    time_t mtime;
+    guchar *data;
+    int width, height;
+    int last_used;
+    volatile gint refs;		/* the cache's, and those of input cache entries */
+    struct _daemon_image_t *next;
+} daemon_image_t;
+
+typedef struct
+{
+    const char *filter_dir;
+    char *root_dir;		/* resolved */
+    render_config_t render;
+} daemon_config_t;
+
+/* Protects the compiler, the filter and image caches, and the input
+   image sizes. */
+static GMutex *daemon_mutex = NULL;
+
+static daemon_filter_t *daemon_filters = NULL;
+
+static daemon_image_t *daemon_images = NULL;
+static size_t daemon_image_bytes = 0;
+static int daemon_clock = 0;
+
+static volatile gint daemon_num_connections = 0;
+
+/* Returns the compiled filter for SCRIPT, compiling it if it's not
+   cached, or NULL and an error message.  *FILTER is set to its cache
+   slot, which is kept until release_daemon_filter(), or to NULL if
+   the slots are all used by other jobs, in which case the filter
+   isn't cached.  Must be called with daemon_mutex held. */
+static mathmap_t*
+get_daemon_filter (char *script, int compile_time_limit, daemon_filter_t **filter, char **error)
+{
+    char *support_paths[1] = { NULL };
+    mathmap_t *mathmap;
+    int i, lru_index = -1;
+
+    for (i = 0; i < daemon_max_filters; ++i)
+    {
+	if (daemon_filters[i].script != NULL && strcmp(daemon_filters[i].script, script) == 0)
+	{
+	    daemon_filters[i].last_used = ++daemon_clock;
+	    ++daemon_filters[i].users;
+	    *filter = &daemon_filters[i];
+	    return daemon_filters[i].mathmap;
+	}
+
+	if (daemon_filters[i].users == 0
+	    && (lru_index < 0
+		|| daemon_filters[i].script == NULL
+		|| (daemon_filters[lru_index].script != NULL
+		    && daemon_filters[i].last_used < daemon_filters[lru_index].last_used)))
+	    lru_index = i;
+    }
+
+    mathmap = compile_mathmap(script, support_paths, compile_time_limit, FALSE);
+    if (mathmap == NULL)
+    {
+	*error = g_strdup(error_string);
+	return NULL;
+    }
+
+    *filter = NULL;
+    if (lru_index < 0)
+	return mathmap;
+
+    if (daemon_filters[lru_index].script != NULL)
+    {
+	free_mathmap(daemon_filters[lru_index].mathmap);
+	g_free(daemon_filters[lru_index].script);
+    }
+
+    /* the compiled filter might refer to the script */
+    daemon_filters[lru_index].script = g_strdup(script);
+    daemon_filters[lru_index].mathmap = mathmap;
+    daemon_filters[lru_index].last_used = ++daemon_clock;
+    daemon_filters[lru_index].users = 1;
+    *filter = &daemon_filters[lru_index];
+
+    return mathmap;
+}
+
+/* Must be called with daemon_mutex held. */
+static void
+release_daemon_filter (daemon_filter_t *filter, mathmap_t *mathmap)
+{
+    if (filter != NULL)
+	--filter->users;
+    else
+	free_mathmap(mathmap);
+}
+
+static void
+unref_daemon_image (daemon_image_t *image)
+{
+    if (g_atomic_int_dec_and_test(&image->refs))
+    {
+	free(image->data);
+	g_free(image->filename);
+	g_free(image);
+    }
+}
+
+/* Takes *P out of the cache.  Input cache entries still using it keep
+   it alive. */
+static void
+remove_daemon_image (daemon_image_t **p)
+{
+    daemon_image_t *image = *p;
+
+    *p = image->next;
+    daemon_image_bytes -= (size_t)image->width * image->height * 3;
+    unref_daemon_image(image);
+}
+
+static daemon_image_t*
+lookup_daemon_image (const char *filename)
+{
+    daemon_image_t *image;
+
+    for (image = daemon_images; image != NULL; image = image->next)
+	if (strcmp(image->filename, filename) == 0
+	    && image->min_width == input_min_width && image->min_height == input_min_height)
+	    return image;
+
+    return NULL;
+}
+
+/* Returns the decoded image FILENAME at the current reduced size,
+   decoding it if it's not cached or has changed on disk, or NULL if it
+   can't be read.  Must be called with daemon_mutex held. */
+static daemon_image_t*
+load_daemon_image (const char *filename)
+{
+    daemon_image_t *image = lookup_daemon_image(filename);
+    struct stat buf;
+
+    if (stat(filename, &buf) != 0)
+	return NULL;
+
+    if (image != NULL && image->mtime != buf.st_mtime)
+    {
+	daemon_image_t **p;
+
+	for (p = &daemon_images; *p != image; p = &(*p)->next)
+	    ;
+	remove_daemon_image(p);
+	image = NULL;
+    }
+
+    if (image == NULL)
+    {
+	double trace_start = mathmap_trace_begin();
+	guchar *data;
+	int width, height;
+
+	data = read_image_scaled(filename, input_min_width, input_min_height, &width, &height);
+	mathmap_trace_end("decode image", "io", trace_start);
+	if (data == NULL)
+	    return NULL;
+
+	image = g_new0(daemon_image_t, 1);
+	image->filename = g_strdup(filename);
+	image->min_width = input_min_width;
+	image->min_height = input_min_height;
+	image->mtime = buf.st_mtime;
+	image->data = data;
+	image->width = width;
+	image->height = height;
+	image->refs = 1;
+	image->next = daemon_images;
+	daemon_images = image;
+	daemon_image_bytes += (size_t)width * height * 3;
+
+	/* evict the least recently used images, but not this one */
+	while (daemon_image_bytes > daemon_max_image_bytes)
+	{
+	    daemon_image_t **p, **lru = NULL;
+
+	    for (p = &daemon_images->next; *p != NULL; p = &(*p)->next)
+		if (lru == NULL || (*p)->last_used < (*lru)->last_used)
+		    lru = p;
+	    if (lru == NULL)
+		break;
+
+	    remove_daemon_image(lru);
+	}
+    }
+    else
+	mathmap_trace_instant("daemon image cache hit", "cache");
+
+    image->last_used = ++daemon_clock;
+
+    return image;
+}
+#endif
+
+/* Returns the pixels of the decoded image FILENAME if the daemon has
+   it cached, with a reference to it in *IMAGE, or NULL.  In daemon
+   mode, input images are only decoded while a job is set up, with
+   daemon_mutex held. */
+static guchar*
+ref_daemon_image (const char *filename, int *width, int *height, struct _daemon_image_t **image)
+{
+#ifndef __MINGW32__
+    daemon_image_t *cached = lookup_daemon_image(filename);
+
+    if (cached == NULL)
+	return NULL;
+
+    g_atomic_int_inc(&cached->refs);
+    *image = cached;
+    *width = cached->width;
+    *height = cached->height;
+
+    return cached->data;
+#else
+    return NULL;
+#endif
+}
+
+#ifndef __MINGW32__
+/* Whether FILENAME is in ROOT_DIR, which must be resolved.  An output
+   file, which doesn't have to exist yet, must not be a symbolic
+   link. */
+static gboolean
+daemon_path_is_allowed (const char *root_dir, const char *filename, gboolean is_output)
+{
+    size_t root_length = strlen(root_dir);
+    char *resolved = NULL;
+    gboolean allowed;
+
+    if (is_output)
+    {
+	char *dirname = g_path_get_dirname(filename);
+	char *basename = g_path_get_basename(filename);
+	struct stat buf;
+
+	if (strcmp(basename, ".") != 0 && strcmp(basename, "..") != 0
+	    && strcmp(basename, G_DIR_SEPARATOR_S) != 0
+	    && (lstat(filename, &buf) != 0 || !S_ISLNK(buf.st_mode)))
+	    resolved = realpath(dirname, NULL);
+
+	g_free(dirname);
+	g_free(basename);
+    }
+    else
+	resolved = realpath(filename, NULL);
+
+    if (resolved == NULL)
+	return FALSE;
+
+    allowed = strncmp(resolved, root_dir, root_length) == 0
+	&& (root_dir[root_length - 1] == '/' || resolved[root_length] == '/' || resolved[root_length] == '\0');
+
+    free(resolved);
+
+    return allowed;
+}
+
+typedef struct
+{
+    char *script;
+    int width, height;		/* zero if not given */
+    define_t *defines;
+    char *output_filename;
+} daemon_job_t;
+
+static void
+free_daemon_job (daemon_job_t *job)
+{
+    while (job->defines != NULL)
+    {
+	define_t *next = job->defines->next;
+
+	free(job->defines->name);
+	free(job->defines->value);
+	g_free(job->defines);
+	job->defines = next;
+    }
+
+    g_free(job->script);
+    g_free(job->output_filename);
+}
+
+/* Reads a line without the newline.  Returns NULL at the end of the
+   input. */
+static char*
+read_daemon_line (FILE *in)
+{
+    GString *line = g_string_new(NULL);
+    int c;
+
+    while ((c = getc(in)) != EOF && c != '\n')
+	g_string_append_c(line, c);
+
+    if (c == EOF && line->len == 0)
+    {
+	g_string_free(line, TRUE);
+	return NULL;
+    }
+
+    return g_string_free(line, FALSE);
+}
+
+/* Returns FALSE at the end of the input.  Otherwise, if the job is
+   malformed, sets ERROR. */
+static gboolean
+read_daemon_job (FILE *in, daemon_config_t *config, daemon_job_t *job, char **error)
+{
+    char *line;
+    gboolean have_lines = FALSE;
+
+    memset(job, 0, sizeof(daemon_job_t));
+    *error = NULL;
+
+    while ((line = read_daemon_line(in)) != NULL)
+    {
+	char *arg = strchr(line, ' ');
+
+	if (line[0] == '\0')
+	{
+	    g_free(line);
+	    if (have_lines)
+		break;
+	    continue;
+	}
+	have_lines = TRUE;
+
+	if (arg != NULL)
+	    *(arg++) = '\0';
+
+	/* the script text has to be consumed even after an error */
+	if (arg != NULL && strcmp(line, "expression") == 0)
+	{
+	    size_t length = strtoul(arg, NULL, 10);
+
+	    g_free(job->script);
+	    job->script = NULL;
+
+	    if (length > DAEMON_MAX_EXPRESSION_LENGTH)
+	    {
+		char buffer[4096];
+		size_t left = length;
+
+		while (left > 0)
+		{
+		    size_t n = fread(buffer, 1, MIN(left, sizeof(buffer)), in);
+
+		    if (n == 0)
+			break;
+		    left -= n;
+		}
+
+		if (*error == NULL)
+		    *error = g_strdup_printf(_("Expression is longer than %lu bytes."),
+					     (unsigned long)DAEMON_MAX_EXPRESSION_LENGTH);
+	    }
+	    else
+	    {
+		job->script = g_malloc(length + 1);
+		if (fread(job->script, 1, length, in) != length && *error == NULL)
+		    *error = g_strdup(_("Expression is truncated."));
+		job->script[length] = '\0';
+	    }
+	}
+	else if (*error != NULL)
+	    ;
+	else if (arg == NULL)
+	    *error = g_strdup_printf(_("Malformed line `%s'."), line);
+	else if (strcmp(line, "script") == 0 || strcmp(line, "filter") == 0)
+	{
+	    char *filename;
+
+	    if (line[0] == 'f' && strchr(arg, '/') != NULL)
+		filename = NULL;
+	    else if (line[0] == 'f')
+		filename = g_strdup_printf("%s/%s.mm", config->filter_dir, arg);
+	    else if (daemon_path_is_allowed(config->root_dir, arg, FALSE))
+		filename = g_strdup(arg);
+	    else
+		filename = NULL;
+
+	    g_free(job->script);
+	    job->script = NULL;
+	    if (filename == NULL || !g_file_get_contents(filename, &job->script, NULL, NULL))
+		*error = g_strdup_printf(_("The script `%s' could not be read."), arg);
+	    g_free(filename);
+	}
+	else if (strcmp(line, "size") == 0)
+	{
+	    if (!parse_image_size(arg, &job->width, &job->height) || job->width <= 0 || job->height <= 0)
+		*error = g_strdup(_("Invalid image size."));
+	}
+	else if (strcmp(line, "define") == 0)
+	{
+	    if (strchr(arg, '=') == NULL)
+		*error = g_strdup_printf(_("Definition `%s' is malformed."), arg);
+	    else
+		append_define(arg, &job->defines);
+	}
+	else if (strcmp(line, "output") == 0)
+	{
+	    g_free(job->output_filename);
+	    job->output_filename = NULL;
+	    if (daemon_path_is_allowed(config->root_dir, arg, TRUE))
+		job->output_filename = g_strdup(arg);
+	    else
+		*error = g_strdup_printf(_("The output file `%s' is not in the root directory."), arg);
+	}
+	else
+	    *error = g_strdup_printf(_("Unknown keyword `%s'."), line);
+
+	g_free(line);
+    }
+
+    if (!have_lines)
+	return FALSE;
+
+    if (*error == NULL && job->script == NULL)
+	*error = g_strdup(_("No script given."));
+    if (*error == NULL && job->output_filename == NULL)
+	*error = g_strdup(_("No output file given."));
+
+    return TRUE;
+}
+
+/* Decodes the input images of JOB and allocates its invocation of
+   MATHMAP in *INVOCATION, with the input images pinned.  Returns an
+   error message, which must be freed, or NULL.  Must be called with
+   daemon_mutex held. */
+static char*
+set_up_daemon_job (daemon_job_t *job, daemon_config_t *config, mathmap_t *mathmap,
+		   mathmap_invocation_t **invocation)
+{
+    userval_info_t *info;
+    int img_width = job->width, img_height = job->height;
+    int num_input_drawables = 0;
+    int num_read_failures;
+    char *error;
+
+    input_min_width = img_width;
+    input_min_height = img_height;
+
+    /* decode the inputs before the drawables are allocated, so that a
+       missing input is an error, not a crash */
+    for (info = mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+    {
+	define_t *define;
+	daemon_image_t *image;
+
+	if (info->type != USERVAL_IMAGE)
+	    continue;
+
+	define = lookup_define(job->defines, info->name);
+	if (define == NULL)
+	    return g_strdup_printf(_("No value defined for input image `%s'."), info->name);
+
+	if (!daemon_path_is_allowed(config->root_dir, define->value, FALSE)
+	    || (image = load_daemon_image(define->value)) == NULL)
+	    return g_strdup_printf(_("Cannot read input image `%s'."), define->value);
+
+	if (img_width == 0)
+	{
+	    img_width = image->width;
+	    img_height = image->height;
+	}
+    }
+
+    if (img_width == 0)
+	return g_strdup(_("Image size not set and no input images given."));
+
+    num_read_failures = g_atomic_int_get(&num_input_read_failures);
+
+    *invocation = invoke_mathmap(mathmap, NULL, img_width, img_height, TRUE);
+
+    error = set_uservals_from_defines(*invocation, job->defines, &num_input_drawables);
+    if (error != NULL)
+    {
+	free_cmdline_invocation(*invocation);
+	return error;
+    }
+
+    pin_input_images(*invocation);
+
+    /* an input that was evicted from the cache and couldn't be read
+       again */
+    if (g_atomic_int_get(&num_input_read_failures) != num_read_failures)
+    {
+	unpin_input_images(*invocation);
+	free_cmdline_invocation(*invocation);
+	return g_strdup(_("An input image could not be read."));
+    }
+
+    apply_render_config(*invocation, &config->render);
+
+    return NULL;
+}
+
+/* Returns an error message, which must be freed, or NULL. */
+static char*
+run_daemon_job (daemon_job_t *job, daemon_config_t *config, double *render_time)
+{
+    mathmap_t *mathmap;
+    daemon_filter_t *filter;
+    mathmap_invocation_t *invocation = NULL;
+    char *error = NULL;
+    guchar *output;
+    int img_width, img_height;
+    double start_time;
+
+    g_mutex_lock(daemon_mutex);
+    mathmap = get_daemon_filter(job->script, config->render.compile_time_limit, &filter, &error);
+    if (mathmap != NULL)
+    {
+	error = set_up_daemon_job(job, config, mathmap, &invocation);
+	if (error != NULL)
+	    release_daemon_filter(filter, mathmap);
+    }
+    g_mutex_unlock(daemon_mutex);
+
+    if (error != NULL)
+	return error;
+
+    img_width = invocation->img_width;
+    img_height = invocation->img_height;
+    output = g_malloc((size_t)invocation->output_bpp * img_width * img_height);
+
+    start_time = mathmap_wall_time();
+    render_frame(invocation, 0, 1, img_width, img_height, output, config->render.num_threads);
+    *render_time = mathmap_wall_time() - start_time;
+
+    write_image(job->output_filename, img_width, img_height, output,
+		invocation->output_bpp, img_width * invocation->output_bpp, IMAGE_FORMAT_PNG);
+
+    g_free(output);
+    unpin_input_images(invocation);
+
+    g_mutex_lock(daemon_mutex);
+    free_cmdline_invocation(invocation);
+    release_daemon_filter(filter, mathmap);
+    g_mutex_unlock(daemon_mutex);
+
+    return NULL;
+}
+
+/* A job waiting in the queue, and its result. */
+typedef struct
+{
+    daemon_job_t job;
+    char *error;
+    double render_time;
+    GAsyncQueue *reply_queue;	/* of the connection, gets the request when done */
+} daemon_request_t;
+
+typedef struct
+{
+    int fd;
+    daemon_config_t *config;
+} daemon_connection_t;
+
+static GAsyncQueue *daemon_job_queue = NULL;
+
+static gpointer
+run_daemon_jobs (gpointer data)
+{
+    daemon_config_t *config = (daemon_config_t*)data;
+
+    for (;;)
+    {
+	daemon_request_t *request = (daemon_request_t*)g_async_queue_pop(daemon_job_queue);
+	double trace_start = mathmap_trace_begin();
+
+	request->error = run_daemon_job(&request->job, config, &request->render_time);
+
+	mathmap_trace_end("daemon job", "daemon", trace_start);
+
+	g_async_queue_push(request->reply_queue, request);
+    }
+
+    return NULL;
+}
+
+static gpointer
+serve_daemon_connection (gpointer data)
+{
+    daemon_connection_t *connection = (daemon_connection_t*)data;
+    int fd = connection->fd;
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    GAsyncQueue *reply_queue;
+    daemon_request_t request;
+    char *error;
+
+    if (in == NULL || out == NULL)
+    {
+	if (in != NULL)
+	    fclose(in);
+	else
+	    close(fd);
+	if (out != NULL)
+	    fclose(out);
+	g_free(connection);
+	g_atomic_int_add(&daemon_num_connections, -1);
+	return NULL;
+    }
+
+    reply_queue = g_async_queue_new();
+
+    while (read_daemon_job(in, connection->config, &request.job, &error))
+    {
+	if (error == NULL)
+	{
+	    request.error = NULL;
+	    request.render_time = 0.0;
+	    request.reply_queue = reply_queue;
+
+	    g_async_queue_push(daemon_job_queue, &request);
+	    g_async_queue_pop(reply_queue);
+
+	    error = request.error;
+	}
+
+	if (error != NULL)
+	{
+	    /* the reply is a single line */
+	    g_strdelimit(error, "\n", ' ');
+	    fprintf(out, "error %s\n", error);
+	    g_free(error);
+	}
+	else
+	    fprintf(out, "ok %.6f\n", request.render_time);
+	fflush(out);
+
+	free_daemon_job(&request.job);
+
+	if (ferror(out))
+	    break;
+    }
+
+    g_async_queue_unref(reply_queue);
+    fclose(in);
+    fclose(out);
+    g_free(connection);
+    g_atomic_int_add(&daemon_num_connections, -1);
+
+    return NULL;
+}
+
+static void
+refuse_daemon_connection (int fd)
+{
+    char *reply = g_strdup_printf("error %s\n", _("Too many connections."));
+
+    /* the client learns why if it's listening, but it's not waited for */
+    send(fd, reply, strlen(reply), MSG_DONTWAIT);
+    g_free(reply);
+    close(fd);
+}
+
+static int
+run_daemon (const char *socket_path, daemon_config_t *config)
+{
+    struct sockaddr_un addr;
+    int listen_fd;
+    mode_t old_mask;
+    int i;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+	fprintf(stderr, _("Error: Socket path `%s' is too long.\n"), socket_path);
+	return 1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+	fprintf(stderr, _("Error: Cannot create socket: %s\n"), strerror(errno));
+	return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    unlink(socket_path);
+    /* the socket is created with mode 0600, so that other users can't
+       make us read and write files */
+    old_mask = umask(077);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+	|| listen(listen_fd, 16) != 0)
+    {
+	fprintf(stderr, _("Error: Cannot listen on socket `%s': %s\n"), socket_path, strerror(errno));
+	umask(old_mask);
+	close(listen_fd);
+	return 1;
+    }
+    umask(old_mask);
+
+    /* a client hanging up must not kill the daemon */
+    signal(SIGPIPE, SIG_IGN);
+
+    daemon_filters = g_new0(daemon_filter_t, daemon_max_filters);
+
+    /* input images that fail to decode again fail their job */
+    input_read_failures_are_fatal = FALSE;
+
+    if (!g_thread_supported())
+	g_thread_init(NULL);
+
+    daemon_mutex = g_mutex_new();
+    daemon_job_queue = g_async_queue_new();
+    for (i = 0; i < daemon_num_job_threads; ++i)
+	if (g_thread_create(run_daemon_jobs, config, FALSE, NULL) == NULL)
+	{
+	    if (i > 0)
+		break;
+	    fprintf(stderr, _("Error: Cannot start the job threads.\n"));
+	    close(listen_fd);
+	    return 1;
+	}
+
+    for (;;)
+    {
+	struct timeval timeout;
+	daemon_connection_t *connection;
+	int fd = accept(listen_fd, NULL, NULL);
+
+	if (fd < 0)
+	{
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    fprintf(stderr, _("Error: Cannot accept connection: %s\n"), strerror(errno));
+	    close(listen_fd);
+	    return 1;
+	}
+
+	if (g_atomic_int_exchange_and_add(&daemon_num_connections, 1) >= DAEMON_MAX_CONNECTIONS)
+	{
+	    g_atomic_int_add(&daemon_num_connections, -1);
+	    refuse_daemon_connection(fd);
+	    continue;
+	}
+
+	/* reads that time out end the connection */
+	timeout.tv_sec = DAEMON_READ_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	connection = g_new(daemon_connection_t, 1);
+	connection->fd = fd;
+	connection->config = config;
+	if (g_thread_create(serve_daemon_connection, connection, FALSE, NULL) == NULL)
+	{
+	    close(fd);
+	    g_free(connection);
+	    g_atomic_int_add(&daemon_num_connections, -1);
+	}
+    }
+}
+#else
+static void
+unref_daemon_image (struct _daemon_image_t *image)
+{
+    g_assert_not_reached();
+}
+#endif
+
+static void
+usage (void)
+{
+    printf("Usage:\n"
+	   "  mathmap --version\n"
+	   "      print out version number\n"
+	   "  mathmap --help\n"
+	   "      print this help text\n"
+	   "  mathmap [option ...] [<script>] <outfile>\n"
+	   "      transform one or more inputs with <script> and write\n"
+	   "      the result to <outfile>\n"
+	   "  mathmap --htmldoc [<script>] <outfile>\n"
+	   "      outputs HTML documentation for the filters in\n"
+	   "      the script to <outfile>\n"
+	   "  mathmap --daemon=SOCKET [option ...]\n"
+	   "      render jobs sent to the UNIX socket SOCKET\n"
+	   "  mathmap --batch=INPUTS [option ...] [<script>] <outfile>\n"
+	   "      transform each of INPUTS, a glob pattern or @FILENAME\n"
+	   "      of a list, and write it to <outfile> with %%s replaced\n"
+	   "      by the input's name, which must be unique without\n"
+	   "      directory and extension\n"
+	   "  mathmap --merge=WIDTHxHEIGHT <outfile> <x>,<y>:<tile> ...\n"
+	   "      put the tiles together into <outfile>\n"
+	   "Options:\n"
+	   "  -f, --script-file=FILENAME  read script from FILENAME\n"
+	   "  -D<name>=<value>            define user value\n"
+#ifdef MOVIES
+	   "  -M, --movie=FILENAME        input movie FILENAME\n"
+#endif
+	   "  -i, --intersampling         use intersampling\n"
+	   "  -o, --oversampling          use oversampling\n"
+	   "  -s, --size=WIDTHxHEIGHT     sets the output image size\n"
+	   "  -c, --cache=NUM             cache NUM input images (default %d)\n"
+	   "  -g, --generator=GEN         generate plug-in code with GEN\n"
+	   "                              (blender, nacl or native)\n"
+	   "      --specialize            compile user values as constants\n"
+	   "      --floatmap-storage=FMT  store intermediate renders as FMT\n"
+	   "                              (float, half or planar)\n"
+	   "      --seed=NUM              seed rand() with NUM (default 0)\n"
+	   "      --precision=MODE        compile math functions as MODE\n"
+	   "                              (precise or fast)\n"
+	   "      --trace=FILENAME        record a timeline of compiling and\n"
+	   "                              rendering in Chrome trace format\n"
+	   "      --pools-statistics      print how much memory the allocation\n"
+	   "                              pools used\n"
+	   "      --profile               count the time spent in each part of the\n"
+	   "                              script and print the hot spots\n"
+	   "      --interpolation=MODE    antialias with MODE (bilinear, bicubic\n"
+	   "                              or lanczos), implies -i\n"
+	   "  -F, --frames=NUM            render NUM frames, into a movie or, if\n"
+	   "                              <outfile> contains %%d, into a sequence\n"
+	   "                              of PNG images\n"
+	   "  -j, --frame-threads=NUM     render NUM frames concurrently\n"
+	   "                              (default: one per CPU)\n"
+	   "      --stream-rows=NUM       render and write a single image NUM rows\n"
+	   "                              at a time to save memory\n"
+	   "      --region=X,Y,W,H        render only the W by H tile at X,Y of\n"
+	   "                              the image\n"
+	   "      --workers=NUM           render the image in NUM processes, each\n"
+	   "                              doing a band of rows\n"
+	   "      --bench-json=FILENAME   write compile and render timings as JSON\n"
+	   "                              to FILENAME\n"
+	   "      --bench-default-image=FILENAME\n"
+	   "                              use FILENAME for undefined input images\n"
+	   "      --bench-perf-counters   count cycles, instructions, cache misses,\n"
+	   "                              branch misses and page faults per render\n"
+	   "                              and per thread\n"
+	   "      --daemon-filter-dir=DIR look up filters by name in DIR (default .)\n"
+	   "      --daemon-filters=NUM    keep NUM compiled filters (default %d)\n"
+	   "      --daemon-image-cache=MB keep up to MB megabytes of decoded input\n"
+	   "                              images (default %d)\n"
+	   "      --daemon-root=DIR       only read scripts and images from and\n"
+	   "                              write output to DIR (default .)\n"
+	   "      --daemon-jobs=NUM       render NUM jobs concurrently (default %d)\n"
+	   "\n"
+	   "Report bugs and suggestions to schani@complang.tuwien.ac.at\n",
+	   cache_size, daemon_max_filters, (int)(daemon_max_image_bytes >> 20), daemon_num_job_threads);
+}
+
+#define OPTION_VERSION				256
 #define OPTION_HELP				257
 #define OPTION_HTMLDOC				258
 #define OPTION_BENCH_NO_OUTPUT			259
@@ -540,16 +3049,37 @@ usage (void)
 #define OPTION_BENCH_NO_COMPILE_TIME_LIMIT	261
 #define OPTION_BENCH_NO_BACKEND			262
 #define OPTION_BENCH_RENDER_COUNT		263
+#define OPTION_SPECIALIZE			264
+#define OPTION_FLOATMAP_STORAGE			265
+#define OPTION_SEED				266
+#define OPTION_PRECISION			267
+#define OPTION_INTERPOLATION			268
+#define OPTION_STREAM_ROWS			269
+#define OPTION_BENCH_JSON			270
+#define OPTION_BENCH_DEFAULT_IMAGE		271
+#define OPTION_PROFILE				272
+#define OPTION_TRACE				273
+#define OPTION_BENCH_PERF_COUNTERS		274
+#define OPTION_POOLS_STATISTICS			275
+#define OPTION_DAEMON				276
+#define OPTION_DAEMON_FILTER_DIR		277
+#define OPTION_DAEMON_FILTERS			278
+#define OPTION_DAEMON_IMAGE_CACHE		279
+#define OPTION_BATCH				280
+#define OPTION_REGION				281
+#define OPTION_MERGE				282
+#define OPTION_WORKERS				283
+#define OPTION_DAEMON_ROOT			284
+#define OPTION_DAEMON_JOBS			285
 
 int
 main (int argc, char *argv[])
 {
-    guchar *output;
     int num_frames = 1;
+    int frame_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int stream_rows = 0;
 #ifdef MOVIES
     int generate_movie = 0;
-    quicktime_t *output_movie;
-    guchar **rows;
 #endif
     int antialiasing = 0, supersampling = 0;
     int img_width, img_height;
@@ -565,6 +3095,29 @@ main (int argc, char *argv[])
     int render_num;
     gboolean bench_no_output = FALSE;
     gboolean bench_no_backend = FALSE;
+    char *bench_json_filename = NULL;
+    char *bench_default_image = NULL;
+    gboolean bench_perf_counters = FALSE;
+    perf_counts_t perf_totals;
+    char *trace_filename = getenv("MATHMAP_TRACE");
+    char *daemon_socket = NULL;
+    char *daemon_filter_dir = ".";
+    char *daemon_root_dir = ".";
+    char *batch_spec = NULL;
+    gboolean region_is_set = FALSE;
+    int region_x = 0, region_y = 0, region_width = 0, region_height = 0;
+    char *merge_size = NULL;
+    int num_workers = 1;
+    render_config_t render_config;
+    double render_start_time;
+    double rendered_pixels = 0.0;
+    compile_timings_t compile_timings;
+    compile_timings_t specialize_timings;
+    gboolean specialize = FALSE;
+    gboolean specialize_compiled = FALSE;
+    int floatmap_layout = FLOATMAP_LAYOUT_INTERLEAVED;
+    guint32 rand_seed = 0;
+    int interpolation = INTERPOLATION_BILINEAR;
     int compile_time_limit = DEFAULT_OPTIMIZATION_TIMEOUT;
 
     init_gettext();
@@ -582,13 +3135,36 @@ main (int argc, char *argv[])
 		{ "size", required_argument, 0, 's' },
 		{ "script-file", required_argument, 0, 'f' },
 		{ "htmldoc", no_argument, 0, OPTION_HTMLDOC },
+		{ "specialize", no_argument, 0, OPTION_SPECIALIZE },
+		{ "floatmap-storage", required_argument, 0, OPTION_FLOATMAP_STORAGE },
+		{ "seed", required_argument, 0, OPTION_SEED },
+		{ "precision", required_argument, 0, OPTION_PRECISION },
+		{ "profile", no_argument, 0, OPTION_PROFILE },
+		{ "pools-statistics", no_argument, 0, OPTION_POOLS_STATISTICS },
+		{ "daemon", required_argument, 0, OPTION_DAEMON },
+		{ "daemon-filter-dir", required_argument, 0, OPTION_DAEMON_FILTER_DIR },
+		{ "daemon-filters", required_argument, 0, OPTION_DAEMON_FILTERS },
+		{ "daemon-image-cache", required_argument, 0, OPTION_DAEMON_IMAGE_CACHE },
+		{ "daemon-root", required_argument, 0, OPTION_DAEMON_ROOT },
+		{ "daemon-jobs", required_argument, 0, OPTION_DAEMON_JOBS },
+		{ "batch", required_argument, 0, OPTION_BATCH },
+		{ "region", required_argument, 0, OPTION_REGION },
+		{ "merge", required_argument, 0, OPTION_MERGE },
+		{ "workers", required_argument, 0, OPTION_WORKERS },
+		{ "trace", required_argument, 0, OPTION_TRACE },
+		{ "interpolation", required_argument, 0, OPTION_INTERPOLATION },
+		{ "stream-rows", required_argument, 0, OPTION_STREAM_ROWS },
 		{ "bench-no-output", no_argument, 0, OPTION_BENCH_NO_OUTPUT },
 		{ "bench-only-compile", no_argument, 0, OPTION_BENCH_ONLY_COMPILE },
 		{ "bench-no-compile-time-limit", no_argument, 0, OPTION_BENCH_NO_COMPILE_TIME_LIMIT },
 		{ "bench-no-backend", no_argument, 0, OPTION_BENCH_NO_BACKEND },
 		{ "bench-render-count", required_argument, 0, OPTION_BENCH_RENDER_COUNT },
-#ifdef MOVIES
+		{ "bench-json", required_argument, 0, OPTION_BENCH_JSON },
+		{ "bench-default-image", required_argument, 0, OPTION_BENCH_DEFAULT_IMAGE },
+		{ "bench-perf-counters", no_argument, 0, OPTION_BENCH_PERF_COUNTERS },
 		{ "frames", required_argument, 0, 'F' },
+		{ "frame-threads", required_argument, 0, 'j' },
+#ifdef MOVIES
 		{ "movie", required_argument, 0, 'M' },
 #endif
 		{ 0, 0, 0, 0 }
@@ -598,9 +3174,9 @@ main (int argc, char *argv[])
 
 	option = getopt_long(argc, argv, 
 #ifdef MOVIES
-			     "f:ioF:D:M:c:g:s:", 
+			     "f:ioF:j:D:M:c:g:s:", 
 #else
-			     "f:ioD:c:g:s:",
+			     "f:ioF:j:D:c:g:s:",
 #endif
 			     long_options, &option_index);
 
@@ -637,6 +3213,67 @@ main (int argc, char *argv[])
 		htmldoc = TRUE;
 		break;
 
+	    case OPTION_SPECIALIZE :
+		specialize = TRUE;
+		break;
+
+	    case OPTION_FLOATMAP_STORAGE :
+		if (strcmp(optarg, "float") == 0)
+		    floatmap_layout = FLOATMAP_LAYOUT_INTERLEAVED;
+		else if (strcmp(optarg, "half") == 0)
+		    floatmap_layout = FLOATMAP_LAYOUT_HALF;
+		else if (strcmp(optarg, "planar") == 0)
+		    floatmap_layout = FLOATMAP_LAYOUT_PLANAR;
+		else
+		{
+		    fprintf(stderr, _("Error: Unknown floatmap storage `%s'.  Use float, half or planar.\n"), optarg);
+		    return 1;
+		}
+		break;
+
+	    case OPTION_SEED :
+		rand_seed = strtoul(optarg, NULL, 0);
+		break;
+
+	    case OPTION_TRACE :
+		trace_filename = optarg;
+		break;
+
+	    case OPTION_PROFILE :
+		set_compile_profiling(TRUE);
+		break;
+
+	    case OPTION_POOLS_STATISTICS :
+		set_pools_statistics(TRUE);
+		break;
+
+	    case OPTION_PRECISION :
+		if (strcmp(optarg, "precise") == 0)
+		    set_compile_precision(MATHMAP_PRECISION_PRECISE);
+		else if (strcmp(optarg, "fast") == 0)
+		    set_compile_precision(MATHMAP_PRECISION_FAST);
+		else
+		{
+		    fprintf(stderr, _("Error: Unknown precision `%s'.  Use precise or fast.\n"), optarg);
+		    return 1;
+		}
+		break;
+
+	    case OPTION_INTERPOLATION :
+		if (strcmp(optarg, "bilinear") == 0)
+		    interpolation = INTERPOLATION_BILINEAR;
+		else if (strcmp(optarg, "bicubic") == 0)
+		    interpolation = INTERPOLATION_BICUBIC;
+		else if (strcmp(optarg, "lanczos") == 0)
+		    interpolation = INTERPOLATION_LANCZOS;
+		else
+		{
+		    fprintf(stderr, _("Error: Unknown interpolation `%s'.  Use bilinear, bicubic or lanczos.\n"), optarg);
+		    return 1;
+		}
+		antialiasing = 1;
+		break;
+
 	    case 'f' :
 		if (!g_file_get_contents(optarg, &script, NULL, NULL))
 		{
@@ -663,7 +3300,8 @@ main (int argc, char *argv[])
 		break;
 
 	    case 'I' :
-		alloc_cmdline_image_input_drawable(optarg);
+		if (alloc_cmdline_image_input_drawable(optarg) == NULL)
+		    return 1;
 		break;
 
 	    case 'g' :
@@ -699,13 +3337,106 @@ main (int argc, char *argv[])
 		bench_no_backend = TRUE;
 		break;
 
-#ifdef MOVIES
+	    case OPTION_BENCH_JSON :
+		bench_json_filename = optarg;
+		break;
+
+	    case OPTION_BENCH_DEFAULT_IMAGE :
+		bench_default_image = optarg;
+		break;
+
+	    case OPTION_BENCH_PERF_COUNTERS :
+		bench_perf_counters = TRUE;
+		break;
+
 	    case 'F' :
-		generate_movie = 1;
 		num_frames = atoi(optarg);
-		assert(num_frames > 0);
+		if (num_frames <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of frames must be positive.\n"));
+		    return 1;
+		}
+		break;
+
+	    case OPTION_STREAM_ROWS :
+		stream_rows = atoi(optarg);
+		if (stream_rows <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of rows to stream must be positive.\n"));
+		    return 1;
+		}
+		break;
+
+	    case OPTION_DAEMON :
+		daemon_socket = optarg;
+		break;
+
+	    case OPTION_DAEMON_FILTER_DIR :
+		daemon_filter_dir = optarg;
+		break;
+
+	    case OPTION_DAEMON_FILTERS :
+		daemon_max_filters = atoi(optarg);
+		if (daemon_max_filters <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of cached filters must be positive.\n"));
+		    return 1;
+		}
+		break;
+
+	    case OPTION_DAEMON_IMAGE_CACHE :
+		daemon_max_image_bytes = (size_t)MAX(atoi(optarg), 0) << 20;
+		break;
+
+	    case OPTION_DAEMON_ROOT :
+		daemon_root_dir = optarg;
 		break;
 
+	    case OPTION_DAEMON_JOBS :
+		daemon_num_job_threads = atoi(optarg);
+		if (daemon_num_job_threads <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of daemon jobs must be positive.\n"));
+		    return 1;
+		}
+		break;
+
+	    case OPTION_BATCH :
+		batch_spec = optarg;
+		break;
+
+	    case OPTION_REGION :
+		if (!parse_region(optarg, &region_x, &region_y, &region_width, &region_height))
+		{
+		    fprintf(stderr, _("Error: Invalid region.  Syntax is <x>,<y>,<width>,<height>.  Example: 0,0,512,512.\n"));
+		    return 1;
+		}
+		region_is_set = TRUE;
+		break;
+
+	    case OPTION_MERGE :
+		merge_size = optarg;
+		break;
+
+	    case OPTION_WORKERS :
+		num_workers = atoi(optarg);
+		if (num_workers <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of workers must be positive.\n"));
+		    return 1;
+		}
+		break;
+
+	    case 'j' :
+		frame_threads = atoi(optarg);
+		if (frame_threads <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of frame threads must be positive.\n"));
+		    return 1;
+		}
+		break;
+
+#ifdef MOVIES
 	    case 'M' :
 		alloc_cmdline_movie_input_drawable(optarg);
 		break;
@@ -713,6 +3444,87 @@ main (int argc, char *argv[])
 	}
     }
 
+    render_config.num_threads = frame_threads;
+    render_config.antialiasing = antialiasing;
+    render_config.supersampling = supersampling;
+    render_config.interpolation = interpolation;
+    render_config.floatmap_layout = floatmap_layout;
+    render_config.rand_seed = rand_seed;
+    render_config.compile_time_limit = compile_time_limit;
+
+#ifndef __MINGW32__
+    if (daemon_socket != NULL)
+    {
+	daemon_config_t config;
+
+	if (script != NULL || argc != optind)
+	{
+	    usage();
+	    return 1;
+	}
+
+	if (trace_filename != NULL && !mathmap_trace_open(trace_filename))
+	{
+	    fprintf(stderr, _("Error: Cannot open file `%s' for writing: %s\n"), trace_filename, strerror(errno));
+	    return 1;
+	}
+
+	init_tags();
+	init_builtins();
+	init_macros();
+	init_compiler();
+
+	config.filter_dir = daemon_filter_dir;
+	config.root_dir = realpath(daemon_root_dir, NULL);
+	if (config.root_dir == NULL)
+	{
+	    fprintf(stderr, _("Error: Cannot resolve the root directory `%s': %s\n"),
+		    daemon_root_dir, strerror(errno));
+	    return 1;
+	}
+	config.render = render_config;
+
+	return run_daemon(daemon_socket, &config);
+    }
+#endif
+
+    if (merge_size != NULL)
+    {
+	merge_tile_t *tiles;
+	int num_tiles = argc - optind - 1;
+	char *message;
+	int i;
+
+	if (num_tiles < 1)
+	{
+	    usage();
+	    return 1;
+	}
+
+	if (!parse_image_size(merge_size, &img_width, &img_height))
+	{
+	    fprintf(stderr, _("Error: Invalid image size.  Syntax is <width>x<height>.  Example: 1024x768.\n"));
+	    return 1;
+	}
+
+	tiles = g_new0(merge_tile_t, num_tiles);
+	for (i = 0; i < num_tiles; ++i)
+	    if (!parse_merge_tile(argv[optind + 1 + i], &tiles[i]))
+	    {
+		fprintf(stderr, _("Error: Invalid tile `%s'.  Syntax is <x>,<y>:<filename>.\n"), argv[optind + 1 + i]);
+		return 1;
+	    }
+
+	message = merge_tiles(tiles, num_tiles, img_width, img_height, argv[optind]);
+	if (message != NULL)
+	{
+	    fprintf(stderr, _("Error: %s\n"), message);
+	    return 1;
+	}
+
+	return 0;
+    }
+
     if (script != NULL)
     {
 	if (argc - optind != 1)
@@ -735,6 +3547,49 @@ main (int argc, char *argv[])
 	output_filename = argv[optind + 1];
     }
 
+    if (stream_rows > 0 && num_frames > 1)
+    {
+	fprintf(stderr, _("Error: Only single images can be streamed.\n"));
+	return 1;
+    }
+
+    if (batch_spec != NULL)
+    {
+	if (num_frames > 1 || stream_rows > 0)
+	{
+	    fprintf(stderr, _("Error: Batch mode renders single images without streaming.\n"));
+	    return 1;
+	}
+
+	if (!is_batch_output_pattern(output_filename))
+	{
+	    fprintf(stderr, _("Error: In batch mode, <outfile> must contain %%s.\n"));
+	    return 1;
+	}
+    }
+
+    if ((region_is_set || num_workers > 1) && (num_frames > 1 || stream_rows > 0 || batch_spec != NULL))
+    {
+	fprintf(stderr, _("Error: Only single images can be rendered in tiles.\n"));
+	return 1;
+    }
+
+#ifdef MOVIES
+    generate_movie = num_frames > 1 && !is_frame_sequence_pattern(output_filename);
+#else
+    if (num_frames > 1 && !is_frame_sequence_pattern(output_filename))
+    {
+	fprintf(stderr, _("Error: To render more than one frame, <outfile> must contain %%d.\n"));
+	return 1;
+    }
+#endif
+
+    if (trace_filename != NULL && !mathmap_trace_open(trace_filename))
+    {
+	fprintf(stderr, _("Error: Cannot open file `%s' for writing: %s\n"), trace_filename, strerror(errno));
+	return 1;
+    }
+
     init_tags();
     init_builtins();
     init_macros();
@@ -776,7 +3631,7 @@ main (int argc, char *argv[])
 	char *support_paths[4];
 	mathmap_t *mathmap;
 	mathmap_invocation_t *invocation;
-	int current_frame;
+	frame_writer_t writer;
 	int i = 0;
 
 	/*
@@ -787,6 +3642,7 @@ main (int argc, char *argv[])
 	support_paths[i] = NULL;
 
 	mathmap = compile_mathmap(script, support_paths, compile_time_limit, bench_no_backend);
+	compile_timings = last_compile_timings;
 
 	if (bench_no_backend)
 	    return 0;
@@ -797,8 +3653,83 @@ main (int argc, char *argv[])
 	    exit(1);
 	}
 
+	if (batch_spec != NULL)
+	{
+	    batch_t batch;
+	    char *message = expand_batch_inputs(batch_spec, &batch.inputs);
+	    int num_failed;
+
+	    if (message == NULL)
+		message = check_batch_output_filenames(output_filename, batch.inputs);
+	    if (message != NULL)
+	    {
+		fprintf(stderr, _("Error: %s\n"), message);
+		return 1;
+	    }
+
+	    batch.batch_userval = NULL;
+	    for (userval_info = mathmap->main_filter->userval_infos;
+		 userval_info != NULL;
+		 userval_info = userval_info->next)
+		if (userval_info->type == USERVAL_IMAGE && lookup_define(defines, userval_info->name) == NULL)
+		{
+		    batch.batch_userval = userval_info;
+		    break;
+		}
+
+	    if (batch.batch_userval == NULL)
+	    {
+		fprintf(stderr, _("Error: The filter has no undefined input image for the batch inputs.\n"));
+		return 1;
+	    }
+
+	    batch.num_inputs = g_strv_length(batch.inputs);
+	    batch.output_pattern = output_filename;
+	    batch.mathmap = mathmap;
+	    batch.defines = defines;
+	    batch.config = &render_config;
+	    if (size_is_set)
+	    {
+		batch.img_width = input_min_width = img_width;
+		batch.img_height = input_min_height = img_height;
+	    }
+	    else
+		batch.img_width = batch.img_height = 0;
+
+	    num_failed = run_batch(&batch);
+	    g_strfreev(batch.inputs);
+
+	    return num_failed > 0 ? 1 : 0;
+	}
+
 	if (bench_render_count == 0)
+	{
+	    if (bench_json_filename != NULL
+		&& !write_bench_json(bench_json_filename, 0, 0, 0, 0, 0.0, 0.0, &compile_timings, NULL, NULL))
+		return 1;
 	    return 0;
+	}
+
+	if (bench_default_image != NULL)
+	    for (userval_info = mathmap->main_filter->userval_infos;
+		 userval_info != NULL;
+		 userval_info = userval_info->next)
+		if (userval_info->type == USERVAL_IMAGE && lookup_define(defines, userval_info->name) == NULL)
+		{
+		    char *str = g_strdup_printf("%s=%s", userval_info->name, bench_default_image);
+
+		    append_define(str, &defines);
+		    g_free(str);
+		}
+
+	/* Input images are addressed in normalized coordinates, so
+	   they only need as many pixels as the canvas has.  If the
+	   canvas size comes from the first input, it's full size. */
+	if (size_is_set)
+	{
+	    input_min_width = img_width;
+	    input_min_height = img_height;
+	}
 
 	if (!size_is_set)
 	    for (userval_info = mathmap->main_filter->userval_infos;
@@ -806,7 +3737,6 @@ main (int argc, char *argv[])
 		 userval_info = userval_info->next)
 	    {
 		define_t *define;
-		unsigned char *image;
 
 		if (userval_info->type != USERVAL_IMAGE)
 		    continue;
@@ -818,13 +3748,11 @@ main (int argc, char *argv[])
 		    return 1;
 		}
 
-		image = read_image(define->value, &img_width, &img_height);
-		if (image == NULL)
+		if (!probe_image_size(define->value, &img_width, &img_height))
 		{
 		    fprintf(stderr, _("Error: Could not read input image `%s'.\n"), define->value);
 		    return 1;
 		}
-		free(image);
 
 		size_is_set = TRUE;
 
@@ -837,52 +3765,100 @@ main (int argc, char *argv[])
 	    exit(1);
 	}
 
+	if (region_is_set
+	    && (region_x + region_width > img_width || region_y + region_height > img_height))
+	{
+	    fprintf(stderr, _("Error: The region doesn't fit into the %dx%d image.\n"), img_width, img_height);
+	    return 1;
+	}
+
+#ifndef __MINGW32__
+	/* workers are started with --region, so they render themselves */
+	if (num_workers > 1 && !region_is_set)
+	{
+	    char *message = run_tile_workers(argc, argv, optind, img_width, img_height,
+					     num_workers, frame_threads);
+
+	    if (message != NULL)
+	    {
+		fprintf(stderr, _("Error: %s\n"), message);
+		return 1;
+	    }
+
+	    return 0;
+	}
+#endif
+
 	invocation = invoke_mathmap(mathmap, NULL, img_width, img_height, TRUE);
 
-	for (userval_info = mathmap->main_filter->userval_infos;
-	     userval_info != NULL;
-	     userval_info = userval_info->next)
 	{
-	    userval_t *userval = &invocation->uservals[userval_info->index];
-	    define_t *define = lookup_define(defines, userval_info->name);
+	    const char **filenames = g_new(const char*, mathmap->main_filter->num_uservals);
+	    int num_filenames = 0;
 
-	    if (define == NULL)
+	    for (userval_info = mathmap->main_filter->userval_infos;
+		 userval_info != NULL;
+		 userval_info = userval_info->next)
 	    {
-		if (userval_info->type == USERVAL_IMAGE)
-		{
-		    fprintf(stderr, _("Error: No value defined for input image `%s'.\n"), userval_info->name);
-		    return 1;
-		}
+		define_t *define = lookup_define(defines, userval_info->name);
+
+		if (userval_info->type == USERVAL_IMAGE && define != NULL)
+		    filenames[num_filenames++] = define->value;
 	    }
-	    else
-		switch (userval_info->type)
-		{
-		    case USERVAL_INT_CONST :
-			userval->v.int_const = atoi(define->value);
-			break;
 
-		    case USERVAL_FLOAT_CONST :
-			userval->v.float_const = g_ascii_strtod(define->value, NULL);
-			break;
+	    if (num_filenames > 0)
+		preload_input_images(filenames, num_filenames, frame_threads);
 
-		    case USERVAL_BOOL_CONST :
-			userval->v.bool_const = (float)atoi(define->value);
-			break;
+	    g_free(filenames);
+	}
 
-		    case USERVAL_IMAGE :
-			assign_image_userval_drawable(userval_info, userval,
-						      alloc_cmdline_image_input_drawable(define->value));
-			++num_input_drawables;
-			break;
+	{
+	    char *message = set_uservals_from_defines(invocation, defines, &num_input_drawables);
 
-		    default :
-			fprintf(stderr, _("Error: Can only define user values for types int, float, bool and image.\n"));
-			return 1;
-		}
+	    if (message != NULL)
+	    {
+		fprintf(stderr, _("Error: %s\n"), message);
+		return 1;
+	    }
+	}
+
+	free_preloaded_images();
+
+	if (specialize)
+	{
+	    mathmap_t *specialized = specialize_mathmap(mathmap, script, invocation->uservals,
+							support_paths, compile_time_limit);
+
+	    if (specialized != mathmap)
+	    {
+		mathmap_invocation_t *specialized_invocation;
+
+		specialize_timings = last_compile_timings;
+		specialize_compiled = TRUE;
+
+		specialized_invocation = invoke_mathmap(specialized, invocation, img_width, img_height, TRUE);
+
+		free_invocation(invocation);
+		invocation = specialized_invocation;
+	    }
+	}
+
+	if (invocation->mathmap->profile_regions != NULL)
+	    mathmap_profile_start(invocation->mathmap);
+
+	if (bench_perf_counters)
+	{
+	    memset(&perf_totals, 0, sizeof(perf_totals));
+	    perf_counters_enable_per_thread(frame_threads);
 	}
 
+	render_start_time = mathmap_wall_time();
+
 	for (render_num = 0; render_num < bench_render_count; ++render_num)
 	{
+	    perf_counter_group_t render_counters;
+	    gboolean counting_events = FALSE;
+	    double num_pixels;
+
 #ifdef MOVIES
 	    for (i = 0; i < num_input_drawables; ++i)
 		if (input_drawables[i].type == DRAWABLE_MOVIE)
@@ -892,68 +3868,144 @@ main (int argc, char *argv[])
 		}
 #endif
 
-	    invocation_set_antialiasing(invocation, antialiasing);
+	    invocation_set_interpolation(invocation, antialiasing ? interpolation : INTERPOLATION_NEAREST);
 	    invocation->supersampling = supersampling;
 
 	    invocation->output_bpp = 4;
+	    invocation->floatmap_layout = floatmap_layout;
+	    invocation->rand_seed = rand_seed;
 
-	    output = (guchar*)malloc((long)invocation->output_bpp * (long)img_width * (long)img_height);
-	    assert(output != 0);
+	    if (bench_perf_counters)
+	    {
+		/* inherit, so the render threads are counted, too */
+		counting_events = perf_counters_open(&render_counters, TRUE);
+		if (!counting_events)
+		{
+		    fprintf(stderr, _("Warning: Cannot open performance counters - rendering without them.\n"));
+		    bench_perf_counters = FALSE;
+		    perf_counters_enable_per_thread(0);
+		}
+	    }
 
-#ifdef MOVIES
-	    if (generate_movie)
+	    if (region_is_set)
 	    {
-		output_movie = quicktime_open(output_filename, 0, 1);
-		assert(output_movie != 0);
+		guchar *output = g_malloc((size_t)invocation->row_stride * region_height);
 
-		quicktime_set_video(output_movie, 1, img_width, img_height, 25, QUICKTIME_JPEG);
-		assert(quicktime_supported_video(output_movie, 0));
-		quicktime_seek_start(output_movie);
+		render_frame_region(invocation, 0, 1, region_x, region_y, region_width, region_height,
+				    output, frame_threads);
+		num_pixels = (double)region_width * region_height;
 
-		rows = (guchar**)malloc(sizeof(guchar*) * img_height);
-		for (i = 0; i < img_height; ++i)
-		    rows[i] = output + img_width * invocation->output_bpp * i;
-	    }
-#endif
+		if (!bench_no_output)
+		{
+		    double trace_start = mathmap_trace_begin();
 
-	    for (current_frame = 0; current_frame < num_frames; ++current_frame)
-	    {
-		float current_t = (float)current_frame / (float)num_frames;
-		image_t *closure = closure_image_alloc(&invocation->mathfuncs,
-						       NULL,
-						       invocation->mathmap->main_filter->num_uservals,
-						       invocation->uservals,
-						       img_width, img_height);
-		mathmap_frame_t *frame = invocation_new_frame(invocation, closure,
-							      current_frame, current_t);
+		    write_image(output_filename, region_width, region_height, output,
+				invocation->output_bpp, invocation->row_stride, IMAGE_FORMAT_PNG);
 
-		call_invocation_parallel_and_join(frame, closure, 0, 0, img_width, img_height, output, 1);
+		    mathmap_trace_end("encode image", "io", trace_start);
+		}
 
-		invocation_free_frame(frame);
+		g_free(output);
+	    }
+	    else if (stream_rows > 0 && !bench_no_output)
+	    {
+		/* with only one frame, the frame threads render rows */
+		if (!render_frame_streaming(invocation, img_width, img_height, stream_rows,
+					    frame_threads, output_filename))
+		{
+		    fprintf(stderr, _("Error: Cannot write output image `%s'.\n"), output_filename);
+		    return 1;
+		}
+		num_pixels = (double)img_width * img_height;
+	    }
+	    else
+	    {
+		writer.img_width = img_width;
+		writer.img_height = img_height;
+		writer.bpp = invocation->output_bpp;
+		writer.num_frames = num_frames;
+		writer.filename = output_filename;
+		writer.is_sequence = is_frame_sequence_pattern(output_filename);
 
 #ifdef MOVIES
+		writer.movie = NULL;
 		if (generate_movie && !bench_no_output)
 		{
-		    fprintf(stderr, _("writing frame %d\n"), current_frame);
-		    assert(quicktime_encode_video(output_movie, rows, 0) == 0);
+		    writer.movie = quicktime_open(output_filename, 0, 1);
+		    assert(writer.movie != 0);
+
+		    quicktime_set_video(writer.movie, 1, img_width, img_height, 25, QUICKTIME_JPEG);
+		    assert(quicktime_supported_video(writer.movie, 0));
+		    quicktime_seek_start(writer.movie);
+
+		    writer.rows = (guchar**)malloc(sizeof(guchar*) * img_height);
 		}
 #endif
 
-		closure_image_free(closure);
-	    }
+		num_pixels = (double)img_width * img_height
+		    * render_frames(invocation, num_frames, img_width, img_height, frame_threads,
+				    bench_no_output ? discard_frame : write_frame, &writer);
 
-	    if (!bench_no_output)
-	    {
 #ifdef MOVIES
-		if (generate_movie)
-		    quicktime_close(output_movie);
-		else
+		if (writer.movie != NULL)
+		{
+		    quicktime_close(writer.movie);
+		    free(writer.rows);
+		}
 #endif
-		    write_image(output_filename, img_width, img_height, output,
-				invocation->output_bpp, img_width * invocation->output_bpp, IMAGE_FORMAT_PNG);
 	    }
 
-	    free(output);
+	    if (counting_events)
+	    {
+		perf_counts_t counts;
+		char *label = g_strdup_printf("render %d", render_num);
+
+		perf_counters_read(&render_counters, &counts);
+		perf_counters_close(&render_counters);
+		perf_counts_add(&perf_totals, &counts);
+		print_perf_counts(stdout, label, &counts, num_pixels);
+		g_free(label);
+	    }
+
+	    rendered_pixels += num_pixels;
+	}
+
+	if (bench_json_filename != NULL
+	    && !write_bench_json(bench_json_filename, img_width, img_height, num_frames, bench_render_count,
+				 rendered_pixels, mathmap_wall_time() - render_start_time,
+				 &compile_timings, specialize_compiled ? &specialize_timings : NULL,
+				 bench_perf_counters ? &perf_totals : NULL))
+	    return 1;
+
+	if (bench_perf_counters)
+	{
+	    int kind;
+
+	    print_perf_counts(stdout, "total", &perf_totals, rendered_pixels);
+	    for (kind = 0; kind < NUM_PERF_THREAD_KINDS; ++kind)
+	    {
+		perf_counts_t *thread_counts;
+		int num_thread_counts = perf_counters_get_per_thread(kind, &thread_counts);
+
+		for (i = 0; i < num_thread_counts; ++i)
+		    if (thread_counts[i].valid[PERF_COUNTER_CYCLES] || thread_counts[i].valid[PERF_COUNTER_PAGE_FAULTS])
+		    {
+			char *label = g_strdup_printf("%s thread %d", perf_thread_kind_names[kind], i);
+
+			print_perf_counts(stdout, label, &thread_counts[i], 0.0);
+			g_free(label);
+		    }
+	    }
+	}
+
+	if (invocation->mathmap->profile_regions != NULL)
+	    mathmap_profile_print_hot_spots(invocation->mathmap, script, stdout, 20);
+
+	if (get_pools_statistics())
+	{
+	    /* the invocation's pools are only counted when it's freed */
+	    free_invocation(invocation);
+	    mathmap_pools_print_statistics(stdout);
 	}
     }
     else
@@ -968,6 +4020,11 @@ main (int argc, char *argv[])
 	    if (!nacl_generate_plug_in (script, output_filename))
 		return 1;
 	}
+	else if (strcmp(generator, "native") == 0)
+	{
+	    if (!native_generate_plug_in(script, output_filename))
+		return 1;
+	}
 	else
 	{
 	    fprintf(stderr, _("Unknown generator `%s'\n"), generator);
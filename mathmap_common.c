@@ -36,9 +36,16 @@
 #ifdef __MINGW32__
 #include <windows.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #include <glib.h>
 #include <glib/gstdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "internals.h"
 #include "tags.h"
@@ -48,11 +55,17 @@
 #include "mathmap.h"
 #include "compiler-internals.h"
 #include "native-filters/native-filters.h"
+#include "lispreader/pools.h"
 
 int cmd_line_mode = 0;
 
 mathmap_t *the_mathmap = 0;
 
+compile_timings_t last_compile_timings;
+
+/* The standalone renderers generated with `-g native' only link the
+   runtime, not the parser and compiler. */
+#ifndef MATHMAP_STANDALONE
 /* from parser.y */
 int yyparse (void);
 
@@ -293,12 +306,30 @@ unload_mathmap (mathmap_t *mathmap)
 void
 free_mathmap (mathmap_t *mathmap)
 {
+    while (mathmap->specializations != NULL)
+    {
+	mathmap_t *next = mathmap->specializations->next;
+
+	free_mathmap(mathmap->specializations);
+	mathmap->specializations = next;
+    }
+
     if (mathmap->filters != 0)
 	free_filters(mathmap->filters);
     unload_mathmap(mathmap);
 
+    if (mathmap->constant_uservals != NULL)
+	free(mathmap->constant_uservals);
+
+    if (mathmap->profile_regions != NULL)
+    {
+	g_free(mathmap->profile_regions->regions);
+	g_free(mathmap->profile_regions);
+    }
+
     free(mathmap);
 }
+#endif
 
 void
 free_invocation (mathmap_invocation_t *invocation)
@@ -311,13 +342,17 @@ free_invocation (mathmap_invocation_t *invocation)
 
     free(invocation->rows_finished);
 
+    free_invocation_lazy_renders(invocation);
+
     g_mutex_free(invocation->native_filter_cache_mutex);
     g_cond_free(invocation->native_filter_cache_cond);
+    mathmap_pools_stats_unregister(&invocation->pools);
     mathmap_pools_free(&invocation->pools);
 
     free(invocation);
 }
 
+#ifndef MATHMAP_STANDALONE
 static filter_t*
 register_native_filter (mathmap_t *mathmap, const char *name, userval_info_t *userval_infos,
 			gboolean needs_rendered_images, gboolean is_pure,
@@ -413,6 +448,7 @@ parse_mathmap (char *expression)
 {
     static mathmap_t *mathmap;	/* this is static to avoid problems with longjmp.  */
     volatile gboolean need_end_scan = FALSE;
+    double trace_start = mathmap_trace_begin();
 
     mathmap = g_new0(mathmap_t, 1);
 
@@ -483,6 +519,8 @@ parse_mathmap (char *expression)
 
     the_mathmap = 0;
 
+    mathmap_trace_end("parse_mathmap", "compile", trace_start);
+
     return mathmap;
 }
 
@@ -500,8 +538,113 @@ check_mathmap (char *expression)
 	return 0;
 }
 
-mathmap_t*
-compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend)
+static gboolean
+is_specializable_userval_type (int type)
+{
+    return type == USERVAL_INT_CONST || type == USERVAL_FLOAT_CONST || type == USERVAL_BOOL_CONST;
+}
+
+/* Copies only the scalar uservals, which are the ones the compiler
+   can treat as constants.  All other entries are zeroed. */
+static userval_t*
+copy_constant_uservals (userval_info_t *infos, int num_uservals, userval_t *uservals)
+{
+    userval_t *copy = (userval_t*)malloc(sizeof(userval_t) * MAX(num_uservals, 1));
+    userval_info_t *info;
+
+    g_assert(copy != NULL);
+    memset(copy, 0, sizeof(userval_t) * MAX(num_uservals, 1));
+
+    for (info = infos; info != NULL; info = info->next)
+	if (is_specializable_userval_type(info->type))
+	    copy[info->index] = uservals[info->index];
+
+    return copy;
+}
+
+static gboolean
+constant_uservals_equal (userval_info_t *infos, userval_t *a, userval_t *b)
+{
+    userval_info_t *info;
+
+    for (info = infos; info != NULL; info = info->next)
+    {
+	userval_t *ua = &a[info->index];
+	userval_t *ub = &b[info->index];
+
+	switch (info->type)
+	{
+	    case USERVAL_INT_CONST :
+		if (ua->v.int_const != ub->v.int_const)
+		    return FALSE;
+		break;
+
+	    case USERVAL_FLOAT_CONST :
+		if (ua->v.float_const != ub->v.float_const)
+		    return FALSE;
+		break;
+
+	    case USERVAL_BOOL_CONST :
+		if (ua->v.bool_const != ub->v.bool_const)
+		    return FALSE;
+		break;
+
+	    default :
+		break;
+	}
+    }
+
+    return TRUE;
+}
+#endif
+
+double
+mathmap_wall_time (void)
+{
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+#ifndef MATHMAP_STANDALONE
+/* The precision mode new mathmaps are compiled with.  Specialized
+   versions always use the mode of the mathmap they specialize. */
+static int compile_precision = MATHMAP_PRECISION_PRECISE;
+
+void
+set_compile_precision (int precision)
+{
+    g_assert(precision == MATHMAP_PRECISION_PRECISE || precision == MATHMAP_PRECISION_FAST);
+
+    compile_precision = precision;
+}
+
+int
+get_compile_precision (void)
+{
+    return compile_precision;
+}
+
+/* If set, new mathmaps are compiled with profiling counters. */
+static gboolean compile_profiling = FALSE;
+
+void
+set_compile_profiling (gboolean profiling)
+{
+    compile_profiling = profiling;
+}
+
+gboolean
+get_compile_profiling (void)
+{
+    return compile_profiling;
+}
+
+static mathmap_t*
+compile_mathmap_with_constants (char *expression, char **support_paths, int timeout, gboolean no_backend,
+				 mathmap_t *template_mathmap, userval_t *constant_uservals)
 {
     volatile mathmap_t *mathmap = NULL;
     char *template_filename, *include_path;
@@ -530,17 +673,37 @@ compile_mathmap (char *expression, char **support_paths, int timeout, gboolean n
     }
     include_path = support_paths[i];
 
+    memset(&last_compile_timings, 0, sizeof(compile_timings_t));
+
     DO_JUMP_CODE {
 	filter_code_t **filter_codes;
+	double start_time;
 
+	start_time = mathmap_wall_time();
 	mathmap = parse_mathmap(expression);
+	last_compile_timings.parse = mathmap_wall_time() - start_time;
 
 	if (mathmap == 0)
 	{
 	    JUMP(1);
 	}
 
+	mathmap->precision = template_mathmap != NULL ? template_mathmap->precision : compile_precision;
+
+	if (constant_uservals != NULL)
+	{
+	    filter_t *main_filter = template_mathmap->main_filter;
+
+	    g_assert(mathmap->main_filter->num_uservals == main_filter->num_uservals);
+
+	    mathmap->constant_uservals = copy_constant_uservals(main_filter->userval_infos,
+								main_filter->num_uservals,
+								constant_uservals);
+	}
+
+	start_time = mathmap_wall_time();
 	filter_codes = compiler_compile_filters((mathmap_t*)mathmap, timeout);
+	last_compile_timings.optimize = mathmap_wall_time() - start_time;
 
 	if (no_backend)
 	{
@@ -581,6 +744,74 @@ compile_mathmap (char *expression, char **support_paths, int timeout, gboolean n
     return (mathmap_t*)mathmap;
 }
 
+mathmap_t*
+compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend)
+{
+    return compile_mathmap_with_constants(expression, support_paths, timeout, no_backend, NULL, NULL);
+}
+
+/* how many specialized versions of a mathmap are kept */
+#define MAX_SPECIALIZATIONS	8
+
+/* Returns a version of MATHMAP, which must have been compiled from
+   EXPRESSION, in which the scalar uservals of the main filter are
+   compile-time constants with the values in USERVALS.  Specialized
+   versions are cached in MATHMAP and freed together with it.  Only the
+   MAX_SPECIALIZATIONS most recently used ones are kept, so a
+   specialized version must not be used anymore after the next call.
+   If the specialized compile fails, returns MATHMAP itself. */
+mathmap_t*
+specialize_mathmap (mathmap_t *mathmap, char *expression, userval_t *uservals,
+		    char **support_paths, int timeout)
+{
+    userval_info_t *infos = mathmap->main_filter->userval_infos;
+    userval_info_t *info;
+    mathmap_t *specialized, **link;
+    int num_kept;
+
+    g_assert(mathmap->constant_uservals == NULL);
+
+    for (info = infos; info != NULL; info = info->next)
+	if (is_specializable_userval_type(info->type))
+	    break;
+    if (info == NULL)
+	return mathmap;
+
+    /* the list is kept in the order of the most recent use */
+    for (link = &mathmap->specializations; *link != NULL; link = &(*link)->next)
+	if (constant_uservals_equal(infos, (*link)->constant_uservals, uservals))
+	{
+	    specialized = *link;
+	    *link = specialized->next;
+	    specialized->next = mathmap->specializations;
+	    mathmap->specializations = specialized;
+	    return specialized;
+	}
+
+    specialized = compile_mathmap_with_constants(expression, support_paths, timeout, FALSE, mathmap, uservals);
+    if (specialized == NULL)
+	return mathmap;
+
+    specialized->next = mathmap->specializations;
+    mathmap->specializations = specialized;
+
+    num_kept = 0;
+    for (link = &mathmap->specializations; *link != NULL; )
+	if (++num_kept > MAX_SPECIALIZATIONS)
+	{
+	    mathmap_t *evicted = *link;
+
+	    *link = evicted->next;
+	    evicted->next = NULL;
+	    free_mathmap(evicted);
+	}
+	else
+	    link = &(*link)->next;
+
+    return specialized;
+}
+#endif
+
 void
 llvm_filter_init_frame (mathmap_frame_t *mmframe, image_t *closure)
 {
@@ -605,7 +836,7 @@ llvm_filter_init_slice (mathmap_slice_t *slice, image_t *closure)
     printf("initing slice %p (pools %p)\n", slice, pools);
 #endif
 
-    slice->y_vars = mathmap_pools_alloc(pools, sizeof(void*) * slice->region_width);
+    slice->y_vars = mathmap_pools_alloc_accounted(pools, sizeof(void*) * slice->region_width);
 
     for (col = 0; col < slice->region_width; ++col)
     {
@@ -635,6 +866,7 @@ llvm_filter_calc_lines (mathmap_slice_t *slice, image_t *closure, int first_row,
     int frame_render_height = mmframe->frame_render_height;
 
     mathmap_pools_init_local(&pixel_pools);
+    mathmap_pools_stats_register(&pixel_pools, POOLS_ROLE_PIXEL);
     pools = &pixel_pools;
 
 #ifdef POOLS_DEBUG_OUTPUT
@@ -663,6 +895,8 @@ llvm_filter_calc_lines (mathmap_slice_t *slice, image_t *closure, int first_row,
 	    float *return_tuple;
 
 	    mathmap_pools_reset(pools);
+	    mathmap_pools_stats_reset(pools);
+	    mathmap_rand_begin();
 
 #ifdef POOLS_DEBUG_OUTPUT
 	    printf("calcing row %d col %d\n", row, col);
@@ -705,9 +939,10 @@ llvm_filter_calc_lines (mathmap_slice_t *slice, image_t *closure, int first_row,
 	    q = (unsigned char*)q + invocation->row_stride;
 
 	if (!invocation->supersampling)
-	    invocation->rows_finished[row] = 1;
+	    invocation->rows_finished[row + slice->region_y] = 1;
     }
 
+    mathmap_pools_stats_unregister(&pixel_pools);
     mathmap_pools_free(&pixel_pools);
 }
 
@@ -733,14 +968,26 @@ init_invocation (mathmap_invocation_t *invocation)
     }
 }
 
+static void init_interpolation_weights (void);
+
 void
 invocation_set_antialiasing (mathmap_invocation_t *invocation, gboolean antialiasing)
 {
-    invocation->antialiasing = antialiasing;
-    if (antialiasing)
-	invocation->orig_val_func = get_orig_val_intersample_pixel;
-    else
+    invocation_set_interpolation(invocation, antialiasing ? INTERPOLATION_BILINEAR : INTERPOLATION_NEAREST);
+}
+
+void
+invocation_set_interpolation (mathmap_invocation_t *invocation, int interpolation)
+{
+    invocation->interpolation = interpolation;
+    invocation->antialiasing = interpolation != INTERPOLATION_NEAREST;
+    if (interpolation == INTERPOLATION_NEAREST)
 	invocation->orig_val_func = get_orig_val_pixel;
+    else
+    {
+	init_interpolation_weights();
+	invocation->orig_val_func = get_orig_val_interpolated_pixel;
+    }
 }
 
 mathmap_invocation_t*
@@ -762,6 +1009,10 @@ invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template, int img_widt
 
     invocation->output_bpp = 4;
 
+    invocation->floatmap_layout = FLOATMAP_LAYOUT_INTERLEAVED;
+
+    invocation->rand_seed = 0;
+
     invocation->edge_behaviour_x = invocation->edge_behaviour_y = EDGE_BEHAVIOUR_COLOR;
 
     invocation->img_width = invocation->render_width = img_width;
@@ -787,41 +1038,89 @@ invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template, int img_widt
 	g_thread_init (NULL);
 
     mathmap_pools_init_global(&invocation->pools);
+    mathmap_pools_stats_register(&invocation->pools, POOLS_ROLE_INVOCATION);
     invocation->native_filter_cache_mutex = g_mutex_new();
     invocation->native_filter_cache_cond = g_cond_new();
     invocation->native_filter_cache = NULL;
+    invocation->lazy_renders = NULL;
 
     return invocation;
 }
 
-mathmap_frame_t*
-invocation_new_frame (mathmap_invocation_t *invocation, image_t *closure,
-		      int current_frame, float current_t)
+struct _lazy_render_scope_t;
+
+static struct _lazy_render_scope_t** enter_lazy_render_scope (struct _lazy_render_scope_t **scope);
+static void leave_lazy_render_scope (struct _lazy_render_scope_t **outer);
+static void free_lazy_render_scope (struct _lazy_render_scope_t *scope);
+static void free_invocation_lazy_renders (mathmap_invocation_t *invocation);
+
+static mathmap_frame_t*
+new_frame_with_size (mathmap_invocation_t *invocation, image_t *closure, int render_width, int render_height,
+		     int current_frame, float current_t)
 {
+    double trace_start = mathmap_trace_begin();
     mathmap_frame_t *frame = g_new0(mathmap_frame_t, 1);
+    struct _lazy_render_scope_t **outer_scope;
+    guint32 outer_rand_count;
 
     frame->invocation = invocation;
 
-    frame->frame_render_width = invocation->render_width;
-    frame->frame_render_height = invocation->render_height;
+    frame->frame_render_width = render_width;
+    frame->frame_render_height = render_height;
 
     frame->current_frame = current_frame;
     frame->current_t = current_t;
 
     mathmap_pools_init_global(&frame->pools);
+    mathmap_pools_stats_register(&frame->pools, POOLS_ROLE_FRAME);
 
+    outer_scope = enter_lazy_render_scope(&frame->lazy_renders);
+    outer_rand_count = mathmap_rand_begin();
     closure->v.closure.funcs->init_frame(frame, closure);
+    mathmap_rand_end(outer_rand_count);
+    leave_lazy_render_scope(outer_scope);
+
+    mathmap_trace_end("invocation_new_frame", "render", trace_start);
 
     return frame;
 }
 
+mathmap_frame_t*
+invocation_new_frame (mathmap_invocation_t *invocation, image_t *closure,
+		      int current_frame, float current_t)
+{
+    return new_frame_with_size(invocation, closure, invocation->render_width, invocation->render_height,
+			       current_frame, current_t);
+}
+
 void
 invocation_free_frame (mathmap_frame_t *frame)
 {
+    free_lazy_render_scope(frame->lazy_renders);
+    mathmap_pools_stats_unregister(&frame->pools);
     mathmap_pools_free(&frame->pools);
     g_free(frame);
 }
 
+/* Drops everything INVOCATION has derived from its input images: lazy
+   render frames and the native filter cache, whose entries live in the
+   invocation pools.  Must only be called while no frame of INVOCATION
+   is being rendered, before the inputs are replaced by other images. */
+void
+invocation_forget_input_images (mathmap_invocation_t *invocation)
+{
+    free_invocation_lazy_renders(invocation);
+
+    g_mutex_lock(invocation->native_filter_cache_mutex);
+    invocation->native_filter_cache = NULL;
+    g_mutex_unlock(invocation->native_filter_cache_mutex);
+
+    mathmap_pools_stats_unregister(&invocation->pools);
+    mathmap_pools_free(&invocation->pools);
+    mathmap_pools_init_global(&invocation->pools);
+    mathmap_pools_stats_register(&invocation->pools, POOLS_ROLE_INVOCATION);
+}
+
 void
 enable_debugging (mathmap_invocation_t *invocation)
 {
@@ -834,6 +1133,21 @@ disable_debugging (mathmap_invocation_t *invocation)
     invocation->do_debug = 0;
 }
 
+/* Runs the filter code for the rows FIRST_ROW to LAST_ROW of SLICE.
+   Lazy renders it does belong to the slice.  This can happen in the
+   middle of evaluating a pixel, if it samples a tile that isn't
+   rendered yet, so the draws of that pixel are kept. */
+static void
+slice_calc_lines (mathmap_slice_t *slice, image_t *closure, int first_row, int last_row, void *q, int floatmap)
+{
+    struct _lazy_render_scope_t **outer_scope = enter_lazy_render_scope(&slice->lazy_renders);
+    guint32 outer_rand_count = mathmap_rand_begin();
+
+    closure->v.closure.funcs->calc_lines(slice, closure, first_row, last_row, q, floatmap);
+    mathmap_rand_end(outer_rand_count);
+    leave_lazy_render_scope(outer_scope);
+}
+
 static void
 calc_lines (mathmap_slice_t *slice, image_t *closure, int first_row, int last_row, unsigned char *q)
 {
@@ -842,13 +1156,17 @@ calc_lines (mathmap_slice_t *slice, image_t *closure, int first_row, int last_ro
 
     assert(first_row >= 0 && last_row <= invocation->img_height + 1 && first_row <= last_row);
 
-    closure->v.closure.funcs->calc_lines(slice, closure, first_row, last_row, q, 0);
+    slice_calc_lines(slice, closure, first_row, last_row, q, 0);
 }
 
 void
 invocation_init_slice (mathmap_slice_t *slice, image_t *closure, mathmap_frame_t *frame, int region_x, int region_y,
 		       int region_width, int region_height, float sampling_offset_x, float sampling_offset_y)
 {
+    double trace_start = mathmap_trace_begin();
+    struct _lazy_render_scope_t **outer_scope;
+    guint32 outer_rand_count;
+
     memset(slice, 0, sizeof(mathmap_slice_t));
 
     slice->frame = frame;
@@ -860,13 +1178,22 @@ invocation_init_slice (mathmap_slice_t *slice, image_t *closure, mathmap_frame_t
     slice->sampling_offset_y = sampling_offset_y;
 
     mathmap_pools_init_local(&slice->pools);
+    mathmap_pools_stats_register(&slice->pools, POOLS_ROLE_SLICE);
 
+    outer_scope = enter_lazy_render_scope(&slice->lazy_renders);
+    outer_rand_count = mathmap_rand_begin();
     closure->v.closure.funcs->init_slice(slice, closure);
+    mathmap_rand_end(outer_rand_count);
+    leave_lazy_render_scope(outer_scope);
+
+    mathmap_trace_end("invocation_init_slice", "render", trace_start);
 }
 
 void
 invocation_deinit_slice (mathmap_slice_t *slice)
 {
+    free_lazy_render_scope(slice->lazy_renders);
+    mathmap_pools_stats_unregister(&slice->pools);
     mathmap_pools_free(&slice->pools);
 }
 
@@ -935,132 +1262,997 @@ call_invocation (mathmap_frame_t *frame, image_t *closure,
     }
 }
 
-#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
-typedef struct
-{
-    thread_handle_t thread_handle;
-    mathmap_frame_t *frame;
-    image_t *closure;
-    int region_x, region_y;
-    int region_height, region_width;
-    unsigned char *q;
-    gboolean is_done;
-} thread_data_t;
+/*** random numbers ***/
 
-typedef struct
-{
-    int num_threads;
-    thread_data_t datas[];
-} invocation_call_t;
+/* rand() is a counter based generator (Philox4x32-10), so its result
+   depends only on the seed, t, the pixel being computed and how many
+   random numbers that pixel has drawn so far.  It therefore needs no
+   locking and gives identical results for any number of threads and
+   any order of tiles.
+
+   The only state is the per thread draw counter.  It is reset
+   explicitly at the start of every pixel evaluation, and it is saved
+   and reset around everything that evaluates other pixels in the
+   middle of one, like sampling a closure or rendering the tiles of a
+   lazily rendered image.  So the draws of a pixel never depend on
+   what was evaluated before it. */
+
+#define PHILOX_M0	0xD2511F53
+#define PHILOX_M1	0xCD9E8D57
+#define PHILOX_W0	0x9E3779B9
+#define PHILOX_W1	0xBB67AE85
 
 static void
-call_invocation_thread_func (gpointer _data)
+philox4x32 (guint32 ctr[4], guint32 key0, guint32 key1)
 {
-    thread_data_t *data = (thread_data_t*)_data;
+    int i;
 
-#ifdef USE_PTHREADS
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-#endif
+    for (i = 0; i < 10; ++i)
+    {
+	guint64 p0 = (guint64)PHILOX_M0 * ctr[0];
+	guint64 p1 = (guint64)PHILOX_M1 * ctr[2];
+	guint32 c1 = ctr[1], c3 = ctr[3];
 
-    call_invocation(data->frame, data->closure, data->region_x, data->region_y,
-		    data->region_width, data->region_height, data->q);
+	ctr[0] = (guint32)(p1 >> 32) ^ c1 ^ key0;
+	ctr[1] = (guint32)p1;
+	ctr[2] = (guint32)(p0 >> 32) ^ c3 ^ key1;
+	ctr[3] = (guint32)p0;
 
-    data->is_done = TRUE;
+	key0 += PHILOX_W0;
+	key1 += PHILOX_W1;
+    }
 }
 
-gpointer
-call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
-			  int region_x, int region_y, int region_width, int region_height,
-			  unsigned char *q, int num_threads)
+static guint32
+float_bits (float f)
 {
-    mathmap_invocation_t *invocation = frame->invocation;
-    invocation_call_t *call;
-    int i;
-    int first_row = region_y;
-    int last_row = region_y + region_height;
+    union { float f; guint32 u; } v;
 
-    g_assert(first_row >= 0 && last_row <= invocation->img_height && first_row <= last_row);
+    /* make 0.0 and -0.0 the same pixel */
+    v.f = f + 0.0f;
+    return v.u;
+}
 
-    memset(invocation->rows_finished + first_row, 0, last_row - first_row);
+typedef struct
+{
+    guint32 count;		/* draws of the current evaluation */
+    gboolean have_block;
+    guint32 x, y, t, seed, index;	/* of the cached block */
+    guint32 block[4];
+} rand_state_t;
+
+static MATHMAP_THREAD_LOCAL rand_state_t rand_state;
+
+/* Starts the draws of a new pixel evaluation.  Returns the count of
+   the evaluation it interrupts, for mathmap_rand_end(). */
+CALLBACK_SYMBOL
+guint32
+mathmap_rand_begin (void)
+{
+    guint32 outer_count = rand_state.count;
 
-    call = g_malloc(sizeof(invocation_call_t) + sizeof(thread_data_t) * num_threads);
+    rand_state.count = 0;
 
-    call->num_threads = num_threads;
+    return outer_count;
+}
 
-    for (i = 0; i < num_threads; ++i)
-    {
-	call->datas[i].frame = frame;
-	call->datas[i].closure = closure;
-	call->datas[i].region_x = region_x;
-	call->datas[i].region_width = region_width;
-	call->datas[i].region_y = first_row + (last_row - first_row) * i / num_threads;
-	call->datas[i].region_height = first_row + (last_row - first_row) * (i + 1) / num_threads - call->datas[i].region_y;
-	call->datas[i].q = q + (call->datas[i].region_y - region_y) * invocation->row_stride;
-	call->datas[i].is_done = FALSE;
+CALLBACK_SYMBOL
+void
+mathmap_rand_end (guint32 outer_count)
+{
+    rand_state.count = outer_count;
+}
 
-	call->datas[i].thread_handle = mathmap_thread_start(call_invocation_thread_func, &call->datas[i]);
+CALLBACK_SYMBOL
+float
+mathmap_rand (mathmap_invocation_t *invocation, float x, float y, float t, float a, float b)
+{
+    rand_state_t *state = &rand_state;
+    guint32 xb = float_bits(x), yb = float_bits(y), tb = float_bits(t);
+    guint32 index = state->count >> 2;
+    guint32 r;
+
+    /* one Philox block gives four numbers.  The cached one can be of
+       another evaluation if this one was interrupted. */
+    if (!state->have_block || state->x != xb || state->y != yb || state->t != tb
+	|| state->seed != invocation->rand_seed || state->index != index)
+    {
+	state->block[0] = xb;
+	state->block[1] = yb;
+	state->block[2] = index;
+	state->block[3] = 0;
+	philox4x32(state->block, invocation->rand_seed, tb);
+
+	state->have_block = TRUE;
+	state->x = xb;
+	state->y = yb;
+	state->t = tb;
+	state->seed = invocation->rand_seed;
+	state->index = index;
     }
+    r = state->block[state->count & 3];
+    ++state->count;
 
-    return call;
+    /* 24 bits is all the precision a float in [0,1) has */
+    return a + (b - a) * ((r >> 8) * (1.0f / 16777216.0f));
 }
 
-void
-join_invocation_call (gpointer *_call)
+/*** tiled floatmaps ***/
+
+/* A tiled floatmap is a rendered closure whose tiles are computed
+   when they are first sampled, so the cost of a render scales with
+   the area that is actually used.  The closure is evaluated at the t
+   of the code doing the RENDER, in a frame that is only created on
+   the first access.
+
+   The tiles belong to the lazy render scope of the frame or slice
+   whose code did the RENDER and are freed when that frame or slice
+   ends.  Within a scope, rendering the same closure at the same size
+   and t again gives the same tiles.  The image_t is allocated in the
+   pools of the caller, like every other image. */
+
+#define FLOATMAP_TILE_SIZE	64
+
+typedef struct _tiled_floatmap_t
 {
-    invocation_call_t *call = (invocation_call_t*)_call;
-    int i;
+    mathmap_invocation_t *invocation;
+    image_t *closure;
+    int image_id;		/* of all images for these tiles */
+    int width, height;
+    float t;
+    int layout;			/* FLOATMAP_LAYOUT_* of the tiles */
+    volatile gsize frame;	/* mathmap_frame_t*, set on first access */
+    int num_tiles_x;
+    int num_tiles_y;
+    struct _tiled_floatmap_t *next;	/* in the scope, with the same closure */
+    volatile gsize tiles[];	/* tile data, set once the tile is rendered */
+} tiled_floatmap_t;
+
+/* The tiled floatmaps rendered in a frame or slice, by closure id.  A
+   scope is only used by the thread running the frame or slice code,
+   so it needs no lock. */
+typedef struct _lazy_render_scope_t
+{
+    GHashTable *tiled_floatmaps;
+} lazy_render_scope_t;
 
-    for (i = 0; i < call->num_threads; ++i)
-	mathmap_thread_join(call->datas[i].thread_handle);
+/* The scope of the filter code running in this thread, or NULL if
+   there is none, in which case lazy renders go to the invocation. */
+static MATHMAP_THREAD_LOCAL lazy_render_scope_t **current_lazy_render_scope = NULL;
 
-    g_free(call);
-}
+/* Protects the lazy renders of invocations. */
+G_LOCK_DEFINE_STATIC(tiled_floatmaps);
 
-#ifdef USE_PTHREADS
-void
-kill_invocation_call (gpointer *_call)
+static lazy_render_scope_t**
+enter_lazy_render_scope (lazy_render_scope_t **scope)
 {
-    invocation_call_t *call = (invocation_call_t*)_call;
-    int i;
+    lazy_render_scope_t **outer = current_lazy_render_scope;
 
-    for (i = 0; i < call->num_threads; ++i)
-	mathmap_thread_kill(call->datas[i].thread_handle);
+    current_lazy_render_scope = scope;
 
-    g_free(call);
+    return outer;
 }
-#endif
 
-gboolean
-invocation_call_is_done (gpointer *_call)
+static void
+leave_lazy_render_scope (lazy_render_scope_t **outer)
 {
-    invocation_call_t *call = (invocation_call_t*)_call;
-    int i;
-
-    for (i = 0; i < call->num_threads; ++i)
-	if (!call->datas[i].is_done)
-	    return FALSE;
-    return TRUE;
+    current_lazy_render_scope = outer;
 }
 
-void
-call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
-				   int region_x, int region_y, int region_width, int region_height,
-				   unsigned char *q, int num_threads)
+static void
+free_tiled_floatmap (tiled_floatmap_t *tiled)
 {
-    gpointer call = call_invocation_parallel(frame, closure, region_x, region_y,
-					     region_width, region_height, q, num_threads);
+    int i;
 
-    join_invocation_call(call);
+    if (tiled->frame != 0)
+	invocation_free_frame((mathmap_frame_t*)tiled->frame);
+    for (i = 0; i < tiled->num_tiles_x * tiled->num_tiles_y; ++i)
+	g_free((gpointer)tiled->tiles[i]);
+    g_free(tiled);
 }
 
-#ifdef USE_PTHREAD
 static void
-sigusr2_handler (int signum)
+free_tiled_floatmaps (gpointer key, gpointer value, gpointer user_data)
 {
-    pthread_testcancel();
-}
-#endif
+    tiled_floatmap_t *tiled = value;
+
+    while (tiled != NULL)
+    {
+	tiled_floatmap_t *next = tiled->next;
+
+	free_tiled_floatmap(tiled);
+	tiled = next;
+    }
+}
+
+static void
+free_lazy_render_scope (lazy_render_scope_t *scope)
+{
+    if (scope == NULL)
+	return;
+
+    g_hash_table_foreach(scope->tiled_floatmaps, free_tiled_floatmaps, NULL);
+    g_hash_table_destroy(scope->tiled_floatmaps);
+    g_free(scope);
+}
+
+/* Frees the lazy renders that were done outside of frames and
+   slices. */
+static void
+free_invocation_lazy_renders (mathmap_invocation_t *invocation)
+{
+    lazy_render_scope_t *scope;
+
+    G_LOCK(tiled_floatmaps);
+    scope = invocation->lazy_renders;
+    invocation->lazy_renders = NULL;
+    G_UNLOCK(tiled_floatmaps);
+
+    free_lazy_render_scope(scope);
+}
+
+static tiled_floatmap_t*
+lookup_tiled_floatmap (mathmap_invocation_t *invocation, lazy_render_scope_t **scope,
+		       image_t *closure, int width, int height, float t)
+{
+    tiled_floatmap_t *first, *tiled;
+    int num_tiles_x, num_tiles_y;
+
+    if (*scope == NULL)
+    {
+	*scope = g_new0(lazy_render_scope_t, 1);
+	(*scope)->tiled_floatmaps = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+
+    first = g_hash_table_lookup((*scope)->tiled_floatmaps, GINT_TO_POINTER(closure->id));
+    for (tiled = first; tiled != NULL; tiled = tiled->next)
+	if (tiled->width == width && tiled->height == height && tiled->t == t)
+	    return tiled;
+
+    num_tiles_x = (width + FLOATMAP_TILE_SIZE - 1) / FLOATMAP_TILE_SIZE;
+    num_tiles_y = (height + FLOATMAP_TILE_SIZE - 1) / FLOATMAP_TILE_SIZE;
+
+    tiled = g_malloc0(sizeof(tiled_floatmap_t) + sizeof(gsize) * num_tiles_x * num_tiles_y);
+    tiled->invocation = invocation;
+    tiled->closure = closure;
+    tiled->image_id = image_new_id();
+    tiled->width = width;
+    tiled->height = height;
+    tiled->t = t;
+    tiled->layout = invocation->floatmap_layout;
+    tiled->num_tiles_x = num_tiles_x;
+    tiled->num_tiles_y = num_tiles_y;
+
+    tiled->next = first;
+    g_hash_table_insert((*scope)->tiled_floatmaps, GINT_TO_POINTER(closure->id), tiled);
+
+    return tiled;
+}
+
+/* T is the t of the code doing the RENDER.  The rendered image is a
+   still, so the t it is sampled at doesn't matter. */
+CALLBACK_SYMBOL
+image_t*
+render_image_lazily (mathmap_invocation_t *invocation, image_t *image, int width, int height, float t,
+		     mathmap_pools_t *pools)
+{
+    image_t *img;
+    tiled_floatmap_t *tiled;
+
+    g_assert(image->type == IMAGE_CLOSURE);
+    g_assert(width > 0 && height > 0);
+
+    if (current_lazy_render_scope != NULL)
+	tiled = lookup_tiled_floatmap(invocation, current_lazy_render_scope, image, width, height, t);
+    else
+    {
+	G_LOCK(tiled_floatmaps);
+	tiled = lookup_tiled_floatmap(invocation, &invocation->lazy_renders, image, width, height, t);
+	G_UNLOCK(tiled_floatmaps);
+    }
+
+    img = mathmap_pools_alloc_accounted(pools, sizeof(image_t));
+
+    img->type = IMAGE_TILED_FLOATMAP;
+    img->id = tiled->image_id;
+    img->pixel_width = width;
+    img->pixel_height = height;
+    /* the inverse of CALC_VIRTUAL_X and CALC_VIRTUAL_Y */
+    img->v.tiled_floatmap.ax = (width - 1) / 2.0;
+    img->v.tiled_floatmap.bx = (width - 1) / 2.0;
+    img->v.tiled_floatmap.ay = -(height - 1) / 2.0;
+    img->v.tiled_floatmap.by = (height - 1) / 2.0;
+    img->v.tiled_floatmap.tiled = tiled;
+
+    return img;
+}
+
+static mathmap_frame_t*
+tiled_floatmap_get_frame (image_t *img)
+{
+    tiled_floatmap_t *tiled = img->v.tiled_floatmap.tiled;
+
+    if (g_once_init_enter(&tiled->frame))
+	g_once_init_leave(&tiled->frame,
+			  (gsize)new_frame_with_size(tiled->invocation, tiled->closure,
+						     tiled->width, tiled->height, 0, tiled->t));
+
+    return (mathmap_frame_t*)tiled->frame;
+}
+
+static void*
+render_tile (image_t *img, mathmap_frame_t *frame, int tile_x, int tile_y)
+{
+    tiled_floatmap_t *tiled = img->v.tiled_floatmap.tiled;
+    image_t *closure = tiled->closure;
+    int x = tile_x * FLOATMAP_TILE_SIZE;
+    int y = tile_y * FLOATMAP_TILE_SIZE;
+    int width = MIN(FLOATMAP_TILE_SIZE, img->pixel_width - x);
+    int height = MIN(FLOATMAP_TILE_SIZE, img->pixel_height - y);
+    int num_pixels = FLOATMAP_TILE_SIZE * FLOATMAP_TILE_SIZE;
+    void *data = g_malloc(floatmap_storage_size(tiled->layout, num_pixels));
+    float row_data[FLOATMAP_TILE_SIZE * NUM_FLOATMAP_CHANNELS];
+    mathmap_slice_t slice;
+    int row;
+    double trace_start = mathmap_trace_begin();
+
+    invocation_init_slice(&slice, closure, frame, x, y, width, height, 0.0, 0.0);
+    /* calc_lines advances by a whole frame row, so we do one row at a
+       time */
+    for (row = 0; row < height; ++row)
+    {
+	if (tiled->layout == FLOATMAP_LAYOUT_INTERLEAVED)
+	    slice_calc_lines(&slice, closure, y + row, y + row + 1,
+			     (float*)data + row * FLOATMAP_TILE_SIZE * NUM_FLOATMAP_CHANNELS, 1);
+	else
+	{
+	    int i, c;
+
+	    slice_calc_lines(&slice, closure, y + row, y + row + 1, row_data, 1);
+	    for (i = 0; i < width; ++i)
+		for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+		    floatmap_storage_set(data, tiled->layout, num_pixels, row * FLOATMAP_TILE_SIZE + i, c,
+					 row_data[i * NUM_FLOATMAP_CHANNELS + c]);
+	}
+    }
+    invocation_deinit_slice(&slice);
+
+    mathmap_trace_end("render tile", "render", trace_start);
+
+    return data;
+}
+
+/* Returns the pixel at COL/ROW.  Tiles that aren't stored
+   interleaved are converted into DEST, otherwise a pointer into the
+   tile is returned. */
+static float*
+tiled_floatmap_texel (image_t *img, int col, int row, float *dest)
+{
+    tiled_floatmap_t *tiled = img->v.tiled_floatmap.tiled;
+    volatile gsize *tile;
+    int i, c;
+
+    col = CLAMP(col, 0, img->pixel_width - 1);
+    row = CLAMP(row, 0, img->pixel_height - 1);
+
+    tile = &tiled->tiles[(row / FLOATMAP_TILE_SIZE) * tiled->num_tiles_x + col / FLOATMAP_TILE_SIZE];
+    if (g_once_init_enter(tile))
+	g_once_init_leave(tile, (gsize)render_tile(img, tiled_floatmap_get_frame(img),
+						   col / FLOATMAP_TILE_SIZE, row / FLOATMAP_TILE_SIZE));
+
+    i = (row % FLOATMAP_TILE_SIZE) * FLOATMAP_TILE_SIZE + col % FLOATMAP_TILE_SIZE;
+    if (tiled->layout == FLOATMAP_LAYOUT_INTERLEAVED)
+	return (float*)*tile + i * NUM_FLOATMAP_CHANNELS;
+
+    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	dest[c] = floatmap_storage_get((void*)*tile, tiled->layout, FLOATMAP_TILE_SIZE * FLOATMAP_TILE_SIZE, i, c);
+    return dest;
+}
+
+CALLBACK_SYMBOL
+float*
+get_tiled_floatmap_pixel (mathmap_invocation_t *invocation, image_t *img, float x, float y, float t,
+			  mathmap_pools_t *pools)
+{
+    float fx = img->v.tiled_floatmap.ax * x + img->v.tiled_floatmap.bx;
+    float fy = img->v.tiled_floatmap.ay * y + img->v.tiled_floatmap.by;
+
+    g_assert(img->type == IMAGE_TILED_FLOATMAP);
+
+    if (!invocation->antialiasing)
+    {
+	float *dest = NULL;
+
+	if (img->v.tiled_floatmap.tiled->layout != FLOATMAP_LAYOUT_INTERLEAVED)
+	    dest = mathmap_pools_alloc(pools, sizeof(float) * NUM_FLOATMAP_CHANNELS);
+	return tiled_floatmap_texel(img, (int)floorf(fx + 0.5), (int)floorf(fy + 0.5), dest);
+    }
+    else
+    {
+	int col = (int)floorf(fx);
+	int row = (int)floorf(fy);
+	float u = fx - col;
+	float v = fy - row;
+	float b00[NUM_FLOATMAP_CHANNELS], b10[NUM_FLOATMAP_CHANNELS];
+	float b01[NUM_FLOATMAP_CHANNELS], b11[NUM_FLOATMAP_CHANNELS];
+	float *p00 = tiled_floatmap_texel(img, col, row, b00);
+	float *p10 = tiled_floatmap_texel(img, col + 1, row, b10);
+	float *p01 = tiled_floatmap_texel(img, col, row + 1, b01);
+	float *p11 = tiled_floatmap_texel(img, col + 1, row + 1, b11);
+	float *result = mathmap_pools_alloc(pools, sizeof(float) * NUM_FLOATMAP_CHANNELS);
+	int i;
+
+	for (i = 0; i < NUM_FLOATMAP_CHANNELS; ++i)
+	    result[i] = (1 - v) * ((1 - u) * p00[i] + u * p10[i])
+		+ v * ((1 - u) * p01[i] + u * p11[i]);
+
+	return result;
+    }
+}
+
+/* Renders all tiles and copies them into an ordinary floatmap with
+   the given LAYOUT, for consumers like native filters that need the
+   whole image.  Floatmaps that are sampled by filter code must be
+   interleaved, because get_floatmap_pixel() only reads that. */
+image_t*
+tiled_floatmap_flatten (mathmap_invocation_t *invocation, image_t *img, int layout, mathmap_pools_t *pools)
+{
+    image_t *floatmap = floatmap_alloc_with_layout(img->pixel_width, img->pixel_height, layout, pools);
+    int row, col, c;
+
+    g_assert(img->type == IMAGE_TILED_FLOATMAP);
+
+    for (row = 0; row < img->pixel_height; ++row)
+	for (col = 0; col < img->pixel_width; ++col)
+	{
+	    float buf[NUM_FLOATMAP_CHANNELS];
+	    float *p = tiled_floatmap_texel(img, col, row, buf);
+
+	    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+		FLOATMAP_SET_I(floatmap, row * img->pixel_width + col, c, p[c]);
+	}
+
+    return floatmap;
+}
+
+/*** hardware counters ***/
+
+/* Event counts from perf_event_open.  A counter group opened with
+   INHERIT counts the calling thread and all threads it starts from
+   then on, as long as they have exited by the time it is read.  If
+   per-thread counting is enabled, render threads count themselves
+   between perf_counters_begin_thread() and perf_counters_end_thread()
+   and add their counts to the slot for their kind and thread index,
+   so that band threads and frame threads, which are both numbered
+   from zero, don't share slots. */
+
+const char *perf_counter_names[NUM_PERF_COUNTERS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses", "page_faults"
+};
+
+const char *perf_thread_kind_names[NUM_PERF_THREAD_KINDS] = {
+    "band", "frame"
+};
+
+static perf_counts_t *perf_thread_counts[NUM_PERF_THREAD_KINDS];
+static int perf_num_thread_counts = 0;
+G_LOCK_DEFINE_STATIC(perf_thread_counts);
+
+#ifdef __linux__
+static int
+open_perf_counter (int counter, gboolean inherit)
+{
+    static const struct { guint32 type; guint64 config; } events[NUM_PERF_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+    };
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[counter].type;
+    attr.config = events[counter].config;
+    attr.inherit = inherit ? 1 : 0;
+    /* works with perf_event_paranoid up to 2 */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/* Opens and starts the counters for the calling thread.  Returns
+   FALSE if none of them could be opened, for example because the
+   kernel doesn't allow it or the host isn't Linux. */
+gboolean
+perf_counters_open (perf_counter_group_t *group, gboolean inherit)
+{
+    gboolean have_counters = FALSE;
+    int i;
+
+    for (i = 0; i < NUM_PERF_COUNTERS; ++i)
+    {
+#ifdef __linux__
+	group->fds[i] = open_perf_counter(i, inherit);
+#else
+	group->fds[i] = -1;
+#endif
+	if (group->fds[i] >= 0)
+	    have_counters = TRUE;
+    }
+
+    return have_counters;
+}
+
+void
+perf_counters_read (perf_counter_group_t *group, perf_counts_t *counts)
+{
+    int i;
+
+    for (i = 0; i < NUM_PERF_COUNTERS; ++i)
+    {
+	guint64 value;
+
+	counts->valid[i] = group->fds[i] >= 0
+	    && read(group->fds[i], &value, sizeof(value)) == sizeof(value);
+	counts->values[i] = counts->valid[i] ? value : 0;
+    }
+}
+
+void
+perf_counters_close (perf_counter_group_t *group)
+{
+    int i;
+
+    for (i = 0; i < NUM_PERF_COUNTERS; ++i)
+	if (group->fds[i] >= 0)
+	{
+	    close(group->fds[i]);
+	    group->fds[i] = -1;
+	}
+}
+
+void
+perf_counts_add (perf_counts_t *sum, perf_counts_t *counts)
+{
+    int i;
+
+    for (i = 0; i < NUM_PERF_COUNTERS; ++i)
+	if (counts->valid[i])
+	{
+	    sum->values[i] += counts->values[i];
+	    sum->valid[i] = TRUE;
+	}
+}
+
+/* Makes render threads count themselves from now on, for up to
+   MAX_THREADS thread indexes of each kind, and resets the per-thread
+   counts. */
+void
+perf_counters_enable_per_thread (int max_threads)
+{
+    int i;
+
+    G_LOCK(perf_thread_counts);
+    for (i = 0; i < NUM_PERF_THREAD_KINDS; ++i)
+    {
+	g_free(perf_thread_counts[i]);
+	perf_thread_counts[i] = g_new0(perf_counts_t, max_threads);
+    }
+    perf_num_thread_counts = max_threads;
+    G_UNLOCK(perf_thread_counts);
+}
+
+/* Returns the number of thread indexes of KIND. */
+int
+perf_counters_get_per_thread (int kind, perf_counts_t **counts)
+{
+    g_assert(kind >= 0 && kind < NUM_PERF_THREAD_KINDS);
+
+    *counts = perf_thread_counts[kind];
+    return perf_num_thread_counts;
+}
+
+/* Returns FALSE if per-thread counting is disabled or not possible, in
+   which case perf_counters_end_thread() must not be called. */
+gboolean
+perf_counters_begin_thread (perf_counter_group_t *group, int kind, int thread_index, gboolean inherit)
+{
+    g_assert(kind >= 0 && kind < NUM_PERF_THREAD_KINDS);
+
+    if (thread_index < 0 || thread_index >= perf_num_thread_counts)
+	return FALSE;
+    return perf_counters_open(group, inherit);
+}
+
+void
+perf_counters_end_thread (perf_counter_group_t *group, int kind, int thread_index)
+{
+    perf_counts_t counts;
+
+    perf_counters_read(group, &counts);
+    perf_counters_close(group);
+
+    G_LOCK(perf_thread_counts);
+    if (thread_index < perf_num_thread_counts)
+	perf_counts_add(&perf_thread_counts[kind][thread_index], &counts);
+    G_UNLOCK(perf_thread_counts);
+}
+
+/*** interpolated sampling ***/
+
+/* Antialiased reads of input drawables.  Instead of fetching each tap
+   through mathmap_get_pixel we read the 2x2 or 4x4 footprint straight
+   from the decoded frame and blend it with SSE2.  The scalar versions
+   do the same operations in the same order, so they give the same
+   results unless the compiler contracts float operations or keeps
+   extended precision.  Footprints touching the image border, and
+   drawables whose pixels aren't available contiguously, go through
+   get_orig_val_intersample_pixel, which does the edge handling. */
+
+/* fractional positions are quantized to this many phases */
+#define INTERPOLATION_PHASES	256
+
+static float cubic_weights[INTERPOLATION_PHASES][4];
+static float lanczos_weights[INTERPOLATION_PHASES][4];
+
+static double
+sinc (double x)
+{
+    if (x == 0.0)
+	return 1.0;
+    return sin(M_PI * x) / (M_PI * x);
+}
+
+static void
+init_interpolation_weights (void)
+{
+    static gsize initialized = 0;
+    int i, j;
+
+    if (!g_once_init_enter(&initialized))
+	return;
+
+    for (i = 0; i < INTERPOLATION_PHASES; ++i)
+    {
+	double t = (double)i / INTERPOLATION_PHASES;
+	double sum = 0.0;
+
+	/* Catmull-Rom */
+	cubic_weights[i][0] = ((-0.5 * t + 1.0) * t - 0.5) * t;
+	cubic_weights[i][1] = (1.5 * t - 2.5) * t * t + 1.0;
+	cubic_weights[i][2] = ((-1.5 * t + 2.0) * t + 0.5) * t;
+	cubic_weights[i][3] = (0.5 * t - 0.5) * t * t;
+
+	/* Lanczos with a = 2, normalized so that flat areas stay flat */
+	for (j = 0; j < 4; ++j)
+	{
+	    double d = t + 1 - j;
+
+	    lanczos_weights[i][j] = sinc(d) * sinc(d / 2);
+	    sum += lanczos_weights[i][j];
+	}
+	for (j = 0; j < 4; ++j)
+	    lanczos_weights[i][j] /= sum;
+    }
+
+    g_once_init_leave(&initialized, 1);
+}
+
+static inline guint32
+load_pixel_rgba (const guchar *p, int bpp)
+{
+    if (bpp == 4)
+    {
+	guint32 v;
+
+	memcpy(&v, p, sizeof(guint32));
+	return GUINT32_FROM_LE(v);
+    }
+    return p[0] | (p[1] << 8) | (p[2] << 16) | 0xff000000;
+}
+
+static color_t
+color_from_rgba (guint32 v)
+{
+    return MAKE_RGBA_COLOR(v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24);
+}
+
+/* FX and FY are the fractional position in 1/256ths.  The weights
+   always add up to exactly 256. */
+static guint32
+bilinear_rgba (const guchar *row0, const guchar *row1, int bpp, int fx, int fy)
+{
+    guint32 p00 = load_pixel_rgba(row0, bpp), p10 = load_pixel_rgba(row0 + bpp, bpp);
+    guint32 p01 = load_pixel_rgba(row1, bpp), p11 = load_pixel_rgba(row1 + bpp, bpp);
+    int w11 = (fx * fy + 128) >> 8;
+    int w10 = fx - w11;
+    int w01 = fy - w11;
+    int w00 = 256 - fx - fy + w11;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i top = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, p10, p00), zero);
+    __m128i bottom = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, p11, p01), zero);
+    __m128i sum;
+
+    /* 255 * 256 still fits into 16 bits */
+    sum = _mm_add_epi16(_mm_mullo_epi16(top, _mm_set_epi16(w10, w10, w10, w10, w00, w00, w00, w00)),
+			_mm_mullo_epi16(bottom, _mm_set_epi16(w11, w11, w11, w11, w01, w01, w01, w01)));
+    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+
+    return _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+#else
+    guint32 result = 0;
+    int shift;
+
+    for (shift = 0; shift < 32; shift += 8)
+    {
+	int c = (((p00 >> shift) & 0xff) * w00 + ((p10 >> shift) & 0xff) * w10
+		 + ((p01 >> shift) & 0xff) * w01 + ((p11 >> shift) & 0xff) * w11 + 128) >> 8;
+
+	result |= (guint32)c << shift;
+    }
+
+    return result;
+#endif
+}
+
+/* 4x4 taps starting at P, weighted separably by WX and WY. */
+static guint32
+separable_4x4_rgba (const guchar *p, int row_stride, int bpp, const float *wx, const float *wy)
+{
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128 acc = _mm_setzero_ps();
+    __m128i result;
+    int i, j;
+
+    for (j = 0; j < 4; ++j, p += row_stride)
+    {
+	__m128 row_acc = _mm_setzero_ps();
+
+	for (i = 0; i < 4; ++i)
+	{
+	    __m128i v = _mm_cvtsi32_si128(load_pixel_rgba(p + i * bpp, bpp));
+
+	    v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero);
+	    row_acc = _mm_add_ps(row_acc, _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(wx[i])));
+	}
+	acc = _mm_add_ps(acc, _mm_mul_ps(row_acc, _mm_set1_ps(wy[j])));
+    }
+
+    /* the packs saturate the overshoot of the negative lobes */
+    result = _mm_cvtps_epi32(acc);
+    result = _mm_packs_epi32(result, result);
+    return _mm_cvtsi128_si32(_mm_packus_epi16(result, result));
+#else
+    /* same order of operations and rounding as above */
+    float acc[4] = { 0.0, 0.0, 0.0, 0.0 };
+    guint32 result = 0;
+    int i, j, c;
+
+    for (j = 0; j < 4; ++j, p += row_stride)
+    {
+	float row_acc[4] = { 0.0, 0.0, 0.0, 0.0 };
+
+	for (i = 0; i < 4; ++i)
+	{
+	    guint32 v = load_pixel_rgba(p + i * bpp, bpp);
+
+	    for (c = 0; c < 4; ++c)
+		row_acc[c] += (float)((v >> (c * 8)) & 0xff) * wx[i];
+	}
+	for (c = 0; c < 4; ++c)
+	    acc[c] += row_acc[c] * wy[j];
+    }
+
+    /* rounds half to even, like _mm_cvtps_epi32 */
+    for (c = 0; c < 4; ++c)
+	result |= (guint32)CLAMP((int)lrintf(acc[c]), 0, 255) << (c * 8);
+
+    return result;
+#endif
+}
+
+color_t
+get_orig_val_interpolated_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *img, int frame)
+{
+    input_drawable_t *drawable = img->v.drawable;
+    int width = img->pixel_width, height = img->pixel_height;
+    int row_stride, bpp;
+    int col, row, phase_x, phase_y;
+    float px, py;
+    guchar *data;
+    color_t color;
+
+    px = (x + drawable->middle_x) * drawable->scale_x;
+    py = (-y + drawable->middle_y) * drawable->scale_y;
+
+    /* this also catches NaNs */
+    if (!(px >= 1.0f && px < width - 2 && py >= 1.0f && py < height - 2))
+	return get_orig_val_intersample_pixel(invocation, x, y, img, frame);
+
+    data = mathmap_get_frame_data(invocation, drawable, frame, &row_stride, &bpp);
+    if (data == NULL)
+	return get_orig_val_intersample_pixel(invocation, x, y, img, frame);
+
+    col = (int)px;
+    row = (int)py;
+    phase_x = (int)((px - col) * INTERPOLATION_PHASES);
+    phase_y = (int)((py - row) * INTERPOLATION_PHASES);
+
+    switch (invocation->interpolation)
+    {
+	case INTERPOLATION_BILINEAR :
+	    {
+		guchar *p = data + row * row_stride + col * bpp;
+
+		color = color_from_rgba(bilinear_rgba(p, p + row_stride, bpp, phase_x, phase_y));
+	    }
+	    break;
+
+	case INTERPOLATION_BICUBIC :
+	    color = color_from_rgba(separable_4x4_rgba(data + (row - 1) * row_stride + (col - 1) * bpp, row_stride, bpp,
+						       cubic_weights[phase_x], cubic_weights[phase_y]));
+	    break;
+
+	case INTERPOLATION_LANCZOS :
+	    color = color_from_rgba(separable_4x4_rgba(data + (row - 1) * row_stride + (col - 1) * bpp, row_stride, bpp,
+						       lanczos_weights[phase_x], lanczos_weights[phase_y]));
+	    break;
+
+	default :
+	    g_assert_not_reached();
+    }
+
+    mathmap_release_frame_data(invocation, drawable, frame);
+
+    return color;
+}
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+typedef struct
+{
+    thread_handle_t thread_handle;
+    mathmap_frame_t *frame;
+    image_t *closure;
+    int region_x, region_y;
+    int region_height, region_width;
+    unsigned char *q;
+    int thread_index;
+    gboolean is_done;
+} thread_data_t;
+
+typedef struct
+{
+    int num_threads;
+    thread_data_t datas[];
+} invocation_call_t;
+
+static void
+call_invocation_thread_func (gpointer _data)
+{
+    thread_data_t *data = (thread_data_t*)_data;
+    double trace_start = mathmap_trace_begin();
+    perf_counter_group_t counters;
+    gboolean count_events;
+
+#ifdef USE_PTHREADS
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+#endif
+
+    count_events = perf_counters_begin_thread(&counters, PERF_THREAD_BAND, data->thread_index, FALSE);
+
+    call_invocation(data->frame, data->closure, data->region_x, data->region_y,
+		    data->region_width, data->region_height, data->q);
+
+    if (count_events)
+	perf_counters_end_thread(&counters, PERF_THREAD_BAND, data->thread_index);
+
+    mathmap_trace_end("calc_lines band", "render", trace_start);
+
+    data->is_done = TRUE;
+}
+
+gpointer
+call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
+			  int region_x, int region_y, int region_width, int region_height,
+			  unsigned char *q, int num_threads)
+{
+    mathmap_invocation_t *invocation = frame->invocation;
+    invocation_call_t *call;
+    int i;
+    int first_row = region_y;
+    int last_row = region_y + region_height;
+
+    g_assert(first_row >= 0 && last_row <= invocation->img_height && first_row <= last_row);
+
+    memset(invocation->rows_finished + first_row, 0, last_row - first_row);
+
+    call = g_malloc(sizeof(invocation_call_t) + sizeof(thread_data_t) * num_threads);
+
+    call->num_threads = num_threads;
+
+    for (i = 0; i < num_threads; ++i)
+    {
+	call->datas[i].frame = frame;
+	call->datas[i].closure = closure;
+	call->datas[i].region_x = region_x;
+	call->datas[i].region_width = region_width;
+	call->datas[i].region_y = first_row + (last_row - first_row) * i / num_threads;
+	call->datas[i].region_height = first_row + (last_row - first_row) * (i + 1) / num_threads - call->datas[i].region_y;
+	call->datas[i].q = q + (call->datas[i].region_y - region_y) * invocation->row_stride;
+	/* a single band is counted by the thread that waits for it */
+	call->datas[i].thread_index = num_threads > 1 ? i : -1;
+	call->datas[i].is_done = FALSE;
+
+	call->datas[i].thread_handle = mathmap_thread_start(call_invocation_thread_func, &call->datas[i]);
+    }
+
+    return call;
+}
+
+void
+join_invocation_call (gpointer *_call)
+{
+    invocation_call_t *call = (invocation_call_t*)_call;
+    int i;
+
+    for (i = 0; i < call->num_threads; ++i)
+	mathmap_thread_join(call->datas[i].thread_handle);
+
+    g_free(call);
+}
+
+#ifdef USE_PTHREADS
+void
+kill_invocation_call (gpointer *_call)
+{
+    invocation_call_t *call = (invocation_call_t*)_call;
+    int i;
+
+    for (i = 0; i < call->num_threads; ++i)
+	mathmap_thread_kill(call->datas[i].thread_handle);
+
+    g_free(call);
+}
+#endif
+
+gboolean
+invocation_call_is_done (gpointer *_call)
+{
+    invocation_call_t *call = (invocation_call_t*)_call;
+    int i;
+
+    for (i = 0; i < call->num_threads; ++i)
+	if (!call->datas[i].is_done)
+	    return FALSE;
+    return TRUE;
+}
+
+void
+call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
+				   int region_x, int region_y, int region_width, int region_height,
+				   unsigned char *q, int num_threads)
+{
+    gpointer call = call_invocation_parallel(frame, closure, region_x, region_y,
+					     region_width, region_height, q, num_threads);
+
+    join_invocation_call(call);
+}
+
+#ifdef USE_PTHREAD
+static void
+sigusr2_handler (int signum)
+{
+    pthread_testcancel();
+}
+#endif
 
 thread_handle_t
 mathmap_thread_start (void (*func) (gpointer), gpointer data)
@@ -1117,10 +2309,667 @@ call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
 				   int region_x, int region_y, int region_width, int region_height,
 				   unsigned char *q, int num_threads)
 {
+    double trace_start = mathmap_trace_begin();
+
     call_invocation(frame, closure, region_x, region_y, region_width, region_height, q);
+
+    mathmap_trace_end("calc_lines band", "render", trace_start);
 }
 #endif
 
+/*** pool statistics ***/
+
+/* If enabled, allocations from mathmap pools that go through
+   mathmap_pools_alloc_accounted() are counted per pool instance.
+   Generated code only does that if it was compiled while statistics
+   were enabled.  The instances are registered with their role when
+   they are initialized and fold their counts into the totals for the
+   role when they are freed.  The mathmap pools allocator doesn't
+   count anything itself, so the bytes reserved and the number of
+   growths are estimates, made by replaying its doubling scheme.  The
+   compiler's lispreader pools report measured numbers.
+
+   The instances live in a fixed table with open addressing.  Only
+   registering and unregistering take the mutex.  An allocation finds
+   its instance without locking and updates it without atomics: a
+   pools is only used by one thread at a time, between registering
+   and unregistering it, and instances never move.  Unregistered
+   instances leave a tombstone, which can be reused.
+
+   The pixel pools of code generated by the C backend live in the
+   template, so they are not registered.  Instead, the pixel code
+   starts with mathmap_pools_stats_begin_pixel(), which registers and
+   resets them.  They are never unregistered, so instances that are
+   still live are added to the totals when those are read.  Because
+   such pools are on the stack, an instance can stand for many pools
+   at the same address. */
+
+#define POOLS_INSTANCE_SLOTS		4096
+#define POOLS_INSTANCE_TOMBSTONE	((gpointer)1)
+
+typedef struct
+{
+    int role;
+    int active_pool;
+    int max_active_pool;
+    size_t fill_ptr;		/* in units of GRANULARITY */
+    size_t in_use;
+    size_t high_water;
+    guint64 num_allocs;
+    guint64 bytes_requested;
+} pools_instance_t;
+
+typedef struct
+{
+    gpointer pools;		/* NULL if never used */
+    pools_instance_t instance;
+} pools_instance_slot_t;
+
+static const char *pools_role_names[NUM_POOLS_ROLES] = {
+    "invocation", "frame", "slice", "pixel", "closure", "compiler", "other"
+};
+
+static gboolean pools_statistics_enabled = FALSE;
+static GStaticMutex pools_statistics_mutex = G_STATIC_MUTEX_INIT;
+static pools_instance_slot_t pools_instance_slots[POOLS_INSTANCE_SLOTS];
+static pools_role_statistics_t pools_role_statistics[NUM_POOLS_ROLES];
+static volatile gint pixel_alloc_warned = 0;
+static gboolean pools_table_full_warned = FALSE;
+
+void
+set_pools_statistics (gboolean enabled)
+{
+    g_static_mutex_lock(&pools_statistics_mutex);
+    memset(pools_instance_slots, 0, sizeof(pools_instance_slots));
+    memset(pools_role_statistics, 0, sizeof(pools_role_statistics));
+    pixel_alloc_warned = 0;
+    pools_table_full_warned = FALSE;
+    pools_statistics_enabled = enabled;
+    g_static_mutex_unlock(&pools_statistics_mutex);
+}
+
+gboolean
+get_pools_statistics (void)
+{
+    return pools_statistics_enabled;
+}
+
+static guint
+pools_instance_hash (mathmap_pools_t *pools)
+{
+    return (guint)((GPOINTER_TO_SIZE(pools) >> 4) * 2654435761u) % POOLS_INSTANCE_SLOTS;
+}
+
+/* Doesn't lock, see above. */
+static pools_instance_slot_t*
+find_pools_slot (mathmap_pools_t *pools)
+{
+    guint index = pools_instance_hash(pools);
+    int i;
+
+    for (i = 0; i < POOLS_INSTANCE_SLOTS; ++i)
+    {
+	gpointer key = g_atomic_pointer_get(&pools_instance_slots[index].pools);
+
+	if (key == pools)
+	    return &pools_instance_slots[index];
+	if (key == NULL)
+	    break;
+	index = (index + 1) % POOLS_INSTANCE_SLOTS;
+    }
+
+    return NULL;
+}
+
+static pools_instance_t*
+find_pools_instance (mathmap_pools_t *pools)
+{
+    pools_instance_slot_t *slot = find_pools_slot(pools);
+
+    return slot != NULL ? &slot->instance : NULL;
+}
+
+/* Returns NULL if the table is full.  Must be called with the mutex
+   held. */
+static pools_instance_t*
+lookup_pools_instance (mathmap_pools_t *pools, int role)
+{
+    pools_instance_slot_t *free_slot = NULL;
+    guint index = pools_instance_hash(pools);
+    int i;
+
+    for (i = 0; i < POOLS_INSTANCE_SLOTS; ++i)
+    {
+	pools_instance_slot_t *slot = &pools_instance_slots[index];
+
+	if (slot->pools == pools)
+	    return &slot->instance;
+	if (slot->pools == POOLS_INSTANCE_TOMBSTONE && free_slot == NULL)
+	    free_slot = slot;
+	if (slot->pools == NULL)
+	{
+	    if (free_slot == NULL)
+		free_slot = slot;
+	    break;
+	}
+	index = (index + 1) % POOLS_INSTANCE_SLOTS;
+    }
+
+    if (free_slot == NULL)
+    {
+	if (!pools_table_full_warned)
+	{
+	    pools_table_full_warned = TRUE;
+	    g_warning("Too many pools to keep statistics for, some allocations are not counted.");
+	}
+	return NULL;
+    }
+
+    memset(&free_slot->instance, 0, sizeof(pools_instance_t));
+    free_slot->instance.role = role;
+    /* publishes the instance to lock-free readers */
+    g_atomic_pointer_set(&free_slot->pools, pools);
+
+    return &free_slot->instance;
+}
+
+static void
+add_instance_to_statistics (pools_role_statistics_t *stats, pools_instance_t *instance)
+{
+    ++stats->num_instances;
+    stats->num_allocs += instance->num_allocs;
+    stats->bytes_requested += instance->bytes_requested;
+    /* the first pool is allocated even if nothing is allocated from
+       it */
+    stats->bytes_reserved += GRANULARITY * FIRST_POOL_SIZE * (((size_t)2 << instance->max_active_pool) - 1);
+    stats->num_growths += instance->max_active_pool;
+    stats->high_water = MAX(stats->high_water, instance->high_water);
+}
+
+static void
+reset_pools_instance (pools_instance_t *instance)
+{
+    instance->active_pool = 0;
+    instance->fill_ptr = 0;
+    instance->in_use = 0;
+}
+
+void
+mathmap_pools_stats_register (mathmap_pools_t *pools, int role)
+{
+    pools_instance_t *instance;
+
+    if (!pools_statistics_enabled)
+	return;
+
+    g_static_mutex_lock(&pools_statistics_mutex);
+    instance = lookup_pools_instance(pools, role);
+    if (instance != NULL)
+	instance->role = role;
+    g_static_mutex_unlock(&pools_statistics_mutex);
+}
+
+void
+mathmap_pools_stats_reset (mathmap_pools_t *pools)
+{
+    pools_instance_t *instance;
+
+    if (!pools_statistics_enabled)
+	return;
+
+    instance = find_pools_instance(pools);
+    if (instance != NULL)
+	reset_pools_instance(instance);
+}
+
+/* Called by generated pixel code, with the pixel pools. */
+CALLBACK_SYMBOL void
+mathmap_pools_stats_begin_pixel (mathmap_pools_t *pools)
+{
+    pools_instance_t *instance;
+
+    if (!pools_statistics_enabled)
+	return;
+
+    instance = find_pools_instance(pools);
+    if (instance == NULL)
+    {
+	g_static_mutex_lock(&pools_statistics_mutex);
+	instance = lookup_pools_instance(pools, POOLS_ROLE_PIXEL);
+	g_static_mutex_unlock(&pools_statistics_mutex);
+	if (instance == NULL)
+	    return;
+    }
+    instance->role = POOLS_ROLE_PIXEL;
+    reset_pools_instance(instance);
+}
+
+void
+mathmap_pools_stats_add_instance (int role, guint64 bytes_requested, guint64 bytes_reserved,
+				  guint64 high_water, guint64 num_growths)
+{
+    pools_role_statistics_t *stats;
+
+    g_assert(role >= 0 && role < NUM_POOLS_ROLES);
+
+    if (!pools_statistics_enabled)
+	return;
+
+    stats = &pools_role_statistics[role];
+
+    g_static_mutex_lock(&pools_statistics_mutex);
+    ++stats->num_instances;
+    stats->bytes_requested += bytes_requested;
+    stats->bytes_reserved += bytes_reserved;
+    stats->num_growths += num_growths;
+    stats->high_water = MAX(stats->high_water, high_water);
+    g_static_mutex_unlock(&pools_statistics_mutex);
+}
+
+void
+mathmap_pools_stats_unregister (mathmap_pools_t *pools)
+{
+    pools_instance_slot_t *slot;
+
+    if (!pools_statistics_enabled)
+	return;
+
+    g_static_mutex_lock(&pools_statistics_mutex);
+    slot = find_pools_slot(pools);
+    if (slot != NULL)
+    {
+	add_instance_to_statistics(&pools_role_statistics[slot->instance.role], &slot->instance);
+	g_atomic_pointer_set(&slot->pools, POOLS_INSTANCE_TOMBSTONE);
+    }
+    g_static_mutex_unlock(&pools_statistics_mutex);
+}
+
+static void
+account_pools_alloc (mathmap_pools_t *pools, size_t size)
+{
+    pools_instance_t *instance = find_pools_instance(pools);
+    size_t padded_size = (size + GRANULARITY - 1) / GRANULARITY;
+
+    if (instance == NULL)
+    {
+	g_static_mutex_lock(&pools_statistics_mutex);
+	instance = lookup_pools_instance(pools, POOLS_ROLE_OTHER);
+	g_static_mutex_unlock(&pools_statistics_mutex);
+	if (instance == NULL)
+	    return;
+    }
+
+    /* same as the allocator: move on to the next, twice as big
+       pool when the current one is full */
+    while (instance->fill_ptr + padded_size >= (FIRST_POOL_SIZE << instance->active_pool))
+    {
+	instance->in_use += GRANULARITY * ((FIRST_POOL_SIZE << instance->active_pool) - instance->fill_ptr);
+	++instance->active_pool;
+	instance->fill_ptr = 0;
+    }
+    instance->max_active_pool = MAX(instance->max_active_pool, instance->active_pool);
+    instance->fill_ptr += padded_size;
+    instance->in_use += GRANULARITY * padded_size;
+    instance->high_water = MAX(instance->high_water, instance->in_use);
+
+    ++instance->num_allocs;
+    instance->bytes_requested += size;
+
+    if (instance->role == POOLS_ROLE_PIXEL && g_atomic_int_compare_and_exchange(&pixel_alloc_warned, 0, 1))
+	g_warning("The filter allocates memory for every pixel (%lu bytes for the first one).",
+		  (unsigned long)size);
+}
+
+CALLBACK_SYMBOL void*
+mathmap_pools_alloc_accounted (mathmap_pools_t *pools, size_t size)
+{
+    if (G_UNLIKELY(pools_statistics_enabled))
+	account_pools_alloc(pools, size);
+
+    return mathmap_pools_alloc(pools, size);
+}
+
+/* Copies the totals per role, including the instances that are still
+   live.  The counts of live instances are read while they may still
+   change. */
+void
+mathmap_pools_get_statistics (pools_role_statistics_t stats[NUM_POOLS_ROLES])
+{
+    int i;
+
+    g_static_mutex_lock(&pools_statistics_mutex);
+    memcpy(stats, pools_role_statistics, sizeof(pools_role_statistics));
+    for (i = 0; i < POOLS_INSTANCE_SLOTS; ++i)
+	if (pools_instance_slots[i].pools != NULL && pools_instance_slots[i].pools != POOLS_INSTANCE_TOMBSTONE)
+	    add_instance_to_statistics(&stats[pools_instance_slots[i].instance.role],
+				       &pools_instance_slots[i].instance);
+    g_static_mutex_unlock(&pools_statistics_mutex);
+}
+
+void
+mathmap_pools_print_statistics (FILE *out)
+{
+    pools_role_statistics_t stats[NUM_POOLS_ROLES];
+    int i;
+
+    mathmap_pools_get_statistics(stats);
+
+    fprintf(out, "%-12s %10s %12s %14s %14s %8s %12s\n",
+	    "pools", "instances", "allocs", "requested", "reserved*", "growths*", "high water");
+    for (i = 0; i < NUM_POOLS_ROLES; ++i)
+	if (stats[i].num_instances > 0)
+	    fprintf(out, "%-12s %10" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT " %14" G_GUINT64_FORMAT
+		    " %14" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT "\n",
+		    pools_role_names[i], stats[i].num_instances, stats[i].num_allocs, stats[i].bytes_requested,
+		    stats[i].bytes_reserved, stats[i].num_growths, stats[i].high_water);
+    fprintf(out, "* estimated from the allocator's pool sizes, except for the compiler\n");
+
+    if (stats[POOLS_ROLE_PIXEL].num_allocs > 0)
+	fprintf(out, "warning: %" G_GUINT64_FORMAT " allocations (%" G_GUINT64_FORMAT " bytes) were made per pixel\n",
+		stats[POOLS_ROLE_PIXEL].num_allocs, stats[POOLS_ROLE_PIXEL].bytes_requested);
+}
+
+/*** tracing ***/
+
+/* A trace records spans of time in Chrome's trace event format, for
+   chrome://tracing or Perfetto.  Spans are timed by the caller with
+   mathmap_trace_begin() and written as complete events by
+   mathmap_trace_end().  Each thread gets a small number of its own as
+   its thread id. */
+
+static FILE *trace_file = NULL;
+static double trace_epoch;
+static gboolean trace_have_events;
+static GStaticMutex trace_mutex = G_STATIC_MUTEX_INIT;
+static int trace_num_threads = 0;
+
+static MATHMAP_THREAD_LOCAL int trace_thread_id = 0;
+
+gboolean
+mathmap_trace_open (const char *filename)
+{
+    static gboolean close_registered = FALSE;
+
+    g_assert(trace_file == NULL);
+
+    trace_file = fopen(filename, "w");
+    if (trace_file == NULL)
+	return FALSE;
+
+    fprintf(trace_file, "{\"traceEvents\":[");
+    trace_epoch = mathmap_wall_time();
+    trace_have_events = FALSE;
+
+    if (!close_registered)
+    {
+	atexit(mathmap_trace_close);
+	close_registered = TRUE;
+    }
+
+    return TRUE;
+}
+
+void
+mathmap_trace_close (void)
+{
+    g_static_mutex_lock(&trace_mutex);
+    if (trace_file != NULL)
+    {
+	fprintf(trace_file, "\n]}\n");
+	fclose(trace_file);
+	trace_file = NULL;
+    }
+    g_static_mutex_unlock(&trace_mutex);
+}
+
+/* NAME and CATEGORY are not escaped. */
+static void
+trace_write_event (const char *phase, const char *name, const char *category, double start, double duration)
+{
+    g_static_mutex_lock(&trace_mutex);
+
+    if (trace_file != NULL)
+    {
+	if (trace_thread_id == 0)
+	    trace_thread_id = ++trace_num_threads;
+
+	fprintf(trace_file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.0f",
+		trace_have_events ? "," : "", name, category, phase, (int)getpid(), trace_thread_id,
+		(start - trace_epoch) * 1000000.0);
+	if (duration >= 0.0)
+	    fprintf(trace_file, ",\"dur\":%.0f", duration * 1000000.0);
+	else
+	    fprintf(trace_file, ",\"s\":\"t\"");
+	fputc('}', trace_file);
+
+	trace_have_events = TRUE;
+    }
+
+    g_static_mutex_unlock(&trace_mutex);
+}
+
+/* Returns the start time of a span, or 0 if no trace is being
+   recorded, in which case mathmap_trace_end() won't record it. */
+CALLBACK_SYMBOL double
+mathmap_trace_begin (void)
+{
+    if (G_LIKELY(trace_file == NULL))
+	return 0.0;
+
+    return mathmap_wall_time();
+}
+
+CALLBACK_SYMBOL void
+mathmap_trace_end (const char *name, const char *category, double start)
+{
+    if (G_LIKELY(trace_file == NULL) || start == 0.0)
+	return;
+
+    trace_write_event("X", name, category, start, mathmap_wall_time() - start);
+}
+
+void
+mathmap_trace_instant (const char *name, const char *category)
+{
+    if (G_LIKELY(trace_file == NULL))
+	return;
+
+    trace_write_event("i", name, category, mathmap_wall_time(), -1.0);
+}
+
+/*** profiling ***/
+
+/* Code compiled for profiling adds the ticks each statement takes to
+   a counter for its source region.  Every thread gets its own set of
+   counters, so the counting itself doesn't synchronize.  A profiling
+   session started by mathmap_profile_start() makes the threads
+   allocate fresh counters, which stay around after the threads exit
+   until the next session starts. */
+
+typedef struct _profile_block_t
+{
+    profile_counter_t *counters;
+    struct _profile_block_t *next;
+} profile_block_t;
+
+static GStaticMutex profile_mutex = G_STATIC_MUTEX_INIT;
+static profile_block_t *profile_blocks = NULL;
+static int profile_num_regions = 0;
+static volatile int profile_session = 0;
+
+static MATHMAP_THREAD_LOCAL profile_counter_t *thread_profile_counters = NULL;
+static MATHMAP_THREAD_LOCAL int thread_profile_session = 0;
+
+static void
+free_profile_blocks (void)
+{
+    while (profile_blocks != NULL)
+    {
+	profile_block_t *next = profile_blocks->next;
+
+	g_free(profile_blocks->counters);
+	g_free(profile_blocks);
+	profile_blocks = next;
+    }
+}
+
+/* Resets the counters for renders of MATHMAP, which must have been
+   compiled for profiling. */
+void
+mathmap_profile_start (mathmap_t *mathmap)
+{
+    g_assert(mathmap->profile_regions != NULL);
+
+    g_static_mutex_lock(&profile_mutex);
+    free_profile_blocks();
+    profile_num_regions = mathmap->profile_regions->num_regions;
+    ++profile_session;
+    g_static_mutex_unlock(&profile_mutex);
+}
+
+CALLBACK_SYMBOL profile_counter_t*
+mathmap_profile_counters (void)
+{
+    if (G_UNLIKELY(thread_profile_session != profile_session))
+    {
+	profile_block_t *block = g_new(profile_block_t, 1);
+
+	g_static_mutex_lock(&profile_mutex);
+	/* at least one counter so that the pointer is never NULL */
+	block->counters = g_new0(profile_counter_t, MAX(profile_num_regions, 1));
+	block->next = profile_blocks;
+	profile_blocks = block;
+	thread_profile_counters = block->counters;
+	thread_profile_session = profile_session;
+	g_static_mutex_unlock(&profile_mutex);
+    }
+
+    return thread_profile_counters;
+}
+
+/* Only used on architectures without a cycle counter. */
+CALLBACK_SYMBOL unsigned long long
+mathmap_profile_ticks (void)
+{
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Sums up the counters of all threads into a new array with one
+   counter per region of MATHMAP. */
+static profile_counter_t*
+collect_profile_counters (mathmap_t *mathmap)
+{
+    int num_regions = mathmap->profile_regions->num_regions;
+    profile_counter_t *sums = g_new0(profile_counter_t, MAX(num_regions, 1));
+    profile_block_t *block;
+    int i;
+
+    g_static_mutex_lock(&profile_mutex);
+    g_assert(num_regions == profile_num_regions);
+    for (block = profile_blocks; block != NULL; block = block->next)
+	for (i = 0; i < num_regions; ++i)
+	{
+	    sums[i].count += block->counters[i].count;
+	    sums[i].cycles += block->counters[i].cycles;
+	}
+    g_static_mutex_unlock(&profile_mutex);
+
+    return sums;
+}
+
+static int
+compare_profile_spots (gconstpointer _a, gconstpointer _b, gpointer data)
+{
+    profile_counter_t *sums = (profile_counter_t*)data;
+    int a = *(const int*)_a, b = *(const int*)_b;
+
+    if (sums[a].cycles > sums[b].cycles)
+	return -1;
+    if (sums[a].cycles < sums[b].cycles)
+	return 1;
+    return a - b;
+}
+
+/* Finds the source region that took the most ticks in the renders
+   since the profiling session started. */
+gboolean
+mathmap_profile_hottest_region (mathmap_t *mathmap, scanner_region_t *region)
+{
+    profile_counter_t *sums;
+    int i, hottest = -1;
+
+    if (mathmap->profile_regions == NULL)
+	return FALSE;
+
+    sums = collect_profile_counters(mathmap);
+    for (i = 0; i < mathmap->profile_regions->num_regions; ++i)
+	if (sums[i].cycles > 0 && (hottest < 0 || sums[i].cycles > sums[hottest].cycles))
+	    hottest = i;
+    g_free(sums);
+
+    if (hottest < 0)
+	return FALSE;
+
+    *region = mathmap->profile_regions->regions[hottest];
+    return TRUE;
+}
+
+/* Prints the MAX_SPOTS source regions of MATHMAP, compiled from
+   SOURCE, that took the most ticks, with their share of the total.
+   The ticks of a region don't include those of the subexpressions it
+   contains. */
+void
+mathmap_profile_print_hot_spots (mathmap_t *mathmap, const char *source, FILE *out, int max_spots)
+{
+    int num_regions = mathmap->profile_regions->num_regions;
+    profile_counter_t *sums = collect_profile_counters(mathmap);
+    int *order = g_new(int, MAX(num_regions, 1));
+    unsigned long long total = 0;
+    int i;
+
+    for (i = 0; i < num_regions; ++i)
+    {
+	order[i] = i;
+	total += sums[i].cycles;
+    }
+    g_qsort_with_data(order, num_regions, sizeof(int), compare_profile_spots, sums);
+
+    fprintf(out, "%6s %14s %12s %8s  %-11s %s\n", "%", "ticks", "count", "ticks/op", "region", "source");
+    for (i = 0; i < MIN(num_regions, max_spots); ++i)
+    {
+	profile_counter_t *sum = &sums[order[i]];
+	scanner_region_t *region = &mathmap->profile_regions->regions[order[i]];
+	char position[32], snippet[41];
+	int length = CLAMP(region->end.pos - region->start.pos, 0, (int)sizeof(snippet) - 1);
+	int j;
+
+	if (sum->cycles == 0)
+	    break;
+
+	g_snprintf(position, sizeof(position), "%d:%d-%d:%d",
+		   region->start.row, region->start.column, region->end.row, region->end.column);
+
+	memcpy(snippet, source + region->start.pos, length);
+	snippet[length] = '\0';
+	for (j = 0; j < length; ++j)
+	    if (snippet[j] == '\n' || snippet[j] == '\t')
+		snippet[j] = ' ';
+
+	fprintf(out, "%6.2f %14llu %12llu %8.1f  %-11s %s\n",
+		total > 0 ? 100.0 * sum->cycles / total : 0.0,
+		sum->cycles, sum->count,
+		sum->count > 0 ? (double)sum->cycles / sum->count : 0.0,
+		position, snippet);
+    }
+
+    g_free(order);
+    g_free(sums);
+}
+
 void
 carry_over_uservals_from_template (mathmap_invocation_t *invocation, mathmap_invocation_t *template,
 				   gboolean copy_first_image)
@@ -1143,6 +2992,7 @@ carry_over_uservals_from_template (mathmap_invocation_t *invocation, mathmap_inv
     }
 }
 
+#ifndef MATHMAP_STANDALONE
 #define MAX_TEMPLATE_VAR_LENGTH       64
 #define is_word_character(c)          (isalnum((c)) || (c) == '_')
 
@@ -1269,6 +3119,7 @@ process_template_file (mathmap_t *mathmap, char *template_filename, FILE *out,
 
     return TRUE;
 }
+#endif
 
 int
 get_num_cpus (void)
@@ -1300,6 +3151,7 @@ get_num_cpus (void)
     return num_cpus;
 }
 
+#ifndef MATHMAP_STANDALONE
 designer_design_type_t*
 make_mathmap_design_type (void)
 {
@@ -1494,6 +3346,7 @@ design_type_from_expression_db (expression_db_t **edb)
 
     return type;
 }
+#endif
 
 void
 init_gettext (void)
@@ -32,36 +32,36 @@
 #include "native-filters.h"
 
 static void
-copy (double *dest, float *src, int n)
+copy (double *dest, image_t *src, int offset, int channel, int n)
 {
     int i;
 
     for (i = 0; i < n; ++i)
-	dest[i] = src[i * NUM_FLOATMAP_CHANNELS];
+	dest[i] = FLOATMAP_GET_I(src, offset + i, channel);
 }
 
 static double
-copy_and_add (double *dest, float *src, int n)
+copy_and_add (double *dest, image_t *src, int offset, int channel, int n)
 {
     int half;
 
     if (n <= 0)
 	return 0.0;
     if (n == 1)
-	return dest[0] = src[0];
+	return dest[0] = FLOATMAP_GET_I(src, offset, channel);
     if (n == 2)
     {
 	double d1, d2;
 
-	d1 = dest[0] = src[0];
-	d2 = dest[1] = src[NUM_FLOATMAP_CHANNELS];
+	d1 = dest[0] = FLOATMAP_GET_I(src, offset, channel);
+	d2 = dest[1] = FLOATMAP_GET_I(src, offset + 1, channel);
 
 	return d1 + d2;
     }
 
     half = n / 2;
-    return copy_and_add(dest, src, half)
-	+ copy_and_add(dest + half, src + half * NUM_FLOATMAP_CHANNELS, n - half);
+    return copy_and_add(dest, src, offset, channel, half)
+	+ copy_and_add(dest + half, src, offset + half, channel, n - half);
 }
 
 CALLBACK_SYMBOL
@@ -81,18 +81,27 @@ native_filter_convolve (mathmap_invocation_t *invocation, userval_t *args, mathm
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_convolve);
     if (cache_entry->image != NULL)
+    {
+	mathmap_trace_instant("native filter cache hit", "cache");
 	return cache_entry->image;
+    }
+    mathmap_trace_instant("native filter cache miss", "cache");
 
+    if (in_image->type == IMAGE_TILED_FLOATMAP)
+	in_image = tiled_floatmap_flatten(invocation, in_image, invocation->floatmap_layout, pools);
     if (in_image->type != IMAGE_FLOATMAP)
 	in_image = render_image(invocation, in_image,
 				invocation->render_width, invocation->render_height, pools, TRUE);
+    if (filter_image->type == IMAGE_TILED_FLOATMAP)
+	filter_image = tiled_floatmap_flatten(invocation, filter_image, invocation->floatmap_layout, pools);
     if (filter_image->type != IMAGE_FLOATMAP
 	|| filter_image->pixel_width != in_image->pixel_width
 	|| filter_image->pixel_height != in_image->pixel_height)
 	filter_image = render_image(invocation, filter_image,
 				    in_image->pixel_width, in_image->pixel_height, pools, TRUE);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc_with_layout(in_image->pixel_width, in_image->pixel_height,
+					  FLOATMAP_LAYOUT_INTERLEAVED, &invocation->pools);
 
     n = in_image->pixel_height * in_image->pixel_width;
     nhalf = in_image->pixel_width * (in_image->pixel_height / 2) + in_image->pixel_width / 2;
@@ -120,18 +129,14 @@ native_filter_convolve (mathmap_invocation_t *invocation, userval_t *args, mathm
     {
 	// FFT of input image
 	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
+	    fftw_in[i] = FLOATMAP_GET_I(in_image, i, channel);
 	fftw_execute(in_plan);
 
 	// FFT of kernel image
 	if (normalize)
 	{
-	    double d1 = copy_and_add(fftw_in,
-				     filter_image->v.floatmap.data + channel + (n - nhalf) * NUM_FLOATMAP_CHANNELS,
-				     nhalf);
-	    double d2 = copy_and_add(fftw_in + nhalf,
-				     filter_image->v.floatmap.data + channel,
-				     n - nhalf);
+	    double d1 = copy_and_add(fftw_in, filter_image, n - nhalf, channel, nhalf);
+	    double d2 = copy_and_add(fftw_in + nhalf, filter_image, 0, channel, n - nhalf);
 	    double factor = 1.0 / (d1 + d2);
 
 	    for (i = 0; i < n; ++i)
@@ -139,8 +144,8 @@ native_filter_convolve (mathmap_invocation_t *invocation, userval_t *args, mathm
 	}
 	else
 	{
-	    copy(fftw_in, filter_image->v.floatmap.data + channel + (n - nhalf) * NUM_FLOATMAP_CHANNELS, nhalf);
-	    copy(fftw_in + nhalf, filter_image->v.floatmap.data + channel, n - nhalf);
+	    copy(fftw_in, filter_image, n - nhalf, channel, nhalf);
+	    copy(fftw_in + nhalf, filter_image, 0, channel, n - nhalf);
 	}
 	fftw_execute(filter_plan);
 
@@ -151,14 +156,13 @@ native_filter_convolve (mathmap_invocation_t *invocation, userval_t *args, mathm
 	// reverse FFT
 	fftw_execute(inverse_plan);
 	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel] = fftw_in[i] / n;
+	    FLOATMAP_SET_I(out_image, i, channel, fftw_in[i] / n);
     }
 
     // copy alpha channel
     if (copy_alpha)
 	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3]
-		= in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3];
+	    FLOATMAP_SET_I(out_image, i, 3, FLOATMAP_GET_I(in_image, i, 3));
 
     fftw_destroy_plan(in_plan);
     fftw_destroy_plan(filter_plan);
@@ -189,18 +193,27 @@ native_filter_half_convolve (mathmap_invocation_t *invocation, userval_t *args,
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_half_convolve);
     if (cache_entry->image != NULL)
+    {
+	mathmap_trace_instant("native filter cache hit", "cache");
 	return cache_entry->image;
+    }
+    mathmap_trace_instant("native filter cache miss", "cache");
 
+    if (in_image->type == IMAGE_TILED_FLOATMAP)
+	in_image = tiled_floatmap_flatten(invocation, in_image, invocation->floatmap_layout, pools);
     if (in_image->type != IMAGE_FLOATMAP)
 	in_image = render_image(invocation, in_image,
 				invocation->render_width, invocation->render_height, pools, TRUE);
+    if (filter_image->type == IMAGE_TILED_FLOATMAP)
+	filter_image = tiled_floatmap_flatten(invocation, filter_image, invocation->floatmap_layout, pools);
     if (filter_image->type != IMAGE_FLOATMAP
 	|| filter_image->pixel_width != in_image->pixel_width
 	|| filter_image->pixel_height != in_image->pixel_height)
 	filter_image = render_image(invocation, filter_image,
 				    in_image->pixel_width, in_image->pixel_height, pools, TRUE);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc_with_layout(in_image->pixel_width, in_image->pixel_height,
+					  FLOATMAP_LAYOUT_INTERLEAVED, &invocation->pools);
 
     n = in_image->pixel_height * in_image->pixel_width;
     nhalf = in_image->pixel_width * (in_image->pixel_height / 2) + in_image->pixel_width / 2;
@@ -225,7 +238,7 @@ native_filter_half_convolve (mathmap_invocation_t *invocation, userval_t *args,
     {
 	// FFT of input image
 	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
+	    fftw_in[i] = FLOATMAP_GET_I(in_image, i, channel);
 	fftw_execute(in_plan);
 
 	// multiply in frequency domain
@@ -240,20 +253,19 @@ native_filter_half_convolve (mathmap_invocation_t *invocation, userval_t *args,
 		if (in_idx >= n)
 		    in_idx -= n;
 
-		image_out[x + y * cw] *= filter_image->v.floatmap.data[in_idx * NUM_FLOATMAP_CHANNELS + channel];
+		image_out[x + y * cw] *= FLOATMAP_GET_I(filter_image, in_idx, channel);
 	    }
 
 	// reverse FFT
 	fftw_execute(inverse_plan);
 	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel] = fftw_in[i] / n;
+	    FLOATMAP_SET_I(out_image, i, channel, fftw_in[i] / n);
     }
 
     // copy alpha channel
     if (copy_alpha)
 	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3]
-		= in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3];
+	    FLOATMAP_SET_I(out_image, i, 3, FLOATMAP_GET_I(in_image, i, 3));
 
     fftw_destroy_plan(in_plan);
     fftw_destroy_plan(inverse_plan);
@@ -282,13 +294,20 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_visualize_fft);
     if (cache_entry->image != NULL)
+    {
+	mathmap_trace_instant("native filter cache hit", "cache");
 	return cache_entry->image;
+    }
+    mathmap_trace_instant("native filter cache miss", "cache");
 
+    if (in_image->type == IMAGE_TILED_FLOATMAP)
+	in_image = tiled_floatmap_flatten(invocation, in_image, invocation->floatmap_layout, pools);
     if (in_image->type != IMAGE_FLOATMAP)
 	in_image = render_image(invocation, in_image,
 				invocation->render_width, invocation->render_height, pools, TRUE);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc_with_layout(in_image->pixel_width, in_image->pixel_height,
+					  FLOATMAP_LAYOUT_INTERLEAVED, &invocation->pools);
 
     n = in_image->pixel_height * in_image->pixel_width;
     sqrtn = sqrt(n);
@@ -313,7 +332,7 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
     {
 	// FFT of input image
 	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
+	    fftw_in[i] = FLOATMAP_GET_I(in_image, i, channel);
 	fftw_execute(in_plan);
 
 	// multiply in frequency domain
@@ -332,10 +351,8 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
 		int out_x2 = x + in_image->pixel_width - cw;
 		double val = cabs(image_out[x + y * cw]) / sqrtn;
 
-		out_image->v.floatmap.data[(out_x1 + out_y * in_image->pixel_width) * NUM_FLOATMAP_CHANNELS + channel]
-		    = val;
-		out_image->v.floatmap.data[(out_x2 + out_y * in_image->pixel_width) * NUM_FLOATMAP_CHANNELS + channel]
-		    = val;
+		FLOATMAP_SET_I(out_image, out_x1 + out_y * in_image->pixel_width, channel, val);
+		FLOATMAP_SET_I(out_image, out_x2 + out_y * in_image->pixel_width, channel, val);
 	    }
 	}
     }
@@ -343,7 +360,7 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
     // set alpha channel
     if (ignore_alpha)
 	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3] = 1.0;
+	    FLOATMAP_SET_I(out_image, i, 3, 1.0);
 
     fftw_destroy_plan(in_plan);
 
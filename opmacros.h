@@ -28,6 +28,14 @@
 /* gsl now libgslcblas 
  * #include <gsl/gsl_version.h> */
 
+#ifdef MATHMAP_FAST_MATH
+#include "fastmath.h"
+
+/* In the fast precision mode the code generator calls the float
+   approximations from fastmath.h instead of the double precision
+   library functions.  The helpers below keep using the library. */
+#endif
+
 #define NOP()                 (0.0)
 
 #define INT2FLOAT(x)          ((float)(x))
@@ -40,8 +48,13 @@
 #define NEG(a)                (-(a))
 #define MUL(a,b)              ((a)*(b))
 #define DIV(a,b)              ((float)(a)/(float)(b))
+#ifdef MATHMAP_FAST_MATH
+#define MOD(a,b)              (fmodf((a),(b)))
+#define GAMMA(a)              (((a) > 171.0) ? 0.0 : fast_gammaf((a)))
+#else
 #define MOD(a,b)              (fmod((a),(b)))
 #define GAMMA(a)              (((a) > 171.0) ? 0.0 : gsl_sf_gamma((a)))
+#endif
 #define EQ(a,b)               ((a)==(b))
 #define LESS(a,b)             ((a)<(b))
 #define LEQ(a,b)              ((a)<=(b))
@@ -63,43 +76,192 @@
 
 #define COMPLEX(r,i)          ((r) + (i) * I)
 
-// matrices
-#define MAKE_GSL_M2X2(m)             ({ float *mm = (m); gsl_matrix *gm = gsl_matrix_alloc(2,2); \
-                                        gsl_matrix_set(gm,0,0,mm[0]); gsl_matrix_set(gm,0,1,mm[1]); \
-					gsl_matrix_set(gm,1,0,mm[2]); gsl_matrix_set(gm,1,1,mm[3]); gm; })
-#define MAKE_GSL_M3X3(m)             ({ float *mm = (m); gsl_matrix *m = gsl_matrix_alloc(3,3); \
-                                        gsl_matrix_set(m,0,0,mm[0]); gsl_matrix_set(m,0,1,mm[1]); gsl_matrix_set(m,0,2,mm[2]); \
-                                        gsl_matrix_set(m,1,0,mm[3]); gsl_matrix_set(m,1,1,mm[4]); gsl_matrix_set(m,1,2,mm[5]); \
-                                        gsl_matrix_set(m,2,0,mm[6]); gsl_matrix_set(m,2,1,mm[7]); gsl_matrix_set(m,2,2,mm[8]); m; })
-#define FREE_MATRIX(m)        (gsl_matrix_free((m)), 0)
-
-// vectors
-#define MAKE_GSL_V2(_mv)      ({ float *mv = (_mv); gsl_vector *gv = gsl_vector_alloc(2); \
-				 gsl_vector_set(gv,0,mv[0]); gsl_vector_set(gv,1,mv[1]); gv; })
-#define MAKE_GSL_V3(_mv)      ({ float *mv = (_mv); gsl_vector *gv = gsl_vector_alloc(3); \
-				 gsl_vector_set(gv,0,mv[0]); gsl_vector_set(gv,1,mv[1]); gsl_vector_set(gv,2,mv[2]); gv; })
-#define FREE_GSL_VECTOR(gv)   (gsl_vector_free((gv)), 0)
+// small linear algebra
+/* Matrices are row-major tuples.  All of this works on the stack, so
+   the generated code doesn't allocate anything per pixel apart from
+   the result tuple.  Singular systems are solved as zero; roots that
+   don't exist are NaN. */
+static inline double
+matrix_det_2 (const float *m)
+{
+    return (double)m[0] * m[3] - (double)m[1] * m[2];
+}
+
+static inline int
+matrix_invert_3 (const float *m, float *r)
+{
+    double c[9];
+    double det;
+    int i;
+
+    c[0] = (double)m[4] * m[8] - (double)m[5] * m[7];
+    c[1] = (double)m[2] * m[7] - (double)m[1] * m[8];
+    c[2] = (double)m[1] * m[5] - (double)m[2] * m[4];
+    c[3] = (double)m[5] * m[6] - (double)m[3] * m[8];
+    c[4] = (double)m[0] * m[8] - (double)m[2] * m[6];
+    c[5] = (double)m[2] * m[3] - (double)m[0] * m[5];
+    c[6] = (double)m[3] * m[7] - (double)m[4] * m[6];
+    c[7] = (double)m[1] * m[6] - (double)m[0] * m[7];
+    c[8] = (double)m[0] * m[4] - (double)m[1] * m[3];
+
+    det = m[0] * c[0] + m[1] * c[3] + m[2] * c[6];
+    for (i = 0; i < 9; ++i)
+	r[i] = det == 0.0 ? 0.0 : c[i] / det;
+    return det != 0.0;
+}
+
+static inline int
+solve_linear_2 (const float *m, const float *v, float *r)
+{
+    double det = matrix_det_2(m);
+
+    if (det == 0.0)
+    {
+	r[0] = r[1] = 0.0;
+	return 0;
+    }
+    /* Cramer's rule */
+    r[0] = ((double)v[0] * m[3] - (double)m[1] * v[1]) / det;
+    r[1] = ((double)m[0] * v[1] - (double)v[0] * m[2]) / det;
+    return 1;
+}
+
+static inline int
+solve_linear_3 (const float *m, const float *v, float *r)
+{
+    float inv[9];
+    int i;
+
+    if (!matrix_invert_3(m, inv))
+    {
+	r[0] = r[1] = r[2] = 0.0;
+	return 0;
+    }
+    for (i = 0; i < 3; ++i)
+	r[i] = (double)inv[i * 3] * v[0] + (double)inv[i * 3 + 1] * v[1] + (double)inv[i * 3 + 2] * v[2];
+    return 1;
+}
+
+/* Real roots of a*x^2 + b*x + c, in ascending order. */
+static inline int
+solve_poly_2 (double a, double b, double c, float *r)
+{
+    double disc, q, x1, x2;
+
+    r[0] = r[1] = NAN;
+    if (a == 0.0)
+    {
+	if (b == 0.0)
+	    return 0;
+	r[0] = -c / b;
+	return 1;
+    }
+
+    disc = b * b - 4.0 * a * c;
+    if (disc < 0.0)
+	return 0;
+
+    /* avoids cancellation between b and the root */
+    q = -0.5 * (b + (b < 0.0 ? -sqrt(disc) : sqrt(disc)));
+    if (q == 0.0)
+    {
+	r[0] = r[1] = 0.0;
+	return 2;
+    }
+    x1 = q / a;
+    x2 = c / q;
+    r[0] = MIN(x1, x2);
+    r[1] = MAX(x1, x2);
+    return 2;
+}
+
+/* Real roots of a*x^3 + b*x^2 + c*x + d, in ascending order. */
+static inline int
+solve_poly_3 (double a, double b, double c, double d, float *r)
+{
+    double q, rr, q3, shift;
+
+    if (a == 0.0)
+    {
+	r[2] = NAN;
+	return solve_poly_2(b, c, d, r);
+    }
+
+    r[0] = r[1] = r[2] = NAN;
+    b /= a;
+    c /= a;
+    d /= a;
+
+    q = (b * b - 3.0 * c) / 9.0;
+    rr = (2.0 * b * b * b - 9.0 * b * c + 27.0 * d) / 54.0;
+    q3 = q * q * q;
+    shift = b / 3.0;
+
+    if (rr * rr < q3)
+    {
+	double theta = acos(rr / sqrt(q3));
+	double sq = -2.0 * sqrt(q);
+	double x0 = sq * cos(theta / 3.0) - shift;
+	double x1 = sq * cos((theta + 2.0 * M_PI) / 3.0) - shift;
+	double x2 = sq * cos((theta - 2.0 * M_PI) / 3.0) - shift;
+	double tmp;
+
+	if (x0 > x1) { tmp = x0; x0 = x1; x1 = tmp; }
+	if (x1 > x2) { tmp = x1; x1 = x2; x2 = tmp; }
+	if (x0 > x1) { tmp = x0; x0 = x1; x1 = tmp; }
+
+	r[0] = x0;
+	r[1] = x1;
+	r[2] = x2;
+	return 3;
+    }
+    else
+    {
+	double s = -cbrt(fabs(rr) + sqrt(rr * rr - q3));
+	double u, x0, x1;
+
+	if (rr < 0.0)
+	    s = -s;
+	u = s == 0.0 ? 0.0 : q / s;
+	x0 = s + u - shift;
+
+	/* with a zero discriminant the other two roots are the same */
+	if (s == 0.0 || rr * rr - q3 > 1e-9 * q3)
+	{
+	    r[0] = x0;
+	    return 1;
+	}
+
+	x1 = -0.5 * (s + u) - shift;
+	r[0] = MIN(x0, x1);
+	r[1] = MAX(x0, x1);
+	return 2;
+    }
+}
+
 #define VECTOR_NTH(i,vec)     ((vec).v[(int)(i)])
 
 // solvers
-#define SOLVE_LINEAR_2(mm,mv) ({ gsl_vector *gv = MAKE_GSL_V2((mv)); gsl_matrix *gm = MAKE_GSL_M2X2((mm)); \
-	    			 gsl_vector *gr = gsl_vector_alloc(2); gsl_linalg_HH_solve(gm,gv,gr); \
-				 float *r = ALLOC_TUPLE(2); \
-				 r[0] = gsl_vector_get(gr, 0); \
-				 r[1] = gsl_vector_get(gr, 1); \
-				 FREE_GSL_VECTOR(gv); FREE_GSL_VECTOR(gr); FREE_MATRIX(gm); r; })
-#define SOLVE_LINEAR_3(mm,mv) ({ gsl_vector *gv = MAKE_GSL_V3((mv)); gsl_matrix *gm = MAKE_GSL_M3X3((mm)); \
-	    			 gsl_vector *gr = gsl_vector_alloc(3); gsl_linalg_HH_solve(gm,gv,gr); \
-				 float *r = ALLOC_TUPLE(3); \
-				 r[0] = gsl_vector_get(gr, 0); \
-				 r[1] = gsl_vector_get(gr, 1); \
-				 r[2] = gsl_vector_get(gr, 2); \
-				 FREE_GSL_VECTOR(gv); FREE_GSL_VECTOR(gr); FREE_MATRIX(gm); r; })
-/* FIXME: implement these! */
-#define SOLVE_POLY_2(a,b,c)   ALLOC_TUPLE(2)
-#define SOLVE_POLY_3(a,b,c,d) ALLOC_TUPLE(3)
+#define SOLVE_LINEAR_2(mm,mv) ({ float *r = ALLOC_TUPLE(2); solve_linear_2((mm), (mv), r); r; })
+#define SOLVE_LINEAR_3(mm,mv) ({ float *r = ALLOC_TUPLE(3); solve_linear_3((mm), (mv), r); r; })
+#define SOLVE_POLY_2(a,b,c)   ({ float *r = ALLOC_TUPLE(2); solve_poly_2((a), (b), (c), r); r; })
+#define SOLVE_POLY_3(a,b,c,d) ({ float *r = ALLOC_TUPLE(3); solve_poly_3((a), (b), (c), (d), r); r; })
 
 // elliptics
+#ifdef MATHMAP_FAST_MATH
+#define ELL_INT_K_COMP(k)     fast_ellint_Kcomp((k))
+#define ELL_INT_E_COMP(k)     fast_ellint_Ecomp((k))
+
+#define ELL_INT_F(phi,k)      fast_ellint_F((phi), (k))
+#define ELL_INT_E(phi,k)      fast_ellint_E((phi), (k))
+#define ELL_INT_P(phi,k,n)    fast_ellint_P((phi), (k), (n))
+#define ELL_INT_D(phi,k,n)    fast_ellint_D((phi), (k))
+
+#define ELL_INT_RC(x,y)       fast_ellint_rc((x), (y))
+#define ELL_INT_RD(x,y,z)     fast_ellint_rd((x), (y), (z))
+#define ELL_INT_RF(x,y,z)     fast_ellint_rf((x), (y), (z))
+#define ELL_INT_RJ(x,y,z,p)   fast_ellint_rj((x), (y), (z), (p))
+#else
 #define ELL_INT_K_COMP(k)     gsl_sf_ellint_Kcomp((k), GSL_PREC_SINGLE)
 #define ELL_INT_E_COMP(k)     gsl_sf_ellint_Ecomp((k), GSL_PREC_SINGLE)
 
@@ -112,6 +274,7 @@
 #define ELL_INT_RD(x,y,z)     gsl_sf_ellint_RD((x), (y), (z), GSL_PREC_SINGLE)
 #define ELL_INT_RF(x,y,z)     gsl_sf_ellint_RF((x), (y), (z), GSL_PREC_SINGLE)
 #define ELL_INT_RJ(x,y,z,p)   gsl_sf_ellint_RJ((x), (y), (z), (p), GSL_PREC_SINGLE)
+#endif
 
 #define ELL_JAC(u,m)	      ({ double sn, cn, dn; \
 				 gsl_sf_elljac_e((u), (m), &sn, &cn, &dn); \
@@ -121,7 +284,11 @@
 				 r[2] = dn; \
 				 r; })
 
-#define RAND(a,b)             (g_random_double_range((a), (b)))
+/* x, y and t are the coordinates of the filter being computed.  In
+   filters that use rand(), the code of every pixel starts with
+   RAND_BEGIN_PIXEL(). */
+#define RAND(a,b)             (mathmap_rand(invocation, x, y, t, (a), (b)))
+#define RAND_BEGIN_PIXEL()    ((void)mathmap_rand_begin())
 #define CLAMP01(x)            (MAX(0,MIN(1,(x))))
 
 #define USERVAL_INT_ACCESS(x)        (ARG((x)).v.int_const)
@@ -153,7 +320,15 @@
 #define CALC_VIRTUAL_X(pxl,size,sampl_off)	(((pxl) - ((size)-1)/2.0 + (sampl_off)) / (((size)-1)/2.0))
 #define CALC_VIRTUAL_Y(pxl,size,sampl_off)	((-(pxl) + ((size)-1)/2.0 - (sampl_off)) / (((size)-1)/2.0))
 
+/* The code of every pixel starts with POOLS_STATS_BEGIN_PIXEL(), with
+   the pixel pools as POOLS. */
+#ifdef MATHMAP_POOLS_STATISTICS
+#define POOLS_ALLOC(s)			(mathmap_pools_alloc_accounted(pools, (s)))
+#define POOLS_STATS_BEGIN_PIXEL()	(mathmap_pools_stats_begin_pixel(pools))
+#else
 #define POOLS_ALLOC(s)			(mathmap_pools_alloc(pools, (s)))
+#define POOLS_STATS_BEGIN_PIXEL()	((void)0)
+#endif
 #define ALLOC_CLOSURE_IMAGE(n)		({ image_t *image = (image_t*)(POOLS_ALLOC(sizeof(image_t) + (n) * sizeof(userval_t))); \
 	    				   image->type = IMAGE_CLOSURE; \
 					   image->id = image_new_id();	\
@@ -202,16 +377,44 @@
 				       y *= img->v.resize.y_factor;	\
 				       img = img->v.resize.original;	\
 				   }					\
-				   if (img->type == IMAGE_CLOSURE)	\
+				   if (img->type == IMAGE_CLOSURE) {	\
+				       guint32 outer_rand_count = mathmap_rand_begin(); \
 				       result = img->v.closure.func(invocation, img, (x), (y), (f), pools); \
+				       mathmap_rand_end(outer_rand_count); \
+				   }					\
 				   else if (img->type == IMAGE_FLOATMAP) \
 				       result = get_floatmap_pixel(invocation, img, (x), (y), (f)); \
+				   else if (img->type == IMAGE_TILED_FLOATMAP) \
+				       result = get_tiled_floatmap_pixel(invocation, img, (x), (y), (f), pools); \
 				   else {				\
 				       color_t color = get_orig_val_pixel_func(invocation, (x), (y), img, (f)); \
 				       result = TUPLE_FROM_COLOR(color); \
 				   }					\
 				   result; })
 
-#define RENDER(i,w,h)	      (render_image(invocation, (i), (w), (h), pools, 0))
+/* Profiling counters around each statement, see
+   mathmap_profile_counters() in mathmap_common.c. */
+#ifdef MATHMAP_PROFILING
+#if defined(__i386__) || defined(__x86_64__)
+#define PROFILE_TICKS()	      __builtin_ia32_rdtsc()
+#else
+#define PROFILE_TICKS()	      mathmap_profile_ticks()
+#endif
+#define PROFILE_BEGIN()	      unsigned long long __profile_start = PROFILE_TICKS()
+#define PROFILE_END(r)	      ({ unsigned long long __profile_end = PROFILE_TICKS(); \
+				 profile_counter_t *__counter = &mathmap_profile_counters()[(r)]; \
+				 __counter->cycles += __profile_end - __profile_start; \
+				 ++__counter->count; })
+#endif
+
+#define CALL_NATIVE_FILTER(n,c)	({ double __trace_start = mathmap_trace_begin(); \
+				   image_t *__image = (c); \
+				   mathmap_trace_end((n), "native", __trace_start); \
+				   __image; })
+
+#define RENDER(i,w,h)	      ({ image_t *img = (i); \
+				 img->type == IMAGE_CLOSURE \
+				     ? render_image_lazily(invocation, img, (w), (h), t, pools) \
+				     : render_image(invocation, img, (w), (h), pools, 0); })
 
 #endif
@@ -39,8 +39,11 @@
 #include "rwgif.h"
 #endif
 
+/* Formats that support it are decoded at a reduced size that is at
+   least MIN_WIDTH x MIN_HEIGHT.  The actual size is in the reader.  If
+   either minimum is not positive the image is read at full size. */
 image_reader_t*
-open_image_reading (const char *filename)
+open_image_reading_scaled (const char *filename, int min_width, int min_height)
 {
     unsigned char magic[4];
     FILE *file;
@@ -48,6 +51,7 @@ open_image_reading (const char *filename)
     int width, height;
     image_reader_t *reader;
     image_read_func_t read_func;
+    image_read_func_t read_rgba_func = 0;
     image_reader_free_func_t free_func;
 
     file = fopen(filename, "rb");
@@ -65,7 +69,7 @@ open_image_reading (const char *filename)
     if (memcmp(magic, "\xff\xd8", 2) == 0)
     {
 #ifdef RWIMG_JPEG
-	data = open_jpeg_file_reading(filename, &width, &height);
+	data = open_jpeg_file_reading(filename, min_width, min_height, &width, &height);
 	read_func = jpeg_read_lines;
 	free_func = jpeg_free_reader_data;
 #else
@@ -77,6 +81,7 @@ open_image_reading (const char *filename)
 #ifdef RWIMG_PNG
 	data = open_png_file_reading(filename, &width, &height);
 	read_func = png_read_lines;
+	read_rgba_func = png_read_rgba_lines;
 	free_func = png_free_reader_data;
 #else
 	return 0;
@@ -106,11 +111,18 @@ open_image_reading (const char *filename)
     reader->num_lines_read = 0;
     reader->data = data;
     reader->read_func = read_func;
+    reader->read_rgba_func = read_rgba_func;
     reader->free_func = free_func;
 
     return reader;
 }
 
+image_reader_t*
+open_image_reading (const char *filename)
+{
+    return open_image_reading_scaled(filename, 0, 0);
+}
+
 void
 read_lines (image_reader_t *reader, unsigned char *lines, int num_lines)
 {
@@ -120,6 +132,32 @@ read_lines (image_reader_t *reader, unsigned char *lines, int num_lines)
     reader->num_lines_read += num_lines;
 }
 
+/* Like read_lines(), but with four bytes per pixel, the last being
+   alpha.  Formats without alpha read as opaque. */
+void
+read_lines_rgba (image_reader_t *reader, unsigned char *lines, int num_lines)
+{
+    assert(reader->num_lines_read + num_lines <= reader->height);
+
+    if (reader->read_rgba_func != 0)
+	reader->read_rgba_func(reader->data, lines, num_lines);
+    else
+    {
+	int i;
+
+	/* expand in place, from the back */
+	reader->read_func(reader->data, lines, num_lines);
+	for (i = reader->width * num_lines - 1; i >= 0; --i)
+	{
+	    lines[i * 4 + 3] = 255;
+	    lines[i * 4 + 2] = lines[i * 3 + 2];
+	    lines[i * 4 + 1] = lines[i * 3 + 1];
+	    lines[i * 4 + 0] = lines[i * 3 + 0];
+	}
+    }
+    reader->num_lines_read += num_lines;
+}
+
 void
 free_image_reader (image_reader_t *reader)
 {
@@ -128,9 +166,9 @@ free_image_reader (image_reader_t *reader)
 }
 
 unsigned char*
-read_image (const char *filename, int *width, int *height)
+read_image_scaled (const char *filename, int min_width, int min_height, int *width, int *height)
 {
-    image_reader_t *reader = open_image_reading(filename);
+    image_reader_t *reader = open_image_reading_scaled(filename, min_width, min_height);
     unsigned char *data;
 
     if (reader == 0)
@@ -147,3 +185,27 @@ read_image (const char *filename, int *width, int *height)
 
     return data;
 }
+
+unsigned char*
+read_image (const char *filename, int *width, int *height)
+{
+    return read_image_scaled(filename, 0, 0, width, height);
+}
+
+/* Reads only as much of the file as is needed to determine the image
+   size.  Returns 0 if the file cannot be read. */
+int
+probe_image_size (const char *filename, int *width, int *height)
+{
+    image_reader_t *reader = open_image_reading(filename);
+
+    if (reader == 0)
+	return 0;
+
+    *width = reader->width;
+    *height = reader->height;
+
+    free_image_reader(reader);
+
+    return 1;
+}
@@ -35,13 +35,19 @@ typedef struct
     int num_lines_read;
     void *data;
     image_read_func_t read_func;
+    image_read_func_t read_rgba_func;	/* 0 if the format has no alpha */
     image_reader_free_func_t free_func;
 } image_reader_t;
 
 image_reader_t* open_image_reading (const char *filename);
+image_reader_t* open_image_reading_scaled (const char *filename, int min_width, int min_height);
 void read_lines (image_reader_t *reader, unsigned char *lines, int num_lines);
+void read_lines_rgba (image_reader_t *reader, unsigned char *lines, int num_lines);
 void free_image_reader (image_reader_t *reader);
 
 unsigned char* read_image (const char *filename, int *width, int *height);
+unsigned char* read_image_scaled (const char *filename, int min_width, int min_height,
+				  int *width, int *height);
+int probe_image_size (const char *filename, int *width, int *height);
 
 #endif
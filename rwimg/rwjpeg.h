@@ -26,7 +26,8 @@
 #ifndef __RWJPEG_H__
 #define __RWJPEG_H__
 
-void* open_jpeg_file_reading (const char *filename, int *width, int *height);
+void* open_jpeg_file_reading (const char *filename, int min_width, int min_height,
+			      int *width, int *height);
 void jpeg_read_lines (void *data, unsigned char *lines, int num_lines);
 void jpeg_free_reader_data (void *data);
 
@@ -100,10 +100,12 @@ open_png_file_reading (const char *filename, int *width, int *height)
     return data;
 }
 
-void
-png_read_lines (void *_data, unsigned char *lines, int num_lines)
+/* Reads NUM_LINES rows into LINES with PIXEL_STRIDE bytes per pixel,
+   which is 3 for RGB or 4 for RGBA.  Gray is expanded to RGB, and
+   images without alpha are opaque. */
+static void
+read_lines_with_stride (png_data_t *data, unsigned char *lines, int num_lines, int pixel_stride)
 {
-    png_data_t *data = (png_data_t*)_data;
     int i;
     int bps, spp;
     unsigned char *row;
@@ -112,6 +114,8 @@ png_read_lines (void *_data, unsigned char *lines, int num_lines)
     if (setjmp (png_jmpbuf (data->png_ptr)))
 	assert(0);
 
+    assert(pixel_stride == 3 || pixel_stride == 4);
+
     color_type = png_get_color_type (data->png_ptr, data->info_ptr);
     if (color_type == PNG_COLOR_TYPE_GRAY)
 	spp = 1;
@@ -139,12 +143,17 @@ png_read_lines (void *_data, unsigned char *lines, int num_lines)
 	if (spp <= 2)
 	    for (j = 0; j < width; ++j)
 		for (channel = 0; channel < 3; ++channel)
-		    lines[i * width * 3 + j * 3 + channel] = row[j * spp * bps];
+		    lines[(i * width + j) * pixel_stride + channel] = row[j * spp * bps];
 	else
 	    for (j = 0; j < width; ++j)
 		for (channel = 0; channel < 3; ++channel)
-		    lines[i * width * 3 + j * 3 + channel]
+		    lines[(i * width + j) * pixel_stride + channel]
 			= row[j * spp * bps + channel * bps];
+
+	if (pixel_stride == 4)
+	    for (j = 0; j < width; ++j)
+		lines[(i * width + j) * 4 + 3]
+		    = (spp == 2 || spp == 4) ? row[j * spp * bps + (spp - 1) * bps] : 255;
     }
 
     free(row);
@@ -152,6 +161,18 @@ png_read_lines (void *_data, unsigned char *lines, int num_lines)
     data->have_read = 1;
 }
 
+void
+png_read_lines (void *data, unsigned char *lines, int num_lines)
+{
+    read_lines_with_stride((png_data_t*)data, lines, num_lines, 3);
+}
+
+void
+png_read_rgba_lines (void *data, unsigned char *lines, int num_lines)
+{
+    read_lines_with_stride((png_data_t*)data, lines, num_lines, 4);
+}
+
 void
 png_free_reader_data (void *_data)
 {
@@ -27,6 +27,7 @@
 
 void* open_png_file_reading (const char *filename, int *width, int *height);
 void png_read_lines (void *data, unsigned char *lines, int num_lines);
+void png_read_rgba_lines (void *data, unsigned char *lines, int num_lines);
 void png_free_reader_data (void *data);
 
 void* open_png_file_writing (const char *filename, int width, int height, int pixel_stride, int row_stride);